@@ -0,0 +1,329 @@
+// p1g1B.c
+// Compile: gcc -O2 -pthread -o bench p1g1B.c
+// Run: ./bench <server-ip> [port] [options]
+// Example: ./bench 127.0.0.1 12345 --clients=8 --senders=2 --messages=20000
+//          ./bench 127.0.0.1 12345 --pingpong=5000 --clients=4
+//          ./bench 10.0.0.2 12345 --clients=8 --senders=2 --size=1000
+//
+// Load generator for the chat server. Every client logs in and reads the
+// broadcast; the senders also write MSG lines as fast as the socket takes
+// them. It reports how long it took until every client had every message.
+// With --pingpong, one client instead sends a message, waits for its own
+// broadcast and repeats, and the round-trip times are reported.
+// With --size, every message text is padded to that many bytes and the
+// payload rate is reported as well; sweep it from another host against
+// servers started with different --zerocopy-min values. Over loopback the
+// kernel copies zerocopy sends anyway, so such runs say nothing about it.
+// Run the server with its spam filter off (the default).
+
+// Include header files
+#include <stdio.h> // for printf, fprintf, etc.
+#include <stdlib.h> // for exit, atoi, etc.
+#include <string.h> // for memset, strlen, strcmp, etc.
+#include <unistd.h> // for close, read, write, etc.
+#include <errno.h> // for errno
+#include <pthread.h> // for pthreads
+#include <netinet/in.h> // for sockaddr_in
+#include <netinet/tcp.h> // for TCP_NODELAY
+#include <sys/socket.h> // for socket functions
+#include <arpa/inet.h> // for inet_pton
+#include <time.h> // for clock_gettime
+#include <sys/time.h> // for struct timeval
+
+#define DEFAULT_PORT 12345
+#define DEFAULT_PASSWORD "PleaseGiveUsExtraCredit:)"
+#define MAX_MESSAGE 1024
+#define READ_BUF 65536
+#define MAX_CLIENTS 1024
+#define IDLE_TIMEOUT_SEC 5 // A reader that hears nothing this long gives up
+
+/**
+ * @brief A connection with a buffered line reader.
+ */
+typedef struct bench_conn {
+    int fd;
+    int id;
+    char buf[READ_BUF];
+    size_t start, end; // unread bytes in buf
+    long received; // benchmark lines seen
+    double done_at; // time the last expected line arrived
+    pthread_t reader, writer;
+} bench_conn_t;
+
+static const char *server_ip = "127.0.0.1";
+static int port = DEFAULT_PORT;
+static const char *password = DEFAULT_PASSWORD;
+static int num_clients = 8; // --clients: connections that read the broadcast
+static int num_senders = 2; // --senders: how many of them also send
+static long num_messages = 10000; // --messages: messages per sender
+static long pingpong_rounds = 0; // --pingpong: round trips to time (0 = throughput run)
+static int payload_size = 0; // --size: pad each message text to this many bytes
+static double start_time; // when the senders were released
+
+/**
+ * @brief Returns a monotonic time in seconds.
+ */
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Sends all bytes in the buffer to the specified file descriptor.
+ *
+ * @return ssize_t The total number of bytes sent, or -1 on error.
+ */
+ssize_t send_all(int fd, const void *buf, size_t len) {
+    size_t total = 0;
+    const char *p = buf;
+    while (total < len) {
+        ssize_t n = send(fd, p + total, len - total, 0);
+        if (n <= 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/**
+ * @brief Reads the next line from a connection.
+ *
+ * @param c The connection.
+ * @return char* The line, NUL-terminated without its newline and valid until the next call, or NULL on EOF or error.
+ */
+char *read_line(bench_conn_t *c) {
+    for (;;) {
+        char *nl = memchr(c->buf + c->start, '\n', c->end - c->start);
+        if (nl) {
+            char *line = c->buf + c->start;
+            *nl = '\0';
+            c->start = nl + 1 - c->buf;
+            return line;
+        }
+        if (c->start > 0) {
+            memmove(c->buf, c->buf + c->start, c->end - c->start);
+            c->end -= c->start;
+            c->start = 0;
+        }
+        if (c->end == sizeof(c->buf)) c->end = 0; // an overlong line: drop it
+        ssize_t n = recv(c->fd, c->buf + c->end, sizeof(c->buf) - c->end, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return NULL;
+        c->end += n;
+    }
+}
+
+/**
+ * @brief Connects and logs in as bench<id>.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+int bench_login(bench_conn_t *c) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) != 1) return -1;
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = { .tv_sec = IDLE_TIMEOUT_SEC, .tv_usec = 0 };
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char out[256];
+    char *line = read_line(c);
+    if (!line || strncmp(line, "PASSWORD:", 9) != 0) return -1;
+    snprintf(out, sizeof(out), "PASS:%s\n", password);
+    if (send_all(c->fd, out, strlen(out)) < 0 || !(line = read_line(c)) || strcmp(line, "OKPASS") != 0) return -1;
+    snprintf(out, sizeof(out), "LOGIN:bench%d\n", c->id);
+    if (send_all(c->fd, out, strlen(out)) < 0 || !(line = read_line(c)) || strcmp(line, "OK") != 0) {
+        fprintf(stderr, "bench%d: login refused: %s\n", c->id, line ? line : "connection closed");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Formats the MSG line for message i of client id, padded to payload_size.
+ *
+ * @param out Output buffer of MAX_MESSAGE + 8 bytes.
+ * @return int The line length, newline included.
+ */
+int format_message(char *out, int id, long i) {
+    int len = snprintf(out, MAX_MESSAGE + 8, "MSG:B%d.%ld", id, i);
+    if (payload_size > len - 4) {
+        out[len++] = ' ';
+        while (len - 4 < payload_size) out[len++] = 'x';
+    }
+    out[len++] = '\n';
+    return len;
+}
+
+/**
+ * @brief Sender thread: writes num_messages MSG lines.
+ */
+void *writer_thread(void *arg) {
+    bench_conn_t *c = arg;
+    char out[MAX_MESSAGE + 8];
+    for (long i = 0; i < num_messages; i++) {
+        int len = format_message(out, c->id, i);
+        if (send_all(c->fd, out, len) < 0) {
+            perror("send");
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reader thread: counts benchmark lines until all have arrived.
+ */
+void *reader_thread(void *arg) {
+    bench_conn_t *c = arg;
+    long expect = num_messages * num_senders;
+    char *line;
+    while (c->received < expect && (line = read_line(c)) != NULL) {
+        // Broadcasts arrive as "<user>: <text>", possibly with an ACK-mode "#<seq>:" prefix
+        if (strstr(line, ": B")) c->received++;
+    }
+    c->done_at = now_sec();
+    return NULL;
+}
+
+/**
+ * @brief Parses the command line.
+ */
+void parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (strncmp(a, "--clients=", 10) == 0) {
+            num_clients = atoi(a + 10);
+        } else if (strncmp(a, "--senders=", 10) == 0) {
+            num_senders = atoi(a + 10);
+        } else if (strncmp(a, "--messages=", 11) == 0) {
+            num_messages = atol(a + 11);
+        } else if (strncmp(a, "--pingpong=", 11) == 0) {
+            pingpong_rounds = atol(a + 11);
+        } else if (strncmp(a, "--size=", 7) == 0) {
+            payload_size = atoi(a + 7);
+        } else if (strncmp(a, "--password=", 11) == 0) {
+            password = a + 11;
+        } else if (a[0] != '-' && i == 1) {
+            server_ip = a;
+        } else if (a[0] != '-' && i == 2) {
+            port = atoi(a);
+        } else {
+            fprintf(stderr, "Usage: %s <server-ip> [port] [options]\n", argv[0]);
+            fprintf(stderr, "  --clients=N     connections reading the broadcast (default 8)\n");
+            fprintf(stderr, "  --senders=N     how many of them also send (default 2)\n");
+            fprintf(stderr, "  --messages=N    messages per sender (default 10000)\n");
+            fprintf(stderr, "  --pingpong=N    time N round trips of one client instead (others just read)\n");
+            fprintf(stderr, "  --size=BYTES    pad each message text to BYTES\n");
+            fprintf(stderr, "  --password=PW   server password\n");
+            exit(1);
+        }
+    }
+    if (num_clients < 1) num_clients = 1;
+    if (num_clients > MAX_CLIENTS) num_clients = MAX_CLIENTS;
+    if (num_senders < 1) num_senders = 1;
+    if (num_senders > num_clients) num_senders = num_clients;
+    if (num_messages < 1) num_messages = 1;
+    if (payload_size > MAX_MESSAGE - 32) payload_size = MAX_MESSAGE - 32;
+    if (pingpong_rounds > 0) {
+        num_senders = 1; // the other readers expect one line per round
+        num_messages = pingpong_rounds;
+    }
+}
+
+/**
+ * @brief Orders doubles ascending (for qsort).
+ */
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Ping-pong run: bench0 sends one message at a time and waits for its own broadcast.
+ */
+int run_pingpong(bench_conn_t *conns) {
+    double *rtt = malloc(pingpong_rounds * sizeof(double));
+    if (!rtt) return 1;
+    for (int i = 1; i < num_clients; i++) pthread_create(&conns[i].reader, NULL, reader_thread, &conns[i]);
+
+    bench_conn_t *c = &conns[0];
+    long done = 0;
+    char out[MAX_MESSAGE + 8], want[MAX_MESSAGE + 16];
+    for (; done < pingpong_rounds; done++) {
+        int len = format_message(out, 0, done);
+        snprintf(want, sizeof(want), "bench0: %.*s", len - 5, out + 4);
+        double t = now_sec();
+        if (send_all(c->fd, out, len) < 0) break;
+        char *line;
+        while ((line = read_line(c)) != NULL && strcmp(line, want) != 0) {}
+        if (!line) break;
+        rtt[done] = (now_sec() - t) * 1e6;
+    }
+    for (int i = 1; i < num_clients; i++) pthread_join(conns[i].reader, NULL);
+
+    if (done > 0) {
+        double sum = 0;
+        for (long i = 0; i < done; i++) sum += rtt[i];
+        qsort(rtt, done, sizeof(double), cmp_double);
+        long p99 = (done * 99 + 99) / 100 - 1; // nearest-rank: ceil(done * 0.99) - 1
+        printf("%ld round trips with %d clients: avg %.1fus p50 %.1fus p99 %.1fus max %.1fus\n", done, num_clients,
+               sum / done, rtt[done / 2], rtt[p99], rtt[done - 1]);
+    }
+    free(rtt);
+    if (done < pingpong_rounds) printf("stopped after %ld of %ld round trips\n", done, pingpong_rounds);
+    return done < pingpong_rounds;
+}
+
+/**
+ * @brief Throughput run: senders write, everyone reads, report delivery rate.
+ */
+int run_throughput(bench_conn_t *conns) {
+    start_time = now_sec();
+    for (int i = 0; i < num_clients; i++) pthread_create(&conns[i].reader, NULL, reader_thread, &conns[i]);
+    for (int i = 0; i < num_senders; i++) pthread_create(&conns[i].writer, NULL, writer_thread, &conns[i]);
+    for (int i = 0; i < num_senders; i++) pthread_join(conns[i].writer, NULL);
+    double sent_at = now_sec();
+
+    double last = start_time;
+    long delivered = 0, expect = num_messages * num_senders;
+    int short_clients = 0;
+    for (int i = 0; i < num_clients; i++) {
+        pthread_join(conns[i].reader, NULL);
+        delivered += conns[i].received;
+        if (conns[i].received < expect) short_clients++;
+        if (conns[i].done_at > last) last = conns[i].done_at;
+    }
+    double secs = last - start_time;
+    printf("sent %ld messages in %.3fs (%.0f msg/s in)\n", expect, sent_at - start_time, expect / (sent_at - start_time));
+    printf("delivered %ld lines to %d clients in %.3fs (%.0f lines/s out)\n", delivered, num_clients, secs, delivered / secs);
+    if (payload_size > 0) printf("payload %d bytes: %.1f MB/s out\n", payload_size, delivered * (double)payload_size / secs / 1e6);
+    if (short_clients) printf("%d clients did not receive every message\n", short_clients);
+    return short_clients ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+    bench_conn_t *conns = calloc(num_clients, sizeof(bench_conn_t));
+    if (!conns) return 1;
+    // Everyone is logged in before the first message, so nobody misses one
+    for (int i = 0; i < num_clients; i++) {
+        conns[i].id = i;
+        if (bench_login(&conns[i]) < 0) {
+            fprintf(stderr, "bench%d: could not connect to %s:%d\n", i, server_ip, port);
+            return 1;
+        }
+    }
+    int rc = pingpong_rounds > 0 ? run_pingpong(conns) : run_throughput(conns);
+    for (int i = 0; i < num_clients; i++) close(conns[i].fd);
+    free(conns);
+    return rc;
+}
@@ -1,6 +1,6 @@
 // client.c
 // Compile: gcc -pthread -o client client.c
-// Run: ./client <server-ip> [port]
+// Run: ./client <server-ip> [port] [--acks]
 // Example: ./client 127.0.0.1 12345
 
 // Include header files
@@ -14,13 +14,20 @@
 #include <netinet/in.h> // for sockaddr_in
 #include <sys/socket.h> // for socket functions
 #include <arpa/inet.h> // for inet_pton
+#include <ctype.h> // for toupper
+#include <time.h> // for clock_gettime
+#include <sys/time.h> // for struct timeval
 
 #define DEFAULT_PORT 12345
 #define MAX_USERNAME 32
 #define MAX_MESSAGE 1024
+#define ACK_EVERY 32 // Acknowledge after this many sequenced messages...
+#define ACK_INTERVAL_MS 200 // ...or once this much time has passed
 
 static int server_fd = -1;
 static volatile int running = 1;
+static int acks_enabled = 0; // --acks: ask for sequence numbers and acknowledge them
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER; // Keeps ACKs from landing inside another write
 
 /**
  * @brief Sends all bytes in the buffer to the specified file descriptor.
@@ -47,35 +54,277 @@ ssize_t send_all(int fd, const void *buf, size_t len) {
     return total;
 }
 
+/**
+ * @brief Sends a buffer without interleaving with other threads' writes.
+ * 
+ * @return ssize_t The total number of bytes sent, or -1 on error.
+ */
+ssize_t send_locked(const void *buf, size_t len) {
+    pthread_mutex_lock(&send_mutex);
+    ssize_t n = send_all(server_fd, buf, len);
+    pthread_mutex_unlock(&send_mutex);
+    return n;
+}
+
+/**
+ * @brief Returns a monotonic time in milliseconds.
+ */
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Sends a cumulative ACK once enough messages or time have accumulated.
+ * 
+ * @param last_seq Sequence number of the last message received.
+ * @param unacked Messages received since the last ACK (reset when one is sent).
+ * @param last_ack Time of the last ACK in ms (updated when one is sent).
+ */
+void maybe_ack(unsigned long long last_seq, int *unacked, long long *last_ack) {
+    if (*unacked == 0) return;
+    long long now = now_ms();
+    if (*unacked < ACK_EVERY && now - *last_ack < ACK_INTERVAL_MS) return;
+    char ack[32];
+    snprintf(ack, sizeof(ack), "ACK:%llu\n", last_seq);
+    send_locked(ack, strlen(ack));
+    *unacked = 0;
+    *last_ack = now;
+}
+
+/**
+ * @brief Receives more bytes into the receive buffer, compacting it first.
+ * 
+ * @param buf The buffer.
+ * @param cap Capacity of buf.
+ * @param start Offset of the first unread byte.
+ * @param end Offset past the last unread byte.
+ * 
+ * @return ssize_t Bytes received, 0 on disconnect, -1 on error.
+ */
+ssize_t recv_more(char *buf, size_t cap, size_t *start, size_t *end) {
+    if (*start > 0) {
+        memmove(buf, buf + *start, *end - *start);
+        *end -= *start;
+        *start = 0;
+    }
+    ssize_t n = recv(server_fd, buf + *end, cap - *end, 0);
+    if (n > 0) *end += n;
+    return n;
+}
+
 /**
  * @brief Thread function to receive messages from the server.
  * 
+ * @details Chat lines are printed as they arrive. A blob download
+ * (BLOBSTART, BLOBCHUNK + raw bytes, BLOBEND) is written to
+ * blob-<id>-<name> in the current directory. In ACK mode, "#<seq> "
+ * prefixes are stripped and acknowledged in batches.
+ * 
  * @param arg Unused parameter.
  * 
  * @return void* Always returns NULL.
  */
 void *recv_thread(void *arg) {
     (void)arg;
-    char buf[2048];
+    char buf[8192];
+    size_t start = 0, end = 0;
+    FILE *download = NULL; // file receiving the current blob
+    char download_name[300] = "";
+    long long chunk_left = 0; // raw bytes left in the current BLOBCHUNK
+    unsigned long long last_seq = 0; // last sequence number received (ACK mode)
+    int unacked = 0;
+    long long last_ack = now_ms();
+
     while (running) {
-        ssize_t n = recv(server_fd, buf, sizeof(buf)-1, 0);
-        if (n <= 0) {
-            if (n == 0) {
-                printf("\n[Disconnected from server]\n");
-            } else {
-                perror("recv");
+        // Need more input: raw bytes are pending but none buffered, or no full line buffered
+        int need = (chunk_left > 0) ? (start == end)
+                                    : (!memchr(buf + start, '\n', end - start) && end - start < sizeof(buf));
+        if (need) {
+            ssize_t n = recv_more(buf, sizeof(buf), &start, &end);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // Receive timeout (ACK mode): acknowledge what is still pending
+                maybe_ack(last_seq, &unacked, &last_ack);
+                continue;
             }
-            running = 0;
-            break;
+            if (n <= 0) {
+                if (n == 0) {
+                    printf("\n[Disconnected from server]\n");
+                } else {
+                    perror("recv");
+                }
+                running = 0;
+                break;
+            }
+            continue;
+        }
+
+        // Raw blob bytes
+        if (chunk_left > 0) {
+            size_t n = end - start;
+            if ((long long)n > chunk_left) n = chunk_left;
+            if (download) fwrite(buf + start, 1, n, download);
+            start += n;
+            chunk_left -= n;
+            continue;
+        }
+
+        // One line (or a full buffer without a newline)
+        char *nl = memchr(buf + start, '\n', end - start);
+        size_t len = nl ? (size_t)(nl - (buf + start)) + 1 : end - start;
+        char line[sizeof(buf) + 1];
+        memcpy(line, buf + start, len);
+        line[len] = '\0';
+        start += len;
+
+        // Sequenced broadcast "#<seq> <line>"
+        if (acks_enabled && line[0] == '#') {
+            char *rest;
+            unsigned long long seq = strtoull(line + 1, &rest, 10);
+            if (rest != line + 1 && *rest == ' ') {
+                memmove(line, rest + 1, strlen(rest + 1) + 1);
+                // Per-core servers interleave shards, so the newest is not always the highest
+                last_seq = seq;
+                unacked++;
+            }
+        }
+
+        unsigned long id;
+        long long size;
+        int name_at = 0;
+        if (sscanf(line, "BLOBSTART:%lu:%lld:%n", &id, &size, &name_at) == 2 && name_at > 0) {
+            char *name = line + name_at;
+            name[strcspn(name, "\n")] = '\0';
+            for (char *q = name; *q; q++) if (*q == '/') *q = '_'; // keep it in this directory
+            snprintf(download_name, sizeof(download_name), "blob-%lu-%s", id, name);
+            if (download) fclose(download);
+            download = fopen(download_name, "wb");
+            printf("[Downloading blob #%lu (%lld bytes) to %s]\n", id, size, download_name);
+        } else if (sscanf(line, "BLOBCHUNK:%lu:%lld", &id, &size) == 2) {
+            chunk_left = size;
+        } else if (sscanf(line, "BLOBEND:%lu", &id) == 1) {
+            if (download) fclose(download);
+            download = NULL;
+            printf("[Saved blob #%lu to %s]\n", id, download_name);
+        } else if (strncmp(line, "DM:", 3) == 0 && strchr(line + 3, ':')) {
+            // Direct message "DM:<from>:<text>" (live, or stored while we were away)
+            char *text = strchr(line + 3, ':');
+            *text++ = '\0';
+            printf("[DM from %s] %s", line + 3, text);
+        } else if (strncmp(line, "MENTION:", 8) == 0) {
+            // Someone @mentioned us: ring the bell
+            printf("\a[mention] %s", line + 8);
+        } else if (strncmp(line, "EDIT:", 5) == 0 && strchr(line + 5, ':')) {
+            // "EDIT:<seq>:<user>: <text>" replaces message #seq
+            char *text = strchr(line + 5, ':');
+            *text++ = '\0';
+            printf("[edited #%s] %s", line + 5, text);
+        } else if (strncmp(line, "DELETE:", 7) == 0) {
+            printf("[deleted #%s]\n", strtok(line + 7, "\n"));
+        } else if (strncmp(line, "REACTS:", 7) == 0 && strchr(line + 7, ':')) {
+            // "REACTS:<seq>:<name>=<count>,..." carries the current totals for message #seq
+            char *totals = strchr(line + 7, ':');
+            *totals++ = '\0';
+            printf("[reactions #%s]", line + 7);
+            for (char *e = strtok(totals, ",\n"); e; e = strtok(NULL, ",\n")) printf(" %s", e);
+            printf("\n");
+        } else if (strncmp(line, "RESULT:", 7) == 0 && strchr(line + 7, ':')) {
+            // Search hit "RESULT:<seq>:<user>: <text>"
+            char *text = strchr(line + 7, ':');
+            *text++ = '\0';
+            printf("[#%s] %s", line + 7, text);
+        } else if (strncmp(line, "HIST:", 5) == 0) {
+            // History line "HIST:<seq>:<ts_usec>:<user>: <text>"
+            unsigned long long hseq;
+            long long ts;
+            int text_at = 0;
+            if (sscanf(line + 5, "%llu:%lld:%n", &hseq, &ts, &text_at) == 2 && text_at > 0) {
+                time_t secs = (time_t)(ts / 1000000);
+                char when[32];
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+                printf("[#%llu %s] %s", hseq, when, line + 5 + text_at);
+            }
+        } else if (strncmp(line, "HISTEND:", 8) == 0) {
+            unsigned long long next = 0;
+            int count = 0;
+            sscanf(line + 8, "%d:%llu", &count, &next);
+            if (next) printf("[%d messages; more from #%llu]\n", count, next);
+            else printf("[%d messages]\n", count);
+        } else if (strncmp(line, "SEARCHEND:", 10) == 0) {
+            unsigned long long next = 0;
+            int count = 0;
+            sscanf(line + 10, "%d:%llu", &count, &next);
+            if (next) printf("[%d results; next page: /search before=%llu <words>]\n", count, next);
+            else printf("[%d results]\n", count);
+        } else if (strncmp(line, "PRESENCE:", 9) == 0) {
+            // Coalesced presence deltas "user=status[,typing];..."
+            printf("[presence]");
+            for (char *e = strtok(line + 9, ";\n"); e; e = strtok(NULL, ";\n")) printf(" %s", e);
+            printf("\n");
+        } else {
+            // Print server message
+            fputs(line, stdout);
         }
-        buf[n] = '\0';
-        // Print server message
-        fputs(buf, stdout);
         fflush(stdout);
+        maybe_ack(last_seq, &unacked, &last_ack);
     }
+    if (download) fclose(download);
     return NULL;
 }
 
+/**
+ * @brief Uploads a file to the server as a blob (BLOB:<size>:<name> + raw bytes).
+ * 
+ * @param path Path of the file to upload.
+ * 
+ * @return int 0 on success, -1 on error.
+ */
+int send_file(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return 0; // not fatal for the connection
+    }
+    fseek(fp, 0, SEEK_END);
+    long long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    char hdr[512];
+    snprintf(hdr, sizeof(hdr), "BLOB:%lld:%s\n", size, name);
+
+    // Hold the send lock for the whole upload so no ACK lands inside the raw bytes
+    pthread_mutex_lock(&send_mutex);
+    if (send_all(server_fd, hdr, strlen(hdr)) < 0) {
+        pthread_mutex_unlock(&send_mutex);
+        fclose(fp);
+        return -1;
+    }
+
+    // Stream the file in chunks; the server stores it without buffering it whole
+    char chunk[65536];
+    long long left = size;
+    while (left > 0) {
+        size_t n = fread(chunk, 1, left < (long long)sizeof(chunk) ? (size_t)left : sizeof(chunk), fp);
+        if (n == 0) {
+            // File shrank: pad so the server still gets the announced size
+            memset(chunk, 0, sizeof(chunk));
+            n = left < (long long)sizeof(chunk) ? (size_t)left : sizeof(chunk);
+        }
+        if (send_all(server_fd, chunk, n) < 0) {
+            pthread_mutex_unlock(&send_mutex);
+            fclose(fp);
+            return -1;
+        }
+        left -= n;
+    }
+    pthread_mutex_unlock(&send_mutex);
+    fclose(fp);
+    return 0;
+}
+
 // Helper: receive one line from server
     int recv_line_client(int fd, char *buf, size_t maxlen) {
         size_t idx = 0;
@@ -91,13 +340,20 @@ void *recv_thread(void *arg) {
     }
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <server-ip> [port]\n", argv[0]);
+    // Positional arguments are the server IP and port; --acks may appear anywhere
+    const char *args[2] = { NULL, NULL };
+    int nargs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--acks") == 0) acks_enabled = 1;
+        else if (nargs < 2) args[nargs++] = argv[i];
+    }
+    if (nargs < 1) {
+        fprintf(stderr, "Usage: %s <server-ip> [port] [--acks]\n", argv[0]);
         return 1;
     }
-    const char *server_ip = argv[1];
+    const char *server_ip = args[0];
     int port = DEFAULT_PORT;
-    if (argc >= 3) port = atoi(argv[2]);
+    if (nargs >= 2) port = atoi(args[1]);
 
     signal(SIGINT, SIG_IGN);
 
@@ -239,9 +495,9 @@ int main(int argc, char **argv) {
     }
 */
 
-    // Prompt for username
-    char username[MAX_USERNAME];
-    printf("Enter username: ");
+    // Prompt for username (servers with accounts expect username:password)
+    char username[MAX_USERNAME + MAX_MESSAGE];
+    printf("Enter username (or username:password): ");
     if (!fgets(username, sizeof(username), stdin)) {
         close(server_fd);
         return 1;
@@ -257,7 +513,7 @@ int main(int argc, char **argv) {
     }
 
     // Send LOGIN:<username>\n
-    char login_msg[128];
+    char login_msg[sizeof(username) + 8];
     snprintf(login_msg, sizeof(login_msg), "LOGIN:%s\n", username);
     if (send_all(server_fd, login_msg, strlen(login_msg)) < 0) {
         perror("send");
@@ -265,16 +521,16 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // Wait for server response (OK or ERR:)
-    //char resp[256];
-    ssize_t nr = recv(server_fd, resp, sizeof(resp)-1, 0);
-    if (nr <= 0) {
+    // Wait for server response (OK or ERR:). Read only the reply line: backfill,
+    // stored DMs and presence follow straight after OK and belong to recv_thread
+    if (recv_line_client(server_fd, resp, sizeof(resp)) <= 0) {
         perror("recv");
         close(server_fd);
         return 1;
     }
-    resp[nr] = '\0';
     if (strncmp(resp, "OK", 2) == 0) {
+        char *colon = strchr(username, ':');
+        if (colon) *colon = '\0'; // do not echo the password
         printf("[Connected to chat as '%s']\n", username);
     } else {
         printf("Server response: %s\n", resp);
@@ -282,6 +538,13 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // ACK mode: wake the receive thread periodically so pending ACKs go out during lulls
+    if (acks_enabled) {
+        struct timeval tv = { .tv_sec = 0, .tv_usec = ACK_INTERVAL_MS * 1000 };
+        setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        send_locked("ACKS:ON\n", 8);
+    }
+
     // Start receive thread
     pthread_t rt;
     pthread_create(&rt, NULL, recv_thread, NULL);
@@ -292,16 +555,38 @@ int main(int argc, char **argv) {
     while (running && fgets(line, sizeof(line), stdin)) {
         // if user types /quit or /exit, send QUIT and break
         if (strncmp(line, "/quit", 5) == 0 || strncmp(line, "/exit", 5) == 0) {
-            send_all(server_fd, "QUIT\n", 5);
+            send_locked("QUIT\n", 5);
             break;
         }
         // Trim newline
         char *p = strchr(line, '\n');
         if (p) *p = '\0';
 
+        // /send <path> uploads a file; /get <id> (below) downloads one
+        if (strncmp(line, "/send ", 6) == 0) {
+            if (send_file(line + 6) < 0) {
+                perror("send");
+                break;
+            }
+            continue;
+        }
+
         char out[MAX_MESSAGE + 8];
-        snprintf(out, sizeof(out), "MSG:%s\n", line);
-        if (send_all(server_fd, out, strlen(out)) < 0) {
+        if (line[0] == '/' && isalpha((unsigned char)line[1])) {
+            // Other slash commands go to the server as-is: "/stats" -> "STATS", "/cmd args" -> "CMD:args"
+            size_t i = 1, o = 0;
+            while (line[i] && line[i] != ' ' && o < sizeof(out) - 3) {
+                out[o++] = toupper((unsigned char)line[i++]);
+            }
+            if (line[i] == ' ') {
+                snprintf(out + o, sizeof(out) - o, ":%s\n", line + i + 1);
+            } else {
+                snprintf(out + o, sizeof(out) - o, "\n");
+            }
+        } else {
+            snprintf(out, sizeof(out), "MSG:%s\n", line);
+        }
+        if (send_locked(out, strlen(out)) < 0) {
             perror("send");
             break;
         }
@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE // for CPU affinity (pthread_attr_setaffinity_np)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,267 +7,7108 @@
 #include <errno.h>
 #include <signal.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/errqueue.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <sys/file.h>
+#include <poll.h>
 
 #define DEFAULT_PORT 12345
 #define MAX_USERNAME 32
 #define MAX_MESSAGE 1024
 #define MAX_CLIENTS 128
+#define MAX_SHARDS 64
+#define SHARD_RING_SIZE 1024 // Frames per shard ring, must be a power of two
+#define CACHE_LINE 64
+#define MAX_CPU_LIST 256
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define DEFAULT_POOL_OBJECTS 4096
+#define FRAME_CAP (MAX_USERNAME + 2 + MAX_MESSAGE + 2) // Largest formatted broadcast line
+#define STATS_BUF 8192
+#define BATCH_MAX 64 // Most frames coalesced into one batch (also the writev iovec count)
+#define BATCH_MAX_BYTES (64 * 1024) // Batches close once they hold this many bytes
+#define BATCH_DEPTH_THRESHOLD 2 // Average queue depth at which the dispatcher starts waiting to coalesce
+
+// TCP tuning profiles for client sockets
+#define TCP_PROFILE_DEFAULT 0    // kernel defaults
+#define TCP_PROFILE_LATENCY 1    // TCP_NODELAY, small unsent backlog
+#define TCP_PROFILE_THROUGHPUT 2 // cork batched writes, larger unsent backlog
+#define LATENCY_NOTSENT_LOWAT (16 * 1024)
+#define THROUGHPUT_NOTSENT_LOWAT (128 * 1024)
+
+// Page backing requested for buffer pools
+#define HUGE_OFF 0      // normal pages
+#define HUGE_THP 1      // transparent huge pages (madvise)
+#define HUGE_EXPLICIT 2 // hugetlbfs pages (MAP_HUGETLB), falling back to THP
+
+#define LOG_SEGMENT_BYTES (16 * 1024 * 1024) // Default size at which a log segment is sealed
+#define LOG_EDIT 1   // log record flag: EDIT delta for an earlier message
+#define LOG_DELETE 2 // log record flag: DELETE delta for an earlier message
+#define LOG_REACT 4  // log record flag: reaction totals for an earlier message
+#define HIST_EDITED 1  // message has been edited
+#define HIST_DELETED 2 // message has been deleted
+#define MAX_LOG_PATH 512
+#define COLD_MAGIC "P1COLD01" // First bytes of a compressed (cold) segment file
+#define COLD_BLOCK (64 * 1024) // Uncompressed bytes per cold block (LZ offsets are 16-bit)
+#define COLD_CACHE_BLOCKS 8 // Decompressed cold blocks kept in memory
+#define LZ_HASH_BITS 12 // Match finder table size of the block compressor
+#define COMPACT_POLL_MS 1000 // How often the compactor looks for segments to compress
+#define EXPORT_MAGIC "P1COL001" // First bytes of a columnar export file
+#define READ_BUF (4 * MAX_MESSAGE) // Per-connection input buffer
+#define BLOB_CHUNK (64 * 1024) // Blob bytes moved per read/write or per BLOBCHUNK frame
+#define DEFAULT_BLOB_MAX (1024LL * 1024 * 1024) // Largest blob accepted by default
+#define MAX_MENTIONS 8 // Users notified per message
+#define ZC_MAX_PENDING 256 // Zerocopy sends a client may have in flight before falling back to copying
+#define ZC_CLOSE_WAIT_MS 200 // How long a closing client waits for its zerocopy completions
+#define ACK_WINDOW 256 // Unacknowledged writes remembered per client in ACK mode
+#define ACK_STATS_CLIENTS 16 // ACK-mode clients listed individually in STATS
+#define DEDUP_WINDOW 64 // Recent message IDs remembered per sender
+#define DEDUP_SET 128 // Hash set slots per sender (twice the window keeps probes short)
+#define DEDUP_SENDERS 1024 // Senders remembered (direct-mapped by name), must be a power of two
+#define DEDUP_ID_MAX 64 // Longest client message ID
+#define HISTORY_RING 4096 // Recent messages kept in memory for history lookups, must be a power of two
+#define MAX_REACTION 16 // Longest reaction name, including the terminator
+#define REACT_KINDS 8 // Distinct reactions per message
+#define DEFAULT_REACT_MS 1000 // Reaction aggregation window
+#define HISTORY_PAGE 50 // Messages per HISTORY page by default
+#define HISTORY_PAGE_MAX 200 // Largest page a client may ask for
+#define LATENCY_BUCKETS 24 // Power-of-two microsecond buckets per latency histogram
+#define MAX_TERM 32 // Longest indexed search term, including the terminator (longer words are cut)
+#define MAX_QUERY_TERMS 8 // Terms per SEARCH query
+#define SEARCH_PAGE 20 // Results per SEARCH page by default
+#define SEARCH_PAGE_MAX 100 // Largest page a client may ask for
+#define INDEX_POLL_MS 100 // How often the indexer looks for new log records
+#define INDEX_MAGIC "P1FTS001" // First bytes of a segment index file
+#define INDEX_VERSION 2 // Layout of a segment index file; files of another version are rebuilt
+#define MAX_STATUS 32 // Longest presence status
+#define BACKFILL_HOLD_MAX (1024 * 1024) // Live output queued for a client while its backfill streams; more cuts it off
+#define DEFAULT_PRESENCE_MS 250 // Presence coalescing window
+#define TYPING_TIMEOUT_USEC 3000000 // Typing indicators expire without a refresh
+#define SKETCH_DEPTH 4 // Hash rows per count-min sketch
+#define SKETCH_WIDTH 4096 // Counters per sketch row, must be a power of two
+#define TOP_K 8 // Heavy hitters tracked per sketch
+#define HITTER_LABEL 40 // Bytes of text kept to identify a heavy hitter
+#define SPAM_MIN_TEXT 8 // Normalized texts shorter than this are not fingerprinted
+#define SPAM_STRIKES 3 // Dropped copies within a window after which a sender is throttled
+#define DEFAULT_SPAM_WINDOW 10 // Seconds per spam detection window
+#define IP_TABLE_SIZE 4096 // Distinct client addresses tracked for --max-per-ip, must be a power of two
+#define PBKDF2_ITERATIONS 100000 // Iterations for newly hashed passwords
+#define SALT_MAX 32 // Longest accepted salt in bytes
+#define AUTH_QUEUE_MAX 64 // Verifications that may wait for a worker before logins are refused as busy
+#define DEFAULT_AUTH_WORKERS 2
+#define DEFAULT_MAILBOX_QUOTA (64 * 1024) // Bytes of stored direct messages allowed per user
+#define DEFAULT_MAILBOX_TOTAL (64L * 1024 * 1024) // Bytes of stored direct messages allowed across all mailboxes
+#define MAILBOX_LOCKS 64 // Mailbox lock stripes, so one slow recipient does not hold up other DMs
+#define STORE_MAGIC "P1ACCTS1" // First bytes of an account store file
+#define STORE_MIN_SLOTS 1024 // Slots in a new account store, must be a power of two
+#define STORE_SLOT_EMPTY 0
+#define STORE_SLOT_USED 1
+#define STORE_SLOT_DELETED 2 // tombstone, dropped when the store grows
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1 // from <linux/mempolicy.h>
+#endif
 
 // Server password
 #define SERVER_PASSWORD "PleaseGiveUsExtraCredit:)"
 
+// Kinds of queued messages
+#define MSG_CHAT 0   // user message or server announcement
+#define MSG_RAW 1    // complete server line, broadcast as is without logging it
+#define MSG_EDIT 2   // new text for an earlier message
+#define MSG_DELETE 3 // deletion of an earlier message
+#define MSG_REACTS 4 // reaction totals for an earlier message
+
+/**
+ * @brief Fixed-size object pool carved out of one contiguous region.
+ *
+ * @details The region can be backed by huge pages to cut TLB misses when many
+ * queued messages and frames are live. When the pool runs dry allocations
+ * fall back to malloc() so callers never fail just because the pool is small.
+ */
+typedef struct pool {
+    // protects free_list and in_use
+    pthread_mutex_t lock;
+
+    // free objects, linked through their first word
+    void *free_list;
+
+    // backing region
+    char *base;
+    size_t region_size;
+
+    // size of one object in bytes
+    size_t obj_size;
+
+    // number of objects carved from the region, and how many are handed out
+    size_t capacity;
+    size_t in_use;
+
+    // allocations served by malloc() because the pool was empty
+    atomic_size_t overflow;
+
+    // "hugetlb", "thp" or "normal"
+    const char *backing;
+
+    // name used in stats
+    char name[32];
+} pool_t;
+
+/**
+ * @brief A zerocopy send whose frames the kernel may still be reading.
+ */
+typedef struct zc_send {
+    // first zerocopy id used by this send and how many ids have not completed yet
+    uint32_t id_lo;
+    uint32_t id_count;
+    uint32_t remaining;
+
+    // frames referenced by the send (one reference each)
+    int nframes;
+    struct frame *frames[BATCH_MAX];
+
+    // next pending send
+    struct zc_send *next;
+} zc_send_t;
+
+/**
+ * @brief A write to an ACK-mode client that has not been acknowledged yet.
+ */
+typedef struct ack_pending {
+    // first and last sequence number in the write
+    uint64_t first_seq;
+    uint64_t seq;
+
+    // now_usec() when it was written
+    uint64_t sent_usec;
+} ack_pending_t;
+
+/**
+ * @brief Client structure representing a connected client.
+ * 
+ */
+typedef struct client {
+    // socket file descriptor
+    int sockfd; 
+
+    // username of the client
+    char username[MAX_USERNAME];
+
+    // 0 = not logged in yet, 1 = logged in (read by broadcasters without the shard lock held by us)
+    atomic_int logged_in; 
+
+    // first sequence number delivered live; older frames were sent as backfill
+    uint64_t live_from;
+
+    // serializes writes to sockfd between the broadcaster and the client thread
+    pthread_mutex_t send_lock;
+
+    // live output held back while the backfill streams, protected by hold_lock
+    pthread_mutex_t hold_lock;
+    atomic_int backfilling; // 1 = output is queued in held instead of written
+    char *held; // queued bytes
+    size_t held_len;
+    size_t held_cap;
+    int held_overflow; // 1 once the queue overflowed and the socket was shut down
+
+    // MSG_ZEROCOPY state, protected by send_lock
+    int zerocopy; // 1 if SO_ZEROCOPY is enabled on sockfd
+    uint32_t zc_next_id; // id the kernel assigns to the next zerocopy send
+    int zc_count; // entries in the pending list
+    zc_send_t *zc_head; // pending sends, oldest first
+
+    // cumulative ACK state, protected by send_lock
+    atomic_int ack_mode; // 1 = broadcasts carry "#<seq> " and the client replies ACK:<seq>
+    uint64_t acked_seq; // highest sequence number acknowledged
+    uint64_t sent_seq; // highest sequence number written
+    ack_pending_t *unacked; // ring of ACK_WINDOW unacknowledged writes (allocated with ACK mode)
+    int unacked_head; // oldest entry in unacked
+    int unacked_count; // entries in unacked
+
+    // peer IPv4 address (host byte order)
+    uint32_t addr;
+
+    // presence, protected by the shard's clients_mutex
+    char status[MAX_STATUS]; // set with STATUS:<text> ("" = online)
+    int typing; // 1 while the user is typing
+    uint64_t typing_until; // now_usec() at which typing expires
+    int presence_dirty; // 1 if presence changed since the last delta
+    int presence_shown; // 1 once the user appeared in a delta, so peers must hear when they leave
+
+    // shard that owns this client
+    struct shard *shard;
+
+    // next client in the list
+    struct client *next; 
+} client_t;
+
+/**
+ * @brief Message structure representing a message in the queue.
+ */
+typedef struct message {
+    // sender username
+    char sender[MAX_USERNAME];
+
+    // message text
+    char text[MAX_MESSAGE];
+
+    // pool the message came from (NULL = malloc)
+    pool_t *pool;
+
+    // MSG_CHAT, MSG_RAW, MSG_EDIT, MSG_DELETE or MSG_REACTS
+    int kind;
+
+    // message an EDIT, DELETE or REACTS applies to
+    uint64_t target;
+
+    // next message in the queue
+    struct message *next;
+} message_t;
+
+/**
+ * @brief Broadcast frame, formatted once and shared by every recipient.
+ *
+ * @details The frame is freed when the last reference is dropped, so a broadcast
+ * can be handed to several shards without copying it per shard.
+ */
+typedef struct frame {
+    // outstanding references to this frame
+    atomic_int refs;
+
+    // sequence number assigned by the dispatcher (0 = not sequenced)
+    uint64_t seq;
+
+    // pool the frame came from; the last holder frees it there, on any thread
+    pool_t *pool;
+
+    // wall-clock time the frame was created, microseconds since the epoch
+    int64_t ts_usec;
+
+    // length of data in bytes
+    size_t len;
+
+    // 1 = not sequenced or logged (presence deltas)
+    int ephemeral;
+
+    // LOG_EDIT, LOG_DELETE or LOG_REACT for delta frames (copied into the log record), else 0
+    uint32_t flags;
+
+    // message a delta frame applies to
+    uint64_t target;
+
+    // formatted wire data ("username: text\n")
+    char data[];
+} frame_t;
+
+/**
+ * @brief On-disk index entry for one logged message.
+ *
+ * @details Each log segment is a pair of files: NNN.log holds the broadcast
+ * lines exactly as sent to clients (so they can be streamed with sendfile)
+ * and NNN.idx holds one of these fixed-size records per line, where NNN is
+ * the first sequence number in the segment.
+ */
+typedef struct log_record {
+    // message sequence number
+    uint64_t seq;
+
+    // wall-clock time, microseconds since the epoch
+    int64_t ts_usec;
+
+    // byte offset and length of the line in the segment's .log file
+    uint64_t offset;
+    uint32_t len;
+
+    // LOG_EDIT, LOG_DELETE or LOG_REACT for delta records, 0 for messages
+    uint32_t flags;
+} log_record_t;
+
+/**
+ * @brief An open log segment.
+ */
+typedef struct log_segment {
+    // sequence number of the first record and number of records
+    uint64_t first_seq;
+    uint64_t count;
+
+    // bytes in the .log file
+    uint64_t size;
+
+    // .log and .idx file descriptors (fd is -1 once the segment is cold)
+    int fd;
+    int idx_fd;
+
+    // compressed data once the segment has been compacted (NULL while hot)
+    struct cold_segment *cold;
+} log_segment_t;
+
+/**
+ * @brief Location of one compressed block in a cold segment file.
+ */
+typedef struct cold_block {
+    // byte offset and length of the block in the file
+    uint64_t offset;
+    uint32_t comp_len;
+
+    // uncompressed length (equal to comp_len if the block is stored as is)
+    uint32_t raw_len;
+} cold_block_t;
+
+/**
+ * @brief Header of a cold segment file.
+ *
+ * @details A cold file (NNN.cold) replaces a sealed segment's NNN.log. The
+ * log data is cut into COLD_BLOCK-byte blocks which are compressed one by
+ * one, followed by the block index. The segment's .idx file is kept as is,
+ * so a record's offset still locates it: the block is offset / block_size.
+ */
+typedef struct cold_header {
+    // COLD_MAGIC
+    char magic[8];
+
+    // size of the original .log data
+    uint64_t raw_size;
+
+    // position of the block index (nblocks cold_block_t entries)
+    uint64_t index_offset;
+
+    // number of blocks and uncompressed bytes per block
+    uint32_t nblocks;
+    uint32_t block_size;
+} cold_header_t;
+
+/**
+ * @brief An open cold segment file and its block index.
+ */
+typedef struct cold_segment {
+    // file descriptor and size of the .cold file
+    int fd;
+    uint64_t file_size;
+
+    // size of the original .log data
+    uint64_t raw_size;
+
+    // the block index
+    uint32_t nblocks;
+    uint32_t block_size;
+    cold_block_t *blocks;
+} cold_segment_t;
+
+/**
+ * @brief Sections of a columnar export file, in file order.
+ */
+enum export_section {
+    EXPORT_TEXT,     // text blocks, compressed like cold segments
+    EXPORT_SEQ,      // varint gaps between sequence numbers
+    EXPORT_TS,       // zigzag varint deltas between timestamps (microseconds)
+    EXPORT_SENDER,   // varint ids into the sender dictionary
+    EXPORT_STATE,    // one byte of HIST_* bits per row
+    EXPORT_TEXT_LEN, // varint length of each row's text
+    EXPORT_DICT,     // sender names: a length byte, then the name
+    EXPORT_BLOCKS,   // cold_block_t index of the text blocks
+    EXPORT_SECTIONS
+};
+
+/**
+ * @brief Header of a columnar export file.
+ *
+ * @details Each column is stored contiguously so a scan only touches the
+ * columns it needs: counting messages per sender reads EXPORT_SENDER and the
+ * dictionary, never the text. Row i of every column is the same message.
+ * The text column is the concatenated texts of all rows, cut into
+ * COLD_BLOCK-byte blocks that are compressed one by one.
+ */
+typedef struct export_header {
+    // EXPORT_MAGIC
+    char magic[8];
+
+    // number of rows (messages)
+    uint64_t rows;
+
+    // entries in the sender dictionary and in the text block index
+    uint32_t nsenders;
+    uint32_t nblocks;
+
+    // byte range of each section
+    uint64_t offset[EXPORT_SECTIONS];
+    uint64_t length[EXPORT_SECTIONS];
+
+    // hash_bytes() of each section; for EXPORT_TEXT, of each uncompressed block chained together
+    uint64_t check[EXPORT_SECTIONS];
+} export_header_t;
+
+/**
+ * @brief A growable byte buffer holding one export column.
+ */
+typedef struct export_buf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+} export_buf_t;
+
+/**
+ * @brief A decompressed cold block kept for reuse.
+ */
+typedef struct cold_cache_entry {
+    // the segment and block held (seg NULL = unused)
+    const cold_segment_t *seg;
+    uint32_t block;
+
+    // uncompressed bytes in data
+    uint32_t len;
+
+    // cold_cache_clock value at the last use
+    uint64_t used;
+
+    // COLD_BLOCK bytes
+    unsigned char *data;
+} cold_cache_entry_t;
+
+/**
+ * @brief A recent broadcast kept in memory, indexed by sequence number.
+ */
+typedef struct history_entry {
+    // sequence number (0 = empty slot)
+    uint64_t seq;
+
+    // wall-clock time, microseconds since the epoch
+    int64_t ts_usec;
+
+    // log flags of the line (0 = message)
+    uint32_t flags;
+
+    // HIST_EDITED and HIST_DELETED bits
+    uint32_t state;
+
+    // length of data in bytes
+    uint32_t len;
+
+    // current line ("username: text\n" for messages), replaced when the message is edited
+    char data[FRAME_CAP];
+} history_entry_t;
+
+/**
+ * @brief Edit state of a logged message that was edited or deleted.
+ *
+ * @details Messages are never rewritten in the log; their EDIT and DELETE
+ * deltas are appended as records of their own. This table maps a message to
+ * its state and latest edit so lookups do not have to scan for them.
+ */
+typedef struct edit_entry {
+    // sequence number of the message (0 = empty slot)
+    uint64_t seq;
+
+    // sequence number of the latest EDIT delta (0 = never edited)
+    uint64_t edit_seq;
+
+    // HIST_EDITED and HIST_DELETED bits
+    uint32_t state;
+} edit_entry_t;
+
+/**
+ * @brief Latency histogram with power-of-two microsecond buckets.
+ *
+ * @details Bucket i counts samples below 2^(i+1) us (and at least 2^i
+ * us for i > 0), so recording is a bit scan and an atomic increment.
+ */
+typedef struct latency_hist {
+    // samples per bucket
+    atomic_ulong buckets[LATENCY_BUCKETS];
+
+    // number of samples and their sum
+    atomic_ulong count;
+    atomic_ulong total_usec;
+} latency_hist_t;
+
+/**
+ * @brief Posting list of one search term within one log segment.
+ *
+ * @details Sequence numbers are stored ascending as varint-encoded gaps, so
+ * a term that appears in consecutive messages costs one byte per message.
+ */
+typedef struct term_postings {
+    // hash of the term (0 = empty slot)
+    uint64_t hash;
+
+    // the term, lowercased
+    char term[MAX_TERM];
+
+    // encoded gaps
+    unsigned char *data;
+    uint32_t len;
+    uint32_t cap;
+
+    // number of postings and the last sequence number added
+    uint32_t count;
+    uint64_t last_seq;
+} term_postings_t;
+
+/**
+ * @brief Inverted index of one log segment.
+ */
+typedef struct segment_index {
+    // first sequence number of the segment
+    uint64_t first_seq;
+
+    // log records indexed so far
+    uint64_t indexed;
+
+    // 1 = the segment is sealed and its index saved to NNN.fts
+    int saved;
+
+    // term table (open addressing by hash)
+    term_postings_t *terms;
+    size_t cap;
+    size_t nterms;
+} segment_index_t;
+
+/**
+ * @brief Header of a saved segment index (NNN.fts), followed by the terms.
+ */
+typedef struct index_header {
+    // INDEX_MAGIC
+    char magic[8];
+
+    // INDEX_VERSION
+    uint32_t version;
+    uint32_t reserved;
+
+    // log records covered and terms stored
+    uint64_t indexed;
+    uint64_t nterms;
+
+    // index_entry_check() of every term chained together
+    uint64_t check;
+} index_header_t;
+
+/**
+ * @brief Reaction counters of one message.
+ */
+typedef struct react_entry {
+    // message sequence number (0 = empty slot)
+    uint64_t seq;
+
+    // distinct reactions in use
+    int n;
+
+    // 1 = counts changed since the totals were last broadcast
+    int dirty;
+
+    // reaction names and their counts
+    char names[REACT_KINDS][MAX_REACTION];
+    uint32_t counts[REACT_KINDS];
+} react_entry_t;
+
+/**
+ * @brief Buffered reader for a client connection.
+ *
+ * @details Lines may arrive split across (or packed into) TCP segments, so
+ * input is buffered until a full line is available. Raw blob bytes that
+ * follow a BLOB header are served from the same buffer first.
+ */
+typedef struct line_reader {
+    // socket to read from
+    int fd;
+
+    // unread bytes are buf[start, end)
+    size_t start;
+    size_t end;
+
+    // 1 while skipping the tail of an overlong line
+    int discarding;
+
+    char buf[READ_BUF];
+} line_reader_t;
+
+/**
+ * @brief Aho-Corasick trie node.
+ *
+ * @details Children are kept as sibling lists rather than 256-entry tables
+ * so thousands of patterns stay small; the automaton is only walked forward,
+ * one input byte at a time.
+ */
+typedef struct ac_node {
+    // first child and next sibling (node indexes, -1 = none)
+    int child;
+    int sibling;
+
+    // longest proper suffix that is also a trie path
+    int fail;
+
+    // nearest node on the fail chain that ends a pattern (-1 = none)
+    int dict;
+
+    // pattern ending at this node (-1 = none)
+    int pattern;
+
+    // byte on the edge from the parent
+    unsigned char label;
+} ac_node_t;
+
+/**
+ * @brief Aho-Corasick automaton: finds every occurrence of many patterns in one pass.
+ */
+typedef struct ac_automaton {
+    // trie nodes, node 0 is the root
+    ac_node_t *nodes;
+    int nnodes;
+    int nodes_cap;
+
+    // per pattern: length in bytes and 1 while the pattern is active
+    int *pattern_len;
+    unsigned char *pattern_active;
+    int npatterns;
+    int patterns_cap;
+
+    // patterns removed but still in the trie
+    int dead;
+
+    // 1 = match ASCII letters case-insensitively
+    int nocase;
+
+    // 1 once fail links match the trie
+    int compiled;
+} ac_automaton_t;
+
+/**
+ * @brief A pending @mention notification.
+ */
+typedef struct mention_note {
+    // user to notify
+    char username[MAX_USERNAME];
+
+    // frame that mentions them (one reference)
+    struct frame *frame;
+} mention_note_t;
+
+/**
+ * @brief Incremental SHA-256 state.
+ */
+typedef struct sha256 {
+    uint32_t state[8];
+
+    // bytes hashed so far
+    uint64_t bytes;
+
+    // partial input block
+    unsigned char block[64];
+    size_t fill;
+} sha256_t;
+
+/**
+ * @brief A stored password: "pbkdf2-sha256$<iterations>$<salt hex>$<hash hex>".
+ */
+typedef struct credential {
+    uint32_t iterations;
+    unsigned char salt[SALT_MAX];
+    size_t salt_len;
+    unsigned char hash[32];
+} credential_t;
+
+/**
+ * @brief A user account from the accounts file.
+ */
+typedef struct account {
+    char username[MAX_USERNAME];
+    credential_t cred;
+} account_t;
+
+/**
+ * @brief Header of an account store file.
+ */
+typedef struct store_header {
+    char magic[8];
+
+    // slots in the table (a power of two)
+    uint32_t capacity;
+
+    // slots holding an account, and tombstones
+    uint32_t used;
+    uint32_t deleted;
+
+    // set once a grown copy is about to replace this file, so readers remap
+    _Atomic uint32_t replaced;
+    uint32_t reserved[10];
+} store_header_t;
+
+/**
+ * @brief One slot of an account store's open-addressing table.
+ *
+ * @details Writers bump seq to an odd value, change the slot and bump it back
+ * to even, so the server can read slots without taking any lock.
+ */
+typedef struct store_slot {
+    // even = stable, odd = being written
+    _Atomic uint32_t seq;
+
+    // STORE_SLOT_EMPTY, STORE_SLOT_USED or STORE_SLOT_DELETED
+    uint32_t state;
+
+    char username[MAX_USERNAME];
+
+    // credential fields, fixed-size so the file layout does not depend on credential_t
+    uint32_t iterations;
+    uint32_t salt_len;
+    unsigned char salt[SALT_MAX];
+    unsigned char hash[32];
+} store_slot_t;
+
+/**
+ * @brief A password verification waiting for (or done by) an auth worker.
+ *
+ * @details Lives on the stack of the client thread that submitted it, which
+ * sleeps on done until a worker posts the result.
+ */
+typedef struct auth_job {
+    // stored credential and the password to check against it
+    const credential_t *cred;
+    const char *password;
+
+    // -1 while pending, then 1 = match, 0 = mismatch
+    int result;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+
+    // next job in the queue
+    struct auth_job *next;
+} auth_job_t;
+
+/**
+ * @brief The recent message IDs of one sender.
+ *
+ * @details IDs are kept in a ring giving their age, so the oldest falls out
+ * once the window is full, plus a small open-addressing set of ring
+ * positions hashed by fingerprint for the duplicate check. A fingerprint
+ * match is confirmed against the stored ID.
+ */
+typedef struct dedup_window {
+    // sender this window belongs to ("" = unused)
+    char username[MAX_USERNAME];
+
+    // IDs in arrival order with their fingerprints, and the oldest one's index
+    char ring[DEDUP_WINDOW][DEDUP_ID_MAX + 1];
+    uint32_t fps[DEDUP_WINDOW];
+    int ring_head;
+    int ring_count;
+
+    // ring positions + 1, hashed by fingerprint (0 = empty slot)
+    uint8_t set[DEDUP_SET];
+} dedup_window_t;
+
+/**
+ * @brief Binary radix trie of IPv4 prefixes.
+ *
+ * @details One node per prefix bit, so a lookup is at most 32 steps no matter
+ * how many prefixes are listed, and covering prefixes need no extra work.
+ */
+typedef struct ip_trie {
+    // nodes: children per bit and 1 if a listed prefix ends here; node 0 is the root
+    struct { int child[2]; int terminal; } *nodes;
+    int nnodes;
+    int nodes_cap;
+
+    // prefixes listed
+    int nprefixes;
+} ip_trie_t;
+
+/**
+ * @brief Concurrent connection count of one client address.
+ */
+typedef struct ip_count {
+    // IPv4 address in host byte order (0 = empty slot)
+    uint32_t addr;
+
+    // open connections from addr
+    int count;
+} ip_count_t;
+
+/**
+ * @brief An entry in a sketch's top-k table.
+ */
+typedef struct heavy_hitter {
+    // hashed key (0 = empty slot)
+    uint64_t key;
+
+    // estimated count in the current window
+    uint32_t count;
+
+    // the key as text, truncated (sender name or normalized message)
+    char label[HITTER_LABEL];
+} heavy_hitter_t;
+
+/**
+ * @brief Count-min sketch with a top-k table of its heaviest keys.
+ *
+ * @details Memory is fixed no matter how many distinct keys are seen. A key's
+ * estimate is the smallest of its counters, so it can only be over-counted,
+ * and only by collisions. Counts are halved at the end of every window, so
+ * they follow recent traffic.
+ */
+typedef struct sketch {
+    // counters, one row per hash function
+    uint32_t counts[SKETCH_DEPTH][SKETCH_WIDTH];
+
+    // keys with the largest estimates (unsorted)
+    heavy_hitter_t top[TOP_K];
+} sketch_t;
+
+/**
+ * @brief Single-producer single-consumer ring of frames.
+ *
+ * @details Every pair of shards has one: the origin shard's dispatcher is the
+ * only producer and the destination's the only consumer. head and tail sit on
+ * separate cache lines so each side only writes a line the other side reads.
+ */
+typedef struct spsc_ring {
+    // next slot to write, owned by the producer
+    _Alignas(CACHE_LINE) atomic_size_t head;
+
+    // next slot to read, owned by the consumer
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+
+    // frame slots
+    _Alignas(CACHE_LINE) frame_t *slots[SHARD_RING_SIZE];
+} spsc_ring_t;
+
+/**
+ * @brief A shard owns a subset of the clients and everything they send.
+ *
+ * @details In the default mode there is a single shard, fed by one listener
+ * and drained by one dispatcher thread. In per-core mode every shard has its
+ * own SO_REUSEPORT listener and acceptor, its own input queue and its own
+ * dispatcher, all on the shard's CPU. A shard's dispatcher sequences and logs
+ * the messages of its own clients (log_mutex is taken once per batch, so the
+ * log stays in sequence order), writes them to its own clients, and hands
+ * them to every other shard through a dedicated SPSC ring; between its own
+ * batches it drains the rings from the other shards to its clients. Each
+ * shard's messages therefore reach every client in the order they were
+ * sequenced, while messages from different shards may interleave in a
+ * different order at different clients.
+ */
+typedef struct shard {
+    // shard index
+    int id;
+
+    // CPU the shard's threads and its client threads run on (-1 = not pinned)
+    int cpu;
+
+    // clients owned by this shard (linked list)
+    client_t *clients_head;
+
+    // protects clients_head
+    pthread_mutex_t clients_mutex;
+
+    // listening socket accepting this shard's connections (-1 = none)
+    int listen_fd;
+
+    // acceptor and dispatcher threads
+    pthread_t acceptor;
+    pthread_t tid;
+
+    // input queue, on its own cache line since every client thread of the shard writes it
+    _Alignas(CACHE_LINE) pthread_mutex_t msg_mutex;
+    message_t *msg_head;
+    message_t *msg_tail;
+    pthread_cond_t msg_cond;
+
+    // 1 while the dispatcher waits on msg_cond; read without msg_mutex by ring producers
+    atomic_int parked;
+
+    // queued messages, readable without msg_mutex so the dispatcher can spin on it
+    atomic_size_t msg_pending;
+
+    // moving average of the queue depth, x16 fixed point (dispatcher only, except for the stats)
+    unsigned depth_ewma;
+
+    // frames from the other shards, one ring per origin shard (per-core mode only)
+    spsc_ring_t *rings;
+
+    // messages enqueued by this shard's client threads
+    pool_t msg_pool;
+
+    // frames formatted by this shard's dispatcher and client threads
+    pool_t frame_pool;
+} shard_t;
+
+
+// Client shards
+static shard_t *shards[MAX_SHARDS]; // Shard table, the first num_shards entries are valid
+static int num_shards = 1; // Number of shards (1 unless per-core mode is enabled)
+static int per_core_mode = 0; // 1 = every shard accepts, sequences and fans out its own clients' messages
+static __thread shard_t *thread_shard = NULL; // Shard of the calling thread: its client threads queue there, its dispatcher formats frames there
+
+// CPU placement
+static int cpu_list[MAX_CPU_LIST]; // CPUs from --cpus, one per shard in order
+static int cpu_list_len = 0; // Number of entries in cpu_list (0 = threads are not pinned)
+
+// Buffer pools
+static int huge_page_mode = HUGE_OFF; // Page backing requested for pools (--huge-pages)
+static int pool_objects = DEFAULT_POOL_OBJECTS; // Objects per pool (--pool-objects)
+
+// Busy-poll mode
+static int spin_usec = 0; // Dispatcher threads spin this long for work before parking (--spin-us)
+static int busy_poll_usec = 0; // SO_BUSY_POLL budget for client sockets (--busy-poll)
+static atomic_ulong spin_hits = 0; // Waits satisfied while spinning
+static atomic_ulong parks = 0; // Waits that had to park on a condition variable
+
+// TCP tuning
+static int tcp_profile = TCP_PROFILE_DEFAULT; // Socket options applied to accepted clients (--tcp-profile)
+static int notsent_lowat = 0; // TCP_NOTSENT_LOWAT override in bytes (--notsent-lowat, 0 = profile default)
+
+// Zerocopy sends
+static size_t zerocopy_min = 0; // Writes of at least this many bytes use MSG_ZEROCOPY (--zerocopy-min, 0 = off)
+static atomic_ulong zc_sends = 0; // sendmsg() calls made with MSG_ZEROCOPY
+static atomic_ulong zc_copied = 0; // Completions where the kernel copied anyway
+static atomic_ulong zc_fallbacks = 0; // Large writes sent by copying because zerocopy was unavailable
+
+// Delivery acknowledgments
+static atomic_ulong acks_received = 0; // ACK frames that matched an unacknowledged write
+static atomic_ulong ack_overflows = 0; // Unacknowledged writes forgotten because a client's window was full
+static atomic_ulong ack_rtt_avg = 0; // Moving average of write-to-ACK time in microseconds
+
+// Idempotent sends
+static pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects dedup_windows
+static dedup_window_t dedup_windows[DEDUP_SENDERS]; // Per-sender ID windows, kept across reconnects
+static atomic_ulong dedup_checked = 0; // MSGID messages checked
+static atomic_ulong dedup_dropped = 0; // Duplicates dropped
+static atomic_ulong dedup_evictions = 0; // Windows taken over by another sender
+
+// Presence
+static int presence_ms = DEFAULT_PRESENCE_MS; // Coalescing window for presence deltas (--presence-ms)
+static atomic_ulong presence_updates = 0; // TYPING and STATUS commands received
+static atomic_ulong presence_entries = 0; // Per-user entries sent in deltas
+static atomic_ulong presence_deltas = 0; // PRESENCE lines broadcast
+static pthread_mutex_t presence_gone_lock = PTHREAD_MUTEX_INITIALIZER; // Protects presence_gone
+static char (*presence_gone)[MAX_USERNAME] = NULL; // Users who left since the last delta, sent as "offline"
+static int presence_gone_count = 0;
+static int presence_gone_cap = 0;
+
+// Full-text search
+static int search_enabled = 0; // Index the log for SEARCH (--search)
+static pthread_rwlock_t search_lock = PTHREAD_RWLOCK_INITIALIZER; // Readers search, the indexer adds
+static segment_index_t *search_segs = NULL; // One index per log segment, same order as log_segs
+static int search_nsegs = 0; // Segments with an index
+static atomic_ulong search_records = 0; // Log records indexed
+static atomic_ulong search_terms = 0; // Distinct terms over all segments
+static atomic_ulong search_bytes = 0; // Encoded posting bytes
+static latency_hist_t search_latency; // Time to answer SEARCH commands
+
+// Reactions (react_mutex)
+static pthread_mutex_t react_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the reaction table
+static int react_ms = DEFAULT_REACT_MS; // Aggregation window for reaction totals (--react-ms)
+static react_entry_t *react_table = NULL; // Reacted-to messages, open addressing by seq
+static size_t react_cap = 0; // Slots in react_table (a power of two)
+static size_t react_count = 0; // Used slots in react_table
+static uint64_t *react_dirty = NULL; // Messages whose totals changed this window
+static size_t react_ndirty = 0; // Entries in react_dirty
+static size_t react_dirty_cap = 0; // Allocated entries in react_dirty
+static atomic_ulong react_received = 0; // REACT commands accepted
+static atomic_ulong react_updates = 0; // REACTS lines broadcast
+
+// Message log
+static char log_dir[MAX_LOG_PATH - 32] = ""; // Directory for log segments (--log-dir, empty = no log)
+static size_t log_segment_bytes = LOG_SEGMENT_BYTES; // Size at which a segment is sealed (--segment-bytes)
+static int backfill_count = 0; // Logged messages replayed to a client at login (--backfill)
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the segment table and next_seq
+static log_segment_t *log_segs = NULL; // Segments, oldest first
+static int log_nsegs = 0; // Number of segments
+static int log_segs_cap = 0; // Allocated entries in log_segs
+static uint64_t next_seq = 1; // Sequence number of the next broadcast
+static atomic_ulong backfills = 0; // Logins that received backfill
+static atomic_ulong backfill_bytes = 0; // Bytes streamed as backfill
+static atomic_ulong backfill_held = 0; // Live bytes queued for clients while their backfill streamed
+static atomic_ulong backfill_overflows = 0; // Clients cut off for falling too far behind during backfill
+
+// Edit history (log_mutex)
+static history_entry_t *history_ring = NULL; // Recent messages, slot seq & (HISTORY_RING - 1)
+static edit_entry_t *edit_map = NULL; // Edited and deleted messages, open addressing by seq
+static size_t edit_map_cap = 0; // Slots in edit_map (a power of two)
+static size_t edit_map_count = 0; // Used slots in edit_map
+static atomic_ulong history_edits = 0; // EDIT commands accepted
+static atomic_ulong history_deletes = 0; // DELETE commands accepted
+static atomic_ulong history_ring_hits = 0; // Lookups answered from the in-memory ring
+static atomic_ulong history_disk_lookups = 0; // Lookups that read the log index
+static latency_hist_t history_latency; // Time to answer HISTORY commands
+
+// Cold storage
+static int compact_keep = -1; // Newest sealed segments left uncompressed (--compact, -1 = never compact)
+static pthread_rwlock_t segment_lock = PTHREAD_RWLOCK_INITIALIZER; // Read to use segment files outside log_mutex, written to retire a .log
+static pthread_mutex_t cold_cache_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the block cache
+static cold_cache_entry_t cold_cache[COLD_CACHE_BLOCKS]; // Recently decompressed blocks
+static uint64_t cold_cache_clock = 0; // Use counter for evicting the least recently used block
+static atomic_ulong cold_segments = 0; // Segments stored compressed
+static atomic_ulong cold_raw_bytes = 0; // Log bytes in cold segments
+static atomic_ulong cold_file_bytes = 0; // Size of the cold files holding them
+static atomic_ulong cold_block_reads = 0; // Blocks read and decompressed
+static atomic_ulong cold_cache_hits = 0; // Block reads answered from the cache
+static latency_hist_t hot_read_latency; // Time to read a range from an uncompressed segment
+static latency_hist_t cold_read_latency; // Time to read a range from a compressed segment
+static int log_readonly = 0; // Open the log without creating or repairing anything (offline tools)
+
+// Export
+static const char *export_path = NULL; // Columnar file to write from the log (--export)
+static const char *read_export_path = NULL; // Columnar file to check and print (--read-export)
+
+// Blob transfers
+static char blob_dir[MAX_LOG_PATH - 32] = ""; // Directory for uploaded blobs (--blob-dir, empty = disabled)
+static long long blob_max = DEFAULT_BLOB_MAX; // Largest accepted upload in bytes (--blob-max)
+static atomic_ulong next_blob_id = 1; // Id given to the next upload
+static atomic_ulong blob_uploads = 0; // Completed uploads
+static atomic_ulong blob_bytes_in = 0; // Bytes received in uploads
+static atomic_ulong blob_downloads = 0; // Completed downloads
+static atomic_ulong blob_bytes_out = 0; // Bytes streamed to downloaders
+
+// Mentions
+static int mentions_enabled = 0; // Notify users when they are @mentioned (--mentions)
+static pthread_mutex_t mention_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the mention automaton and names
+static ac_automaton_t mention_ac; // "@username" patterns of logged-in users
+static char (*mention_names)[MAX_USERNAME] = NULL; // Username of each pattern id
+static int mention_names_cap = 0;                   // Entries allocated in mention_names
+static atomic_ulong mentions_sent = 0; // Notifications delivered
+static atomic_ulong mention_rebuilds = 0; // Times the automaton was rebuilt to drop logged-out users
+
+// Content filter
+#define FILTER_MASK 0 // replace banned terms with '*'
+#define FILTER_DROP 1 // do not broadcast messages containing banned terms
+static char filter_path[MAX_LOG_PATH] = ""; // Word list, one term per line (--filter, empty = off)
+static int filter_action = FILTER_MASK; // What to do with a match (--filter-action)
+static pthread_rwlock_t filter_lock = PTHREAD_RWLOCK_INITIALIZER; // Dispatchers scan filter_ac, adopting a reload writes it
+static ac_automaton_t *filter_ac = NULL; // Compiled word list in use
+static _Atomic(ac_automaton_t *) filter_pending = NULL; // Freshly reloaded list waiting for a dispatcher to adopt it
+static atomic_int filter_terms = 0; // Terms in the list in use
+static atomic_ulong filter_masked = 0; // Messages with terms masked
+static atomic_ulong filter_dropped = 0; // Messages dropped
+static atomic_ulong filter_reloads = 0; // Successful reloads (SIGHUP)
+
+// Spam detection
+static int spam_threshold = 0; // Copies of one text allowed per window before more are dropped (--spam-threshold, 0 = off)
+static int spam_window_sec = DEFAULT_SPAM_WINDOW; // Length of a detection window (--spam-window)
+static pthread_mutex_t spam_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the sketches and spam_window_end
+static sketch_t spam_texts; // Fingerprints of message texts
+static sketch_t spam_senders; // Senders of dropped copies (strikes)
+static uint64_t spam_window_end = 0; // now_usec() at which the current window closes
+static atomic_ulong spam_dropped = 0; // Messages dropped as repeated spam
+static atomic_ulong spam_throttled = 0; // Messages dropped because their sender was throttled
+
+// Connection admission
+static char blocklist_path[MAX_LOG_PATH] = ""; // Blocked addresses and CIDR prefixes (--blocklist, empty = off)
+static int max_per_ip = 0; // Concurrent connections allowed per address (--max-per-ip, 0 = unlimited)
+static ip_trie_t *blocklist = NULL; // Blocklist in use, owned by the accept loop
+static _Atomic(ip_trie_t *) blocklist_pending = NULL; // Freshly reloaded blocklist waiting for the accept loop
+static pthread_mutex_t ip_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects ip_counts and ip_tracked
+static ip_count_t ip_counts[IP_TABLE_SIZE]; // Open connections per address (linear probing)
+static int ip_tracked = 0; // Addresses in ip_counts
+static atomic_int blocklist_prefixes = 0; // Prefixes in the blocklist in use
+static atomic_ulong blocklist_reloads = 0; // Successful reloads (SIGHUP)
+static atomic_ulong conn_blocked = 0; // Connections refused by the blocklist
+static atomic_ulong conn_limited = 0; // Connections refused by the per-address cap
+
+// Authentication
+static credential_t server_cred; // Server password (--password-hash, or SERVER_PASSWORD hashed at startup)
+static char password_hash[256] = ""; // Stored form of the server password given on the command line
+static char accounts_path[MAX_LOG_PATH] = ""; // User accounts, "name:credential" per line (--accounts, empty = open logins)
+static account_t *accounts = NULL; // Accounts sorted by username
+static int num_accounts = 0; // Entries in accounts
+static char store_path[MAX_LOG_PATH] = ""; // Account store file (--account-store, empty = none)
+static pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER; // Held for reading during lookups, for writing to remap
+static store_header_t *store_map = NULL; // The mapped store file
+static size_t store_map_len = 0; // Length of the mapping
+static ino_t store_ino = 0; // Inode of the mapped file, to notice when it was replaced
+static atomic_ulong store_remaps = 0; // Times the store was mapped again after being replaced
+static const char *store_admin_user = NULL; // Account to change (--set-account / --del-account)
+static int store_admin_delete = 0; // 1 = delete store_admin_user, 0 = set its password
+static int auth_workers = DEFAULT_AUTH_WORKERS; // Threads hashing passwords (--auth-workers)
+static pthread_t *auth_tids = NULL; // The auth worker threads
+static pthread_mutex_t auth_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the auth queue
+static pthread_cond_t auth_cond = PTHREAD_COND_INITIALIZER; // Signals queued jobs (and shutdown) to workers
+static auth_job_t *auth_head = NULL; // Oldest queued job
+static auth_job_t *auth_tail = NULL; // Newest queued job
+static int auth_queued = 0; // Jobs in the queue
+static int auth_stopped = 0; // 1 once workers drain the queue and exit (protected by auth_mutex)
+static atomic_ulong auth_ok = 0; // Successful verifications
+static atomic_ulong auth_failed = 0; // Failed verifications
+static atomic_ulong auth_busy = 0; // Verifications refused because the queue was full
+
+// Offline mailboxes
+static char mailbox_dir[MAX_LOG_PATH - 80] = ""; // Directory for undelivered DMs (--mailbox-dir, empty = DMs need the recipient online)
+static long mailbox_quota = DEFAULT_MAILBOX_QUOTA; // Largest mailbox in bytes (--mailbox-quota)
+static long mailbox_total = DEFAULT_MAILBOX_TOTAL; // Largest total of all mailboxes in bytes (--mailbox-total)
+static atomic_long mailbox_bytes = 0; // Bytes currently stored across all mailboxes
+static pthread_mutex_t mailbox_locks[MAILBOX_LOCKS]; // Serialize delivery decisions per recipient (striped by name)
+static atomic_ulong dm_live = 0; // DMs delivered to an online recipient
+static atomic_ulong dm_stored = 0; // DMs stored for an offline recipient
+static atomic_ulong dm_delivered = 0; // Stored DMs delivered at login
+static atomic_ulong dm_rejected = 0; // DMs refused because the mailbox was full
+
+// Adaptive micro-batching (the queue depth average lives in each shard)
+static int batch_budget_usec = 0; // Longest a message may be held back to coalesce writes (--batch-budget-us, 0 = off)
+static atomic_ulong batches = 0; // Batches delivered
+static atomic_ulong batched_frames = 0; // Frames delivered in those batches
+static atomic_ulong batches_waited = 0; // Batches that were held open waiting for more messages
+
+static _Alignas(CACHE_LINE) volatile int server_running = 1; // Server running flag
+
+/**
+ *  @brief Sends all bytes in the buffer to the specified file descriptor.
+ * 
+ * @details This function attempts to send the entire buffer of length 'len' to the
+ * 
+ * @param fd The file descriptor to send data to.
+ * @param buf Pointer to the buffer containing data to send.
+ * @param len The length of the buffer in bytes.
+ * @return ssize_t : The total number of bytes sent, or -1 on error.
+ * 
+ */
+ssize_t send_all(int fd, const void *buf, size_t len) {
+    size_t total = 0;
+    const char *p = buf;
+    while (total < len) {
+        ssize_t n = send(fd, p + total, len - total, 0);
+        if (n <= 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/**
+ * @brief Writes all bytes in the buffer to a file descriptor.
+ * 
+ * @param fd The file descriptor to write to.
+ * @param buf Pointer to the data.
+ * @param len The length of the data in bytes.
+ * @return int 0 on success, -1 on error.
+ */
+int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the NUMA node a CPU belongs to.
+ * 
+ * @param cpu The CPU number.
+ * @return int The node number, or -1 if unknown.
+ */
+int cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    int node = -1;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+            node = atoi(e->d_name + 4);
+            break;
+        }
+    }
+    closedir(d);
+    return node;
+}
+
+/**
+ * @brief Checks whether transparent huge pages can be requested with madvise().
+ * 
+ * @return int 1 if THP is enabled in "always" or "madvise" mode, 0 otherwise.
+ */
+int thp_available(void) {
+    char mode[128] = "";
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!fp) return 0;
+    if (!fgets(mode, sizeof(mode), fp)) mode[0] = '\0';
+    fclose(fp);
+    return strstr(mode, "[never]") == NULL && mode[0] != '\0';
+}
+
+/**
+ * @brief Allocates a zeroed memory region on the NUMA node of a CPU, optionally with huge pages.
+ * 
+ * @details Explicit huge pages come from the hugetlbfs reserve and fall back
+ * to transparent huge pages when the reserve is empty. THP regions are aligned
+ * to the huge page size so the kernel can actually back them with huge pages.
+ * The node preference is set with mbind() before the pages are touched, so
+ * they are faulted in on that node.
+ * 
+ * @param size Number of bytes; updated to the size actually mapped.
+ * @param cpu The CPU whose node should hold the memory, or -1.
+ * @param huge One of HUGE_OFF, HUGE_THP or HUGE_EXPLICIT.
+ * @param backing Receives "hugetlb", "thp" or "normal" (may be NULL).
+ * @return void* The memory, or NULL if allocation failed.
+ */
+void *region_alloc(size_t *size, int cpu, int huge, const char **backing) {
+    size_t len = *size;
+    const char *how = "normal";
+    void *p = MAP_FAILED;
+
+    if (huge == HUGE_EXPLICIT) {
+        size_t hlen = (len + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        p = mmap(NULL, hlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            len = hlen;
+            how = "hugetlb";
+        }
+    }
+    if (p == MAP_FAILED && huge != HUGE_OFF && thp_available()) {
+        // Over-map and trim so the region starts on a huge page boundary
+        size_t hlen = (len + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        char *raw = mmap(NULL, hlen + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED) {
+            char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+            if (aligned > raw) munmap(raw, aligned - raw);
+            munmap(aligned + hlen, (raw + hlen + HUGE_PAGE_SIZE) - (aligned + hlen));
+            p = aligned;
+            len = hlen;
+            how = (madvise(p, len, MADV_HUGEPAGE) == 0) ? "thp" : "normal";
+        }
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return NULL;
+    }
+
+    int node = (cpu >= 0) ? cpu_node(cpu) : -1;
+    if (node >= 0 && node < (int)(8 * sizeof(unsigned long))) {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, p, len, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0);
+    }
+    memset(p, 0, len); // fault the pages in on the preferred node
+
+    *size = len;
+    if (backing) *backing = how;
+    return p;
+}
+
+/**
+ * @brief Allocates zeroed, page-aligned memory on the NUMA node of a CPU.
+ * 
+ * @param size Number of bytes.
+ * @param cpu The CPU whose node should hold the memory, or -1.
+ * @return void* The memory, or NULL if allocation failed.
+ */
+void *numa_alloc_on_cpu(size_t size, int cpu) {
+    return region_alloc(&size, cpu, HUGE_OFF, NULL);
+}
+
+/**
+ * @brief Initializes an object pool in a region placed near a CPU.
+ * 
+ * @param pl The pool to initialize.
+ * @param name Name used in stats.
+ * @param obj_size Size of one object in bytes.
+ * @param count Number of objects to reserve.
+ * @param cpu The CPU whose node should hold the region, or -1.
+ * @return int 0 on success, -1 if the region could not be allocated.
+ */
+int pool_init(pool_t *pl, const char *name, size_t obj_size, size_t count, int cpu) {
+    memset(pl, 0, sizeof(*pl));
+    pthread_mutex_init(&pl->lock, NULL);
+    snprintf(pl->name, sizeof(pl->name), "%s", name);
+    pl->obj_size = (obj_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    pl->backing = "none";
+    if (count == 0) return 0;
+
+    pl->region_size = pl->obj_size * count;
+    pl->base = region_alloc(&pl->region_size, cpu, huge_page_mode, &pl->backing);
+    if (!pl->base) return -1;
+
+    // Huge page rounding may leave room for extra objects
+    pl->capacity = pl->region_size / pl->obj_size;
+    for (size_t i = pl->capacity; i-- > 0;) {
+        void *obj = pl->base + i * pl->obj_size;
+        *(void **)obj = pl->free_list;
+        pl->free_list = obj;
+    }
+    return 0;
+}
+
+/**
+ * @brief Takes an object from a pool, or from malloc() if the pool is empty.
+ * 
+ * @param pl The pool (NULL = always malloc).
+ * @param size Size needed; larger than the pool's objects means malloc.
+ * @return void* Uninitialized memory, or NULL if allocation failed.
+ */
+void *pool_alloc(pool_t *pl, size_t size) {
+    if (pl && size <= pl->obj_size) {
+        pthread_mutex_lock(&pl->lock);
+        void *obj = pl->free_list;
+        if (obj) {
+            pl->free_list = *(void **)obj;
+            pl->in_use++;
+        }
+        pthread_mutex_unlock(&pl->lock);
+        if (obj) return obj;
+        atomic_fetch_add_explicit(&pl->overflow, 1, memory_order_relaxed);
+    }
+    return malloc(size);
+}
+
+/**
+ * @brief Returns an object to the pool it came from (or to free()).
+ * 
+ * @param pl The pool the object may belong to (may be NULL).
+ * @param obj The object to release.
+ */
+void pool_free(pool_t *pl, void *obj) {
+    if (!obj) return;
+    if (pl && (char *)obj >= pl->base && (char *)obj < pl->base + pl->region_size) {
+        pthread_mutex_lock(&pl->lock);
+        *(void **)obj = pl->free_list;
+        pl->free_list = obj;
+        pl->in_use--;
+        pthread_mutex_unlock(&pl->lock);
+        return;
+    }
+    free(obj);
+}
+
+/**
+ * @brief Prepares thread attributes that pin a new thread to one CPU.
+ * 
+ * @param attr The attributes to initialize (destroy with pthread_attr_destroy).
+ * @param cpu The CPU to pin to, or -1 to leave the thread unpinned.
+ */
+void thread_attr_for_cpu(pthread_attr_t *attr, int cpu) {
+    pthread_attr_init(attr);
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/**
+ * @brief Parses a CPU list such as "0,2,4-7" into cpu_list.
+ * 
+ * @param spec The list text.
+ * @return int 0 on success, -1 if the list is malformed.
+ */
+int parse_cpu_list(const char *spec) {
+    cpu_list_len = 0;
+    const char *p = spec;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0 || lo >= CPU_SETSIZE) return -1;
+        long hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo || hi >= CPU_SETSIZE) return -1;
+            p = end;
+        }
+        for (long cpu = lo; cpu <= hi && cpu_list_len < MAX_CPU_LIST; cpu++) {
+            cpu_list[cpu_list_len++] = (int)cpu;
+        }
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    return cpu_list_len > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Picks the CPU for a shard's threads from cpu_list.
+ * 
+ * @details Slot i is shard i (in the default mode, slot 0 is the single
+ * dispatcher). Shards wrap around the list when there are more of them than
+ * CPUs listed.
+ * 
+ * @param slot The thread slot.
+ * @return int The CPU, or -1 if threads are not pinned.
+ */
+int cpu_for_slot(int slot) {
+    if (cpu_list_len == 0) return -1;
+    return cpu_list[slot % cpu_list_len];
+}
+
+/**
+ * @brief Applies the selected TCP tuning profile to an accepted client socket.
+ * 
+ * @details The latency profile disables Nagle so short chat lines leave at
+ * once. Both profiles cap the unsent data the kernel keeps queued
+ * (TCP_NOTSENT_LOWAT), so slow readers do not bloat socket buffers.
+ * 
+ * @param fd The client socket.
+ */
+void apply_tcp_profile(int fd) {
+    if (tcp_profile == TCP_PROFILE_DEFAULT && notsent_lowat == 0) return;
+
+    int lowat = notsent_lowat;
+    if (tcp_profile == TCP_PROFILE_LATENCY) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (!lowat) lowat = LATENCY_NOTSENT_LOWAT;
+    } else if (tcp_profile == TCP_PROFILE_THROUGHPUT) {
+        if (!lowat) lowat = THROUGHPUT_NOTSENT_LOWAT;
+    }
+    if (lowat > 0) setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+}
+
+/**
+ * @brief Returns a monotonic timestamp in microseconds.
+ * 
+ * @return uint64_t Microseconds since an arbitrary point.
+ */
+uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Records one latency sample.
+ * 
+ * @param h The histogram.
+ * @param usec The sample in microseconds.
+ */
+void latency_record(latency_hist_t *h, uint64_t usec) {
+    int b = usec ? 63 - __builtin_clzll(usec) : 0;
+    if (b >= LATENCY_BUCKETS) b = LATENCY_BUCKETS - 1;
+    atomic_fetch_add_explicit(&h->buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total_usec, usec, memory_order_relaxed);
+}
+
+/**
+ * @brief Returns the upper bound of the bucket holding a percentile.
+ * 
+ * @param h The histogram.
+ * @param pct The percentile (1-100).
+ * @return uint64_t The bound in microseconds, 0 if there are no samples.
+ */
+uint64_t latency_percentile(latency_hist_t *h, int pct) {
+    uint64_t count = atomic_load(&h->count), seen = 0;
+    if (count == 0) return 0;
+    uint64_t want = (count * pct + 99) / 100;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += atomic_load(&h->buckets[b]);
+        if (seen >= want) return 2ULL << b;
+    }
+    return 2ULL << (LATENCY_BUCKETS - 1);
+}
+
+/**
+ * @brief Queues output for a client whose backfill is still being streamed.
+ *
+ * @details Broadcasters (and DM or mention senders) never wait for a
+ * backfill: while it streams, their writes are appended to the client's
+ * held queue, which the client thread writes out right after the backfill.
+ * A client that falls more than BACKFILL_HOLD_MAX behind is cut off.
+ *
+ * @param c The client.
+ * @param iov The data.
+ * @param n Number of buffers.
+ * @return int 0 if queued, -1 if the client was cut off, 1 if it is live and the caller should write.
+ */
+int client_hold(client_t *c, const struct iovec *iov, int n) {
+    if (!atomic_load_explicit(&c->backfilling, memory_order_acquire)) return 1;
+    size_t total = 0;
+    for (int i = 0; i < n; i++) total += iov[i].iov_len;
+
+    pthread_mutex_lock(&c->hold_lock);
+    int rc = 0;
+    if (!atomic_load_explicit(&c->backfilling, memory_order_relaxed)) {
+        rc = 1;
+    } else if (c->held_overflow || c->held_len + total > BACKFILL_HOLD_MAX) {
+        if (!c->held_overflow) {
+            shutdown(c->sockfd, SHUT_RDWR); // ends the backfill; the client thread then disconnects
+            atomic_fetch_add_explicit(&backfill_overflows, 1, memory_order_relaxed);
+        }
+        c->held_overflow = 1;
+        rc = -1;
+    } else {
+        if (c->held_len + total > c->held_cap) {
+            size_t cap = c->held_cap ? c->held_cap : 4096;
+            while (cap < c->held_len + total) cap *= 2;
+            char *grown = realloc(c->held, cap);
+            if (!grown) {
+                pthread_mutex_unlock(&c->hold_lock);
+                return -1;
+            }
+            c->held = grown;
+            c->held_cap = cap;
+        }
+        for (int i = 0; i < n; i++) {
+            memcpy(c->held + c->held_len, iov[i].iov_base, iov[i].iov_len);
+            c->held_len += iov[i].iov_len;
+        }
+        atomic_fetch_add_explicit(&backfill_held, total, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&c->hold_lock);
+    return rc;
+}
+
+/**
+ * @brief Writes out a client's held output and makes it live (client thread, after its backfill).
+ *
+ * @details Output keeps being queued until the queue is found empty under
+ * hold_lock, at which point writers switch to the socket; nothing can slip
+ * in between, so the original order is kept.
+ *
+ * @param c The client.
+ */
+void client_release_held(client_t *c) {
+    for (;;) {
+        pthread_mutex_lock(&c->hold_lock);
+        char *buf = c->held;
+        size_t len = c->held_len;
+        c->held = NULL;
+        c->held_len = c->held_cap = 0;
+        if (len == 0) atomic_store_explicit(&c->backfilling, 0, memory_order_release);
+        pthread_mutex_unlock(&c->hold_lock);
+        if (len == 0) {
+            free(buf);
+            return;
+        }
+        pthread_mutex_lock(&c->send_lock);
+        send_all(c->sockfd, buf, len);
+        pthread_mutex_unlock(&c->send_lock);
+        free(buf);
+    }
+}
+
+/**
+ * @brief Sends a buffer to a client, serialized with every other write to its socket.
+ *
+ * @param c The client to send to.
+ * @param buf Pointer to the buffer containing data to send.
+ * @param len The length of the buffer in bytes.
+ * @return ssize_t The total number of bytes sent (or queued), or -1 on error.
+ */
+ssize_t client_send(client_t *c, const void *buf, size_t len) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    int held = client_hold(c, &iov, 1);
+    if (held <= 0) return held < 0 ? -1 : (ssize_t)len;
+    pthread_mutex_lock(&c->send_lock);
+    ssize_t n = send_all(c->sockfd, buf, len);
+    pthread_mutex_unlock(&c->send_lock);
+    return n;
+}
+
+/**
+ * @brief Returns the frame pool of the calling thread's shard (NULL = malloc).
+ */
+static inline pool_t *thread_frame_pool(void) {
+    return thread_shard ? &thread_shard->frame_pool : NULL;
+}
+
+/**
+ * @brief Formats a broadcast frame holding one reference.
+ *
+ * @param sender The username of the sender.
+ * @param text The message text.
+ * @return frame_t* The new frame, or NULL if allocation failed.
+ */
+frame_t *frame_format(const char *sender, const char *text) {
+    // format: username: text\n
+    size_t cap = FRAME_CAP;
+    frame_t *f = pool_alloc(thread_frame_pool(), sizeof(frame_t) + cap);
+    if (!f) return NULL;
+    f->pool = thread_frame_pool();
+    int n = snprintf(f->data, cap, "%s: %s\n", sender, text);
+    f->len = (n < 0) ? 0 : ((size_t)n >= cap ? cap - 1 : (size_t)n);
+    f->seq = 0;
+    f->ephemeral = 0;
+    f->flags = 0;
+    f->target = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    f->ts_usec = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    atomic_init(&f->refs, 1);
+    return f;
+}
+
+/**
+ * @brief Formats an ephemeral frame carrying a complete server line.
+ *
+ * @param line The line, without the newline.
+ * @return frame_t* The new frame, or NULL if allocation failed.
+ */
+frame_t *frame_format_raw(const char *line) {
+    frame_t *f = pool_alloc(thread_frame_pool(), sizeof(frame_t) + FRAME_CAP);
+    if (!f) return NULL;
+    f->pool = thread_frame_pool();
+    int n = snprintf(f->data, FRAME_CAP, "%s\n", line);
+    f->len = (n < 0) ? 0 : ((size_t)n >= FRAME_CAP ? FRAME_CAP - 1 : (size_t)n);
+    f->seq = 0;
+    f->ephemeral = 1;
+    f->flags = 0;
+    f->target = 0;
+    f->ts_usec = 0;
+    atomic_init(&f->refs, 1);
+    return f;
+}
+
+/**
+ * @brief Formats a delta frame for an earlier message.
+ *
+ * @details Deltas name the message by sequence number instead of re-sending
+ * it: "EDIT:<seq>:<username>: <text>" carries only the new line,
+ * "DELETE:<seq>" nothing else, and "REACTS:<seq>:<name>=<count>,..." the
+ * message's reaction totals.
+ *
+ * @param kind MSG_EDIT, MSG_DELETE or MSG_REACTS.
+ * @param target Sequence number of the message.
+ * @param sender The message's author (MSG_EDIT only).
+ * @param text The new text or the totals.
+ * @return frame_t* The new frame, or NULL if allocation failed.
+ */
+frame_t *frame_format_delta(int kind, uint64_t target, const char *sender, const char *text) {
+    frame_t *f = frame_format(sender, "");
+    if (!f) return NULL;
+    unsigned long long t = (unsigned long long)target;
+    int n = kind == MSG_EDIT ? snprintf(f->data, FRAME_CAP, "EDIT:%llu:%s: %s\n", t, sender, text)
+          : kind == MSG_REACTS ? snprintf(f->data, FRAME_CAP, "REACTS:%llu:%s\n", t, text)
+          : snprintf(f->data, FRAME_CAP, "DELETE:%llu\n", t);
+    f->len = (n < 0) ? 0 : ((size_t)n >= FRAME_CAP ? FRAME_CAP - 1 : (size_t)n);
+    f->flags = kind == MSG_EDIT ? LOG_EDIT : kind == MSG_REACTS ? LOG_REACT : LOG_DELETE;
+    f->target = target;
+    return f;
+}
+
+/**
+ * @brief Drops one reference to a frame, freeing it with the last one.
+ *
+ * @details The last reference may be dropped by another shard's dispatcher
+ * or a client thread; the frame still goes back to the pool it came from.
+ *
+ * @param f The frame to release.
+ */
+void frame_put(frame_t *f) {
+    if (f && atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) {
+        pool_free(f->pool, f);
+    }
+}
+
+/**
+ * @brief Writes an entire iovec array, resuming after partial writes.
+ * 
+ * @param fd The file descriptor to write to.
+ * @param iov The buffers to write (modified as data is consumed).
+ * @param iovcnt Number of buffers.
+ * @return int 0 on success, -1 on error.
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        // Skip fully written buffers and trim the first partial one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Applies one zerocopy completion range to a client's pending sends.
+ * 
+ * @param c The client (send_lock held).
+ * @param lo First completed id.
+ * @param hi Last completed id.
+ */
+void zc_complete(client_t *c, uint32_t lo, uint32_t hi) {
+    zc_send_t **pp = &c->zc_head;
+    while (*pp) {
+        zc_send_t *z = *pp;
+        uint32_t zlo = z->id_lo, zhi = z->id_lo + z->id_count - 1;
+        uint32_t a = lo > zlo ? lo : zlo;
+        uint32_t b = hi < zhi ? hi : zhi;
+        if (a <= b) z->remaining -= (b - a + 1);
+        if (z->remaining == 0) {
+            // The kernel is done with these frames
+            for (int i = 0; i < z->nframes; i++) frame_put(z->frames[i]);
+            *pp = z->next;
+            c->zc_count--;
+            free(z);
+        } else {
+            pp = &z->next;
+        }
+    }
+}
+
+/**
+ * @brief Reads pending zerocopy notifications from a client's error queue.
+ * 
+ * @param c The client (send_lock held).
+ * @return int Number of notifications read.
+ */
+int zc_reap(client_t *c) {
+    int got = 0;
+    while (c->zc_head) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+        got++;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                atomic_fetch_add_explicit(&zc_copied, 1, memory_order_relaxed);
+            }
+            zc_complete(c, ee->ee_info, ee->ee_data);
+        }
+    }
+    return got;
+}
+
+/**
+ * @brief Waits a bounded time for a closing client's zerocopy completions.
+ * 
+ * @details A send completes once the peer has acknowledged its data, so a
+ * healthy connection drains within a round trip or two; the bound is for a
+ * peer that stopped reading. Notifications make poll() report POLLERR.
+ * 
+ * @param c The client, already removed from its shard so nothing else sends to it.
+ * @param ms The longest wait, in milliseconds.
+ */
+void zc_drain(client_t *c, int ms) {
+    uint64_t deadline = now_usec() + (uint64_t)ms * 1000;
+    pthread_mutex_lock(&c->send_lock);
+    zc_reap(c);
+    while (c->zc_head) {
+        uint64_t now = now_usec();
+        if (now >= deadline) break;
+        int left = (int)((deadline - now + 999) / 1000);
+        struct pollfd pfd = { .fd = c->sockfd, .events = 0 };
+        int n = poll(&pfd, 1, left);
+        if (zc_reap(c) == 0 && n > 0) {
+            // Ready for another reason (a hangup or socket error): don't spin on it
+            struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+    pthread_mutex_unlock(&c->send_lock);
+}
+
+/**
+ * @brief Reaps the zerocopy completions of idle clients.
+ * 
+ * @details Completions are otherwise read only on a client's next zerocopy
+ * send, so a client that stops receiving large writes would keep its last
+ * frames pinned. Called from the ticker; a client whose send_lock is busy
+ * is skipped, since whoever holds it is sending and reaps anyway.
+ */
+void zc_tick(void) {
+    for (int i = 0; i < num_shards; i++) {
+        shard_t *s = shards[i];
+        pthread_mutex_lock(&s->clients_mutex);
+        for (client_t *c = s->clients_head; c; c = c->next) {
+            if (!c->zerocopy || pthread_mutex_trylock(&c->send_lock) != 0) continue;
+            if (c->zc_head) zc_reap(c);
+            pthread_mutex_unlock(&c->send_lock);
+        }
+        pthread_mutex_unlock(&s->clients_mutex);
+    }
+}
+
+/**
+ * @brief Drops every pending zerocopy send of a client that is going away.
+ * 
+ * @details Must run after the socket is closed. close_and_free_client()
+ * first waits up to ZC_CLOSE_WAIT_MS for the completions. Sends still
+ * missing one after that are data the kernel may transmit (or retransmit)
+ * straight from the frames, so such a connection is reset (SO_LINGER 0),
+ * which discards its write queue, rather than let a frame be reused while it
+ * could still go out on the wire.
+ * 
+ * @param c The client.
+ */
+void zc_release_all(client_t *c) {
+    while (c->zc_head) {
+        zc_send_t *z = c->zc_head;
+        c->zc_head = z->next;
+        for (int i = 0; i < z->nframes; i++) frame_put(z->frames[i]);
+        free(z);
+    }
+    c->zc_count = 0;
+}
+
+/**
+ * @brief Sends frames with MSG_ZEROCOPY, keeping them alive until the kernel is done.
+ * 
+ * @param c The client (send_lock held).
+ * @param iov The frame buffers (modified as data is consumed).
+ * @param frames The frames behind iov.
+ * @param n Number of frames.
+ * @return int 0 on success, -1 on error, 1 if zerocopy is unavailable and the caller should copy.
+ */
+int zc_writev_all(client_t *c, struct iovec *iov, frame_t **frames, int n) {
+    zc_reap(c);
+    if (c->zc_count >= ZC_MAX_PENDING) return 1;
+
+    zc_send_t *z = malloc(sizeof(zc_send_t));
+    if (!z) return 1;
+    z->id_lo = c->zc_next_id;
+    z->id_count = 0;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    int rc = 0;
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(c->sockfd, &msg, MSG_ZEROCOPY);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && errno == ENOBUFS && z->id_count == 0) {
+            // Out of optmem for notifications before anything was sent: just copy
+            free(z);
+            return 1;
+        }
+        if (sent <= 0) {
+            rc = -1;
+            break;
+        }
+        z->id_count++; // every successful zerocopy sendmsg() consumes one id
+        atomic_fetch_add_explicit(&zc_sends, 1, memory_order_relaxed);
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    if (z->id_count == 0) {
+        free(z);
+        return rc;
+    }
+
+    // Hold the frames until the completions for these ids arrive
+    c->zc_next_id += z->id_count;
+    z->remaining = z->id_count;
+    z->nframes = n;
+    for (int i = 0; i < n; i++) {
+        atomic_fetch_add_explicit(&frames[i]->refs, 1, memory_order_relaxed);
+        z->frames[i] = frames[i];
+    }
+    z->next = NULL;
+    zc_send_t **pp = &c->zc_head;
+    while (*pp) pp = &(*pp)->next;
+    *pp = z;
+    c->zc_count++;
+    return rc;
+}
+
+/**
+ * @brief Remembers a write to an ACK-mode client (send_lock held).
+ * 
+ * @details Each write keeps the range of sequence numbers it carried. Within
+ * a write they ascend, but in per-core mode writes from different shards
+ * interleave, so a later write may carry lower numbers; sent_seq is the
+ * highest written so far. A full window forgets its oldest entry.
+ * 
+ * @param c The client.
+ * @param first First sequence number written.
+ * @param seq Last sequence number written.
+ */
+void ack_track(client_t *c, uint64_t first, uint64_t seq) {
+    if (!c->unacked) return;
+    if (c->unacked_count == ACK_WINDOW) {
+        c->unacked_head = (c->unacked_head + 1) % ACK_WINDOW;
+        c->unacked_count--;
+        atomic_fetch_add_explicit(&ack_overflows, 1, memory_order_relaxed);
+    }
+    ack_pending_t *e = &c->unacked[(c->unacked_head + c->unacked_count) % ACK_WINDOW];
+    e->first_seq = first;
+    e->seq = seq;
+    e->sent_usec = now_usec();
+    c->unacked_count++;
+    if (seq > c->sent_seq) c->sent_seq = seq;
+}
+
+/**
+ * @brief Writes frames to an ACK-mode client, each prefixed with "#<seq> ".
+ * 
+ * @details The prefixes live on the stack, so these writes always copy
+ * rather than use MSG_ZEROCOPY. Ephemeral frames go out unprefixed.
+ * 
+ * @param c The client.
+ * @param frames The frames, in order.
+ * @param n Number of frames (at most BATCH_MAX).
+ * @return int 0 on success, -1 on error.
+ */
+int ack_send_frames(client_t *c, frame_t **frames, int n) {
+    struct iovec iov[2 * BATCH_MAX];
+    char prefix[BATCH_MAX][24];
+    uint64_t first = 0, last = 0;
+    for (int i = 0; i < n; i++) {
+        // Ephemeral frames have no sequence number to acknowledge
+        int len = frames[i]->seq ? snprintf(prefix[i], sizeof(prefix[i]), "#%llu ", (unsigned long long)frames[i]->seq) : 0;
+        if (frames[i]->seq && !first) first = frames[i]->seq;
+        if (frames[i]->seq) last = frames[i]->seq;
+        iov[2 * i].iov_base = prefix[i];
+        iov[2 * i].iov_len = len;
+        iov[2 * i + 1].iov_base = frames[i]->data;
+        iov[2 * i + 1].iov_len = frames[i]->len;
+    }
+    pthread_mutex_lock(&c->send_lock);
+    int rc = writev_all(c->sockfd, iov, 2 * n);
+    if (rc == 0 && last) ack_track(c, first, last);
+    pthread_mutex_unlock(&c->send_lock);
+    return rc;
+}
+
+/**
+ * @brief Turns ACK mode on or off for a client (ACKS:ON / ACKS:OFF).
+ * 
+ * @param c The client.
+ * @param on 1 to enable.
+ * @return int 0 on success, -1 if the window could not be allocated.
+ */
+int ack_set_mode(client_t *c, int on) {
+    pthread_mutex_lock(&c->send_lock);
+    if (on && !c->unacked) c->unacked = malloc(ACK_WINDOW * sizeof(ack_pending_t));
+    int rc = (on && !c->unacked) ? -1 : 0;
+    if (rc == 0) {
+        c->unacked_head = c->unacked_count = 0;
+        c->acked_seq = c->sent_seq = 0;
+        atomic_store(&c->ack_mode, on);
+    }
+    pthread_mutex_unlock(&c->send_lock);
+    return rc;
+}
+
+/**
+ * @brief Applies a cumulative ACK: everything written up to seq has reached the client.
+ * 
+ * @details The client acknowledges the last sequence number it read. TCP
+ * delivers writes in order, so that write and every earlier one arrived,
+ * whatever numbers they carried. Trimming pops whole writes off the front of
+ * the window, so an ACK costs one step per write it covers no matter how
+ * many frames those held; the write holding seq is popped once seq is its
+ * last number.
+ * 
+ * @param c The client.
+ * @param seq Last sequence number the client has received.
+ */
+void ack_receive(client_t *c, uint64_t seq) {
+    pthread_mutex_lock(&c->send_lock);
+    int k = 0;
+    while (k < c->unacked_count) {
+        ack_pending_t *e = &c->unacked[(c->unacked_head + k) % ACK_WINDOW];
+        if (seq >= e->first_seq && seq <= e->seq) break;
+        k++;
+    }
+    if (k < c->unacked_count) {
+        c->acked_seq = seq;
+        if (c->unacked[(c->unacked_head + k) % ACK_WINDOW].seq == seq) k++;
+        uint64_t sent = 0;
+        for (; k > 0; k--) {
+            sent = c->unacked[c->unacked_head].sent_usec;
+            c->unacked_head = (c->unacked_head + 1) % ACK_WINDOW;
+            c->unacked_count--;
+        }
+        if (sent) {
+            long rtt = (long)(now_usec() - sent);
+            long avg = (long)atomic_load_explicit(&ack_rtt_avg, memory_order_relaxed);
+            atomic_store_explicit(&ack_rtt_avg, (unsigned long)(avg + (rtt - avg) / 8), memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&acks_received, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&c->send_lock);
+}
+
+/**
+ * @brief Writes a batch of frames to a client with a single gathered write.
+ * 
+ * @param c The client to send to.
+ * @param frames The frames, in order.
+ * @param n Number of frames (at most BATCH_MAX).
+ * @return int 0 on success, -1 on error.
+ */
+int client_send_frames(client_t *c, frame_t **frames, int n) {
+    if (atomic_load_explicit(&c->ack_mode, memory_order_relaxed)) return ack_send_frames(c, frames, n);
+
+    struct iovec iov[BATCH_MAX];
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = frames[i]->data;
+        iov[i].iov_len = frames[i]->len;
+        total += frames[i]->len;
+    }
+    int held = client_hold(c, iov, n);
+    if (held <= 0) return held;
+
+    // Large writes skip the per-recipient copy into the socket buffer
+    if (zerocopy_min > 0 && total >= zerocopy_min) {
+        pthread_mutex_lock(&c->send_lock);
+        int rc = c->zerocopy ? zc_writev_all(c, iov, frames, n) : 1;
+        pthread_mutex_unlock(&c->send_lock);
+        if (rc <= 0) return rc;
+        atomic_fetch_add_explicit(&zc_fallbacks, 1, memory_order_relaxed);
+    }
+    // In the throughput profile, cork the socket so a batch leaves in full-sized segments
+    int cork = (tcp_profile == TCP_PROFILE_THROUGHPUT && n > 1);
+    int on = 1, off = 0;
+    pthread_mutex_lock(&c->send_lock);
+    if (cork) setsockopt(c->sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    int rc = writev_all(c->sockfd, iov, n);
+    if (cork) setsockopt(c->sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    pthread_mutex_unlock(&c->send_lock);
+    return rc;
+}
+
+/**
+ * @brief Writes a batch of frames to every logged-in client of a shard.
+ *
+ * @param s The shard whose clients receive the frames.
+ * @param frames The frames, in order.
+ * @param n Number of frames (at most BATCH_MAX).
+ */
+void shard_broadcast(shard_t *s, frame_t **frames, int n) {
+    pthread_mutex_lock(&s->clients_mutex);
+    client_t *c = s->clients_head;
+
+    // While the client is active, check to see if the other clients are active.
+    // We can make this into a function later in the future if we want to specify a minumum number of clients
+    while (c) {
+        if (c->logged_in) {
+            // Frames logged before the client went live already reached it as backfill
+            int skip = 0;
+            for (int i = 0; i < n; i++) {
+                if (frames[i]->seq && frames[i]->seq < c->live_from) skip = i + 1;
+            }
+            if (skip < n && client_send_frames(c, frames + skip, n - skip) < 0) {
+                // ignore error here; the client thread will handle closure
+            }
+        }
+        c = c->next;
+    }
+    pthread_mutex_unlock(&s->clients_mutex);
+}
+
+/**
+ * @brief Pushes a frame onto a shard ring.
+ *
+ * @param r The ring to push to.
+ * @param f The frame to push.
+ * @return int 0 on success, -1 if the ring is full.
+ */
+int ring_push(spsc_ring_t *r, frame_t *f) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail == SHARD_RING_SIZE) return -1;
+    r->slots[head & (SHARD_RING_SIZE - 1)] = f;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @brief Pops a frame from a shard ring.
+ *
+ * @param r The ring to pop from.
+ * @return frame_t* The oldest frame, or NULL if the ring is empty.
+ */
+frame_t *ring_pop(spsc_ring_t *r) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (head == tail) return NULL;
+    frame_t *f = r->slots[tail & (SHARD_RING_SIZE - 1)];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return f;
+}
+
+/**
+ * @brief Checks whether a shard ring has no frames left.
+ *
+ * @param r The ring to check.
+ * @return int 1 if empty, 0 otherwise.
+ */
+int ring_empty(spsc_ring_t *r) {
+    return atomic_load_explicit(&r->head, memory_order_acquire) ==
+           atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+/**
+ * @brief Checks whether any other shard has frames waiting for a shard.
+ *
+ * @param s The destination shard.
+ * @return int 1 if all of its rings are empty (always in the default mode).
+ */
+int shard_rings_empty(shard_t *s) {
+    if (!s->rings) return 1;
+    for (int i = 0; i < num_shards; i++) {
+        if (i != s->id && !ring_empty(&s->rings[i])) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Writes the frames other shards have handed to a shard to its clients.
+ *
+ * @details Each ring is drained in its own batches, so the frames of one
+ * origin shard keep their order.
+ *
+ * @param s The destination shard (called by its dispatcher).
+ * @return int Number of frames written.
+ */
+int shard_drain_rings(shard_t *s) {
+    if (!s->rings) return 0;
+    frame_t *batch[BATCH_MAX];
+    int total = 0;
+    for (int i = 0; i < num_shards; i++) {
+        if (i == s->id) continue;
+        int n = 0;
+        while (n < BATCH_MAX && (batch[n] = ring_pop(&s->rings[i])) != NULL) n++;
+        if (n == 0) continue;
+        shard_broadcast(s, batch, n);
+        for (int j = 0; j < n; j++) frame_put(batch[j]);
+        total += n;
+    }
+    return total;
+}
+
+/**
+ * @brief Hands a batch of frames from one shard to another, waking its dispatcher if it is parked.
+ *
+ * @details While the ring is full the sender drains its own incoming rings
+ * before yielding, so two shards filling each other's rings never wait on
+ * each other, and a slow shard applies back-pressure instead of losing frames.
+ *
+ * @param from The origin shard (called by its dispatcher).
+ * @param to The destination shard.
+ * @param frames The frames; one reference to each is transferred.
+ * @param n Number of frames.
+ */
+void shard_submit(shard_t *from, shard_t *to, frame_t **frames, int n) {
+    spsc_ring_t *r = &to->rings[from->id];
+    for (int i = 0; i < n; i++) {
+        while (ring_push(r, frames[i]) < 0) {
+            if (!server_running) {
+                frame_put(frames[i]);
+                break;
+            }
+            if (shard_drain_rings(from) == 0) sched_yield();
+        }
+    }
+
+    // Pairs with the fence in dequeue_message(): either we see the dispatcher parked or it sees the new frames
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&to->parked, memory_order_relaxed)) {
+        pthread_mutex_lock(&to->msg_mutex);
+        pthread_cond_signal(&to->msg_cond);
+        pthread_mutex_unlock(&to->msg_mutex);
+    }
+}
+
+/**
+ * @brief Broadcasts a batch of sequenced frames to all logged-in clients.
+ * 
+ * @details The shard writes to its own clients directly; in per-core mode
+ * every other shard gets its own references through its ring.
+ * 
+ * @param s The shard whose dispatcher sequenced the batch.
+ * @param frames The frames, in order; the caller's references are consumed.
+ * @param n Number of frames (at most BATCH_MAX).
+ */
+void broadcast_frames(shard_t *s, frame_t **frames, int n) {
+    if (n <= 0) return;
+    shard_broadcast(s, frames, n);
+    for (int i = 0; i < num_shards && per_core_mode; i++) {
+        if (i == s->id) continue;
+        for (int j = 0; j < n; j++) {
+            atomic_fetch_add_explicit(&frames[j]->refs, 1, memory_order_relaxed);
+        }
+        shard_submit(s, shards[i], frames, n);
+    }
+    for (int j = 0; j < n; j++) frame_put(frames[j]);
+    atomic_fetch_add_explicit(&batches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&batched_frames, n, memory_order_relaxed);
+}
+
+/**
+ * @brief Hints the CPU that we are in a spin-wait loop.
+ */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * @brief Spins for up to spin_usec until work is ready.
+ * 
+ * @param ready Returns non-zero once there is work.
+ * @param arg Argument passed to ready.
+ * @return int 1 if work showed up while spinning, 0 if the caller should park.
+ */
+int spin_for_work(int (*ready)(void *), void *arg) {
+    if (spin_usec <= 0) return 0;
+    uint64_t deadline = now_usec() + spin_usec;
+    do {
+        for (int i = 0; i < 64; i++) {
+            if (ready(arg)) {
+                atomic_fetch_add_explicit(&spin_hits, 1, memory_order_relaxed);
+                return 1;
+            }
+            cpu_relax();
+        }
+    } while (server_running && now_usec() < deadline);
+    return 0;
+}
+
+/**
+ * @brief Spin predicate: a shard has queued messages or frames from other shards.
+ * 
+ * @param arg Pointer to the shard.
+ * @return int Non-zero if there is work.
+ */
+int shard_ready(void *arg) {
+    shard_t *s = (shard_t *)arg;
+    return atomic_load_explicit(&s->msg_pending, memory_order_acquire) != 0 || !shard_rings_empty(s);
+}
+
+/**
+ * @brief Hashes a byte string (64-bit FNV-1a with a final mix).
+ * 
+ * @param data The bytes.
+ * @param len Number of bytes.
+ * @return uint64_t The hash.
+ */
+uint64_t hash_bytes(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    // FNV leaves the high bits poorly mixed; sketch rows use both halves
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1; // 0 marks an empty top-k slot
+}
+
+/**
+ * @brief Returns the counter a key maps to in one sketch row.
+ */
+static inline uint32_t *sketch_cell(sketch_t *s, int row, uint64_t key) {
+    uint32_t h1 = (uint32_t)key, h2 = (uint32_t)(key >> 32) | 1;
+    return &s->counts[row][(h1 + row * h2) & (SKETCH_WIDTH - 1)];
+}
+
+/**
+ * @brief Returns a key's estimated count.
+ * 
+ * @param s The sketch.
+ * @param key The hashed key.
+ * @return uint32_t The estimate (never below the true count).
+ */
+uint32_t sketch_estimate(sketch_t *s, uint64_t key) {
+    uint32_t est = UINT32_MAX;
+    for (int r = 0; r < SKETCH_DEPTH; r++) {
+        uint32_t v = *sketch_cell(s, r, key);
+        if (v < est) est = v;
+    }
+    return est;
+}
+
+/**
+ * @brief Counts one occurrence of a key and updates the top-k table.
+ * 
+ * @details Uses conservative update: only the counters at the current minimum
+ * are raised, which keeps collisions from inflating other keys as much.
+ * 
+ * @param s The sketch.
+ * @param key The hashed key.
+ * @param label Text identifying the key, kept if it enters the top-k.
+ * @return uint32_t The key's new estimate.
+ */
+uint32_t sketch_add(sketch_t *s, uint64_t key, const char *label) {
+    uint32_t est = sketch_estimate(s, key) + 1;
+    for (int r = 0; r < SKETCH_DEPTH; r++) {
+        uint32_t *cell = sketch_cell(s, r, key);
+        if (*cell < est) *cell = est;
+    }
+
+    // Update the entry if the key is tracked, otherwise displace the smallest
+    int min = 0;
+    for (int i = 0; i < TOP_K; i++) {
+        if (s->top[i].key == key) {
+            s->top[i].count = est;
+            return est;
+        }
+        if (s->top[i].count < s->top[min].count) min = i;
+    }
+    if (est > s->top[min].count) {
+        s->top[min].key = key;
+        s->top[min].count = est;
+        snprintf(s->top[min].label, HITTER_LABEL, "%s", label);
+    }
+    return est;
+}
+
+/**
+ * @brief Ages a sketch by halving its counts once per elapsed window.
+ * 
+ * @param s The sketch.
+ * @param windows Number of windows that have passed.
+ */
+void sketch_decay(sketch_t *s, uint64_t windows) {
+    int shift = windows > 31 ? 32 : (int)windows;
+    for (int r = 0; r < SKETCH_DEPTH; r++) {
+        for (int i = 0; i < SKETCH_WIDTH; i++) {
+            s->counts[r][i] = shift == 32 ? 0 : s->counts[r][i] >> shift;
+        }
+    }
+    for (int i = 0; i < TOP_K; i++) {
+        s->top[i].count = shift == 32 ? 0 : s->top[i].count >> shift;
+        if (s->top[i].count == 0) s->top[i].key = 0;
+    }
+}
+
+/**
+ * @brief Normalizes a message for fingerprinting.
+ * 
+ * @details Letters are lowercased, digits kept and every other run of bytes
+ * becomes a single space, so trivially varied copies hash the same.
+ * 
+ * @param text The message text.
+ * @param out Receives the normalized text.
+ * @param cap Capacity of out.
+ * @return size_t Length of the normalized text.
+ */
+size_t spam_normalize(const char *text, char *out, size_t cap) {
+    size_t n = 0;
+    int gap = 0;
+    for (const unsigned char *p = (const unsigned char *)text; *p && n + 2 < cap; p++) {
+        unsigned char ch = *p;
+        if (ch >= 'A' && ch <= 'Z') ch = ch - 'A' + 'a';
+        if ((ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || ch >= 0x80) {
+            if (gap && n > 0) out[n++] = ' ';
+            out[n++] = ch;
+            gap = 0;
+        } else {
+            gap = 1;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/**
+ * @brief Decides whether a client message is spam.
+ * 
+ * @details Every message from a user is fingerprinted into a count-min
+ * sketch. Once one text has been seen more than spam_threshold times in the
+ * current window, further copies are dropped, from whichever account sends
+ * them, and each dropped copy is a strike against its sender. A sender with
+ * SPAM_STRIKES strikes is throttled: all of their messages are dropped until
+ * the strikes decay. Everything fits in two fixed-size sketches.
+ * 
+ * @param sender The username of the sender.
+ * @param text The message text.
+ * @return int 1 if the message should be dropped, 0 otherwise.
+ */
+int spam_check(const char *sender, const char *text) {
+    char norm[MAX_MESSAGE];
+    size_t len = spam_normalize(text, norm, sizeof(norm));
+    uint64_t skey = hash_bytes(sender, strlen(sender));
+    uint64_t tkey = len >= SPAM_MIN_TEXT ? hash_bytes(norm, len) : 0;
+    uint64_t now = now_usec(), window = (uint64_t)spam_window_sec * 1000000;
+
+    pthread_mutex_lock(&spam_mutex);
+    if (now >= spam_window_end) {
+        if (spam_window_end) {
+            uint64_t elapsed = (now - spam_window_end) / window + 1;
+            sketch_decay(&spam_texts, elapsed);
+            sketch_decay(&spam_senders, elapsed);
+        }
+        spam_window_end = now + window;
+    }
+
+    int drop = 0;
+    if (sketch_estimate(&spam_senders, skey) >= SPAM_STRIKES) {
+        drop = 1;
+        atomic_fetch_add_explicit(&spam_throttled, 1, memory_order_relaxed);
+    } else if (tkey && sketch_add(&spam_texts, tkey, norm) > (uint32_t)spam_threshold) {
+        drop = 1;
+        sketch_add(&spam_senders, skey, sender);
+        atomic_fetch_add_explicit(&spam_dropped, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&spam_mutex);
+    return drop;
+}
+
+/**
+ * @brief Returns the message pool of the calling client thread's shard (NULL = malloc).
+ */
+static inline pool_t *thread_msg_pool(void) {
+    return thread_shard ? &thread_shard->msg_pool : NULL;
+}
+
+/**
+ * @brief Appends a message to the queue of the caller's shard and wakes its dispatcher if needed.
+ * 
+ * @details Client threads queue to their own shard; other threads (the
+ * ticker, for instance) queue to shard 0.
+ * 
+ * @param m The message.
+ */
+void message_push(message_t *m) {
+    shard_t *s = thread_shard ? thread_shard : shards[0];
+    m->next = NULL;
+    pthread_mutex_lock(&s->msg_mutex);
+    if (!s->msg_tail) {
+        s->msg_head = s->msg_tail = m;
+    } else {
+        s->msg_tail->next = m;
+        s->msg_tail = m;
+    }
+    atomic_fetch_add_explicit(&s->msg_pending, 1, memory_order_release);
+    // A spinning dispatcher sees msg_pending; only a parked one needs the wakeup
+    if (atomic_load_explicit(&s->parked, memory_order_relaxed)) pthread_cond_signal(&s->msg_cond);
+    pthread_mutex_unlock(&s->msg_mutex);
+}
+
+/**
+ * @brief Enqueues a message to the message queue.
+ * 
+ * @details Messages from users go through spam detection first when it is
+ * enabled; server announcements never do. Whether a message is an
+ * announcement is decided by the caller, never by the sender's name.
+ * 
+ * @param sender The username of the sender.
+ * @param text The message text.
+ * @param system 1 for a server announcement, 0 for a user's message.
+ * @return int 0 if queued, 1 if dropped as spam, -1 if allocation failed.
+ */
+int enqueue_message(const char *sender, const char *text, int system) {
+    if (spam_threshold > 0 && !system && spam_check(sender, text)) return 1;
+
+    message_t *m = pool_alloc(thread_msg_pool(), sizeof(message_t));
+    if (!m) return -1; // allocation failed
+    strncpy(m->sender, sender, MAX_USERNAME-1); // Send the sender username
+    m->sender[MAX_USERNAME-1] = '\0';
+    strncpy(m->text, text, MAX_MESSAGE-1); // Send text
+    m->text[MAX_MESSAGE-1] = '\0';
+    m->pool = thread_msg_pool();
+    m->kind = MSG_CHAT;
+    m->target = 0;
+    message_push(m);
+    return 0;
+}
+
+/**
+ * @brief Enqueues a complete server line to be broadcast as an ephemeral frame.
+ * 
+ * @param line The line, without the newline.
+ * @return int 0 if queued, -1 if allocation failed.
+ */
+int enqueue_raw(const char *line) {
+    message_t *m = pool_alloc(thread_msg_pool(), sizeof(message_t));
+    if (!m) return -1;
+    m->sender[0] = '\0';
+    snprintf(m->text, MAX_MESSAGE, "%s", line);
+    m->pool = thread_msg_pool();
+    m->kind = MSG_RAW;
+    m->target = 0;
+    message_push(m);
+    return 0;
+}
+
+/**
+ * @brief Enqueues a change to an earlier message.
+ * 
+ * @param kind MSG_EDIT, MSG_DELETE or MSG_REACTS.
+ * @param sender The message's author.
+ * @param target Sequence number of the message.
+ * @param text The new text or the reaction totals (NULL for MSG_DELETE).
+ * @return int 0 if queued, -1 if allocation failed.
+ */
+int enqueue_delta(int kind, const char *sender, uint64_t target, const char *text) {
+    message_t *m = pool_alloc(thread_msg_pool(), sizeof(message_t));
+    if (!m) return -1;
+    snprintf(m->sender, MAX_USERNAME, "%s", sender);
+    snprintf(m->text, MAX_MESSAGE, "%s", text ? text : "");
+    m->pool = thread_msg_pool();
+    m->kind = kind;
+    m->target = target;
+    message_push(m);
+    return 0;
+}
+
+/**
+ * @brief Finds the set slot holding an ID, or the empty slot ending its probe.
+ */
+static uint32_t dedup_slot(const dedup_window_t *w, const char *id, uint32_t fp) {
+    uint32_t i = fp & (DEDUP_SET - 1);
+    while (w->set[i] && (w->fps[w->set[i] - 1] != fp || strcmp(w->ring[w->set[i] - 1], id) != 0)) {
+        i = (i + 1) & (DEDUP_SET - 1);
+    }
+    return i;
+}
+
+/**
+ * @brief Removes a ring position from a sender's set (backward-shift deletion).
+ */
+static void dedup_erase(dedup_window_t *w, int pos) {
+    uint32_t i = w->fps[pos] & (DEDUP_SET - 1);
+    while (w->set[i] && w->set[i] != pos + 1) i = (i + 1) & (DEDUP_SET - 1);
+    if (!w->set[i]) return;
+    for (uint32_t j = (i + 1) & (DEDUP_SET - 1); w->set[j]; j = (j + 1) & (DEDUP_SET - 1)) {
+        uint32_t home = w->fps[w->set[j] - 1] & (DEDUP_SET - 1);
+        int stays = i < j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            w->set[i] = w->set[j];
+            i = j;
+        }
+    }
+    w->set[i] = 0;
+}
+
+/**
+ * @brief Checks whether a client message ID was recently delivered.
+ * 
+ * @details Each sender remembers its last DEDUP_WINDOW delivered IDs (see
+ * dedup_record), so a client that resends after a reconnect is recognised.
+ * Windows are direct-mapped by username; a sender whose slot is taken over
+ * by another simply loses its history, which can let a duplicate through
+ * but never drops a new message.
+ * 
+ * @param sender The username of the sender.
+ * @param id The client's message ID (at most DEDUP_ID_MAX bytes).
+ * @return int 1 if the ID is a duplicate, 0 if it is new.
+ */
+int dedup_seen(const char *sender, const char *id) {
+    uint32_t fp = (uint32_t)hash_bytes(id, strlen(id));
+    dedup_window_t *w = &dedup_windows[hash_bytes(sender, strlen(sender)) & (DEDUP_SENDERS - 1)];
+
+    pthread_mutex_lock(&dedup_mutex);
+    int dup = strncmp(w->username, sender, MAX_USERNAME) == 0 && w->set[dedup_slot(w, id, fp)] != 0;
+    pthread_mutex_unlock(&dedup_mutex);
+
+    atomic_fetch_add_explicit(&dedup_checked, 1, memory_order_relaxed);
+    if (dup) atomic_fetch_add_explicit(&dedup_dropped, 1, memory_order_relaxed);
+    return dup;
+}
+
+/**
+ * @brief Records a client message ID once its message has been queued.
+ * 
+ * @details Only queued messages are recorded, so a message refused (as spam,
+ * or for lack of memory) is not confirmed when the client resends it. A
+ * sender's messages all come from its one logged-in connection, so nothing
+ * else records the same ID between dedup_seen() and this call.
+ * 
+ * @param sender The username of the sender.
+ * @param id The client's message ID (at most DEDUP_ID_MAX bytes).
+ */
+void dedup_record(const char *sender, const char *id) {
+    uint32_t fp = (uint32_t)hash_bytes(id, strlen(id));
+    dedup_window_t *w = &dedup_windows[hash_bytes(sender, strlen(sender)) & (DEDUP_SENDERS - 1)];
+
+    pthread_mutex_lock(&dedup_mutex);
+    if (strncmp(w->username, sender, MAX_USERNAME) != 0) {
+        if (w->username[0]) atomic_fetch_add_explicit(&dedup_evictions, 1, memory_order_relaxed);
+        memset(w, 0, sizeof(*w));
+        snprintf(w->username, MAX_USERNAME, "%s", sender);
+    }
+    uint32_t i = dedup_slot(w, id, fp);
+    if (!w->set[i]) {
+        if (w->ring_count == DEDUP_WINDOW) {
+            dedup_erase(w, w->ring_head);
+            w->ring_head = (w->ring_head + 1) % DEDUP_WINDOW;
+            w->ring_count--;
+            i = dedup_slot(w, id, fp); // the erase may have shifted the probe
+        }
+        int pos = (w->ring_head + w->ring_count) % DEDUP_WINDOW;
+        snprintf(w->ring[pos], sizeof(w->ring[pos]), "%s", id);
+        w->fps[pos] = fp;
+        w->ring_count++;
+        w->set[i] = (uint8_t)(pos + 1);
+    }
+    pthread_mutex_unlock(&dedup_mutex);
+}
+
+/**
+ * @brief Unlinks the head of a shard's message queue (msg_mutex must be held).
+ * 
+ * @param s The shard.
+ * @return message_t* The oldest message.
+ */
+message_t *pop_message_locked(shard_t *s) {
+    message_t *m = s->msg_head;
+    s->msg_head = m->next;
+    if (!s->msg_head) s->msg_tail = NULL;
+    atomic_fetch_sub_explicit(&s->msg_pending, 1, memory_order_relaxed);
+    return m;
+}
+
+/**
+ * @brief Dequeues a message from a shard's queue, waiting for one or for frames from other shards.
+ * 
+ * @param s The shard (called by its dispatcher).
+ * @return message_t* The dequeued message, or NULL if frames from other
+ * shards are waiting or the server is shutting down.
+ */
+message_t *dequeue_message(shard_t *s) {
+    // In busy-poll mode, spin briefly before paying for a sleep and wakeup
+    if (!shard_ready(s)) spin_for_work(shard_ready, s);
+
+    pthread_mutex_lock(&s->msg_mutex);
+    while (!s->msg_head && server_running) {
+        atomic_store_explicit(&s->parked, 1, memory_order_relaxed);
+        // Pairs with the fence in shard_submit(): either it sees us parked or we see its frames
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!shard_rings_empty(s)) break;
+        atomic_fetch_add_explicit(&parks, 1, memory_order_relaxed);
+        pthread_cond_wait(&s->msg_cond, &s->msg_mutex);
+    }
+    atomic_store_explicit(&s->parked, 0, memory_order_relaxed);
+    message_t *m = (s->msg_head && server_running) ? pop_message_locked(s) : NULL;
+    pthread_mutex_unlock(&s->msg_mutex);
+    return m;
+}
+
+/**
+ * @brief Dequeues a message from a shard's queue, waiting no later than a deadline.
+ * 
+ * @param s The shard (called by its dispatcher).
+ * @param deadline now_usec() value to give up at; 0 means do not wait at all.
+ * @return message_t* The dequeued message, or NULL if none arrived in time.
+ */
+message_t *dequeue_message_until(shard_t *s, uint64_t deadline) {
+    pthread_mutex_lock(&s->msg_mutex);
+    while (!s->msg_head && server_running) {
+        uint64_t now = now_usec();
+        if (deadline <= now) break;
+
+        // msg_cond runs on CLOCK_REALTIME
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = (uint64_t)ts.tv_nsec + (deadline - now) * 1000;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+
+        atomic_store_explicit(&s->parked, 1, memory_order_relaxed);
+        pthread_cond_timedwait(&s->msg_cond, &s->msg_mutex, &ts);
+        atomic_store_explicit(&s->parked, 0, memory_order_relaxed);
+    }
+    message_t *m = (s->msg_head && server_running) ? pop_message_locked(s) : NULL;
+    pthread_mutex_unlock(&s->msg_mutex);
+    return m;
+}
+
+/**
+ * @brief Receives a line of text from the specified file descriptor.
+ * 
+ * @param fd The file descriptor to receive data from.
+ * @param buf Pointer to the buffer to store the received line.
+ * @param maxlen The maximum length of the buffer.
+ * 
+ * @return int The number of bytes received, or -1 on error.
+ */
+int recv_line(int fd, char *buf, size_t maxlen) {
+    // ssize is for signed size
+    // size_t is for unsigned size
+    size_t idx = 0; // current index in buffer
+    while (idx < maxlen - 1) {
+        char c;
+        ssize_t n = recv(fd, &c, 1, 0);
+        if (n <= 0) return -1;
+        buf[idx++] = c;
+        if (c == '\n') break;
+    }
+    buf[idx] = '\0';
+    return idx;
+}
+
+/**
+ * @brief Adds a client to the client list of its shard.
+ * 
+ * @param c Pointer to the client to add.
+ */
+void add_client(client_t *c) {
+    shard_t *s = c->shard;
+    pthread_mutex_lock(&s->clients_mutex);
+    c->next = s->clients_head;
+    s->clients_head = c;
+    pthread_mutex_unlock(&s->clients_mutex);
+}
+
+/**
+ * @brief Removes a client from the client list of its shard.
+ * 
+ * @param c Pointer to the client, which we will remove.
+ */
+void remove_client(client_t *c) {
+    shard_t *s = c->shard;
+    pthread_mutex_lock(&s->clients_mutex);
+    client_t **p = &s->clients_head;
+    while (*p) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+        p = &(*p)->next;
+    }
+    if (c->logged_in && c->presence_shown) {
+        // Peers still show this user's last status; the next delta marks them offline
+        pthread_mutex_lock(&presence_gone_lock);
+        if (presence_gone_count == presence_gone_cap) {
+            int cap = presence_gone_cap ? presence_gone_cap * 2 : 16;
+            char (*grown)[MAX_USERNAME] = realloc(presence_gone, cap * sizeof(*grown));
+            if (grown) {
+                presence_gone = grown;
+                presence_gone_cap = cap;
+            }
+        }
+        if (presence_gone_count < presence_gone_cap) {
+            memcpy(presence_gone[presence_gone_count++], c->username, MAX_USERNAME);
+        }
+        pthread_mutex_unlock(&presence_gone_lock);
+    }
+    pthread_mutex_unlock(&s->clients_mutex);
+}
+
+/**
+ * @brief Checks that a username cannot be mistaken for protocol.
+ * 
+ * @details Broadcasts reach clients as "<user>: <text>" on the same stream
+ * as control frames such as "BLOBCHUNK:<id>:<size>" or "DM:<from>:<text>".
+ * A user named after a frame could therefore forge one with a chat line, so
+ * names may not be a protocol word, contain ':', '#' (ACK-mode prefix) or
+ * whitespace, or hold control characters. "Server" is the author of
+ * announcements, and history takes a line's author from its text, so it is
+ * reserved too.
+ * 
+ * @param username The username.
+ * @return int 1 if it may be used, 0 if not.
+ */
+int username_valid(const char *username) {
+    static const char *const reserved[] = {
+        "ACK", "ACKS", "BLOB", "BLOBCHUNK", "BLOBEND", "BLOBSTART", "DELETE", "DM", "EDIT", "ERR", "GET",
+        "HIST", "HISTEND", "HISTORY", "LOGIN", "MENTION", "MSG", "MSGID", "OKACKS", "OKBLOB", "OKDELETE",
+        "OKDM", "OKEDIT", "OKMSG", "OKPASS", "OKREACT", "PASS", "PASSWORD", "PRESENCE", "REACT", "REACTS",
+        "RESULT", "SEARCH", "SEARCHEND", "SERVER", "STAT", "STATS", "STATUS", "TYPING",
+    };
+    if (!username[0]) return 0;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+        if (*p <= ' ' || *p == 0x7f || *p == ':' || *p == '#') return 0;
+    }
+    for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+        if (strcasecmp(username, reserved[i]) == 0) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Checks if a username is already taken by a logged-in client.
+ * 
+ * @param username The username to check.
+ * 
+ * @return int 1 if taken, 0 if available.
+ */
+int username_taken(const char *username) {
+    int taken = 0;
+    for (int i = 0; i < num_shards && !taken; i++) {
+        shard_t *s = shards[i];
+        pthread_mutex_lock(&s->clients_mutex);
+        client_t *c = s->clients_head;
+        while (c) {
+            if (c->logged_in && strcmp(c->username, username) == 0) {
+                taken = 1;
+                break;
+            }
+            c = c->next;
+        }
+        pthread_mutex_unlock(&s->clients_mutex);
+    }
+    return taken;
+}
+
+/**
+ * @brief Frees a trie's memory.
+ * 
+ * @param t The trie.
+ */
+void ip_trie_free(ip_trie_t *t) {
+    if (!t) return;
+    free(t->nodes);
+    free(t);
+}
+
+/**
+ * @brief Adds an IPv4 prefix to a trie.
+ * 
+ * @param t The trie.
+ * @param addr The address (host byte order).
+ * @param bits Prefix length, 0 to 32.
+ * @return int 0 on success, -1 if allocation failed.
+ */
+int ip_trie_add(ip_trie_t *t, uint32_t addr, int bits) {
+    int node = 0;
+    for (int i = 0; i < bits; i++) {
+        int bit = (addr >> (31 - i)) & 1;
+        if (t->nodes[node].child[bit] == 0) {
+            if (t->nnodes == t->nodes_cap) {
+                int cap = t->nodes_cap * 2;
+                void *grown = realloc(t->nodes, cap * sizeof(t->nodes[0]));
+                if (!grown) return -1;
+                t->nodes = grown;
+                t->nodes_cap = cap;
+            }
+            memset(&t->nodes[t->nnodes], 0, sizeof(t->nodes[0]));
+            t->nodes[node].child[bit] = t->nnodes++;
+        }
+        node = t->nodes[node].child[bit];
+    }
+    t->nodes[node].terminal = 1;
+    t->nprefixes++;
+    return 0;
+}
+
+/**
+ * @brief Checks whether an address falls under any prefix in a trie.
+ * 
+ * @param t The trie.
+ * @param addr The address (host byte order).
+ * @return int 1 if a prefix matches, 0 otherwise.
+ */
+int ip_trie_match(const ip_trie_t *t, uint32_t addr) {
+    int node = 0;
+    for (int i = 0; ; i++) {
+        if (t->nodes[node].terminal) return 1;
+        if (i == 32) return 0;
+        node = t->nodes[node].child[(addr >> (31 - i)) & 1];
+        if (node == 0) return 0; // the root is never a child, so 0 means "no child"
+    }
+}
+
+/**
+ * @brief Loads a blocklist: one IPv4 address or CIDR prefix per line, '#' starts a comment.
+ * 
+ * @param path The blocklist file.
+ * @return ip_trie_t* The blocklist, or NULL on error.
+ */
+ip_trie_t *blocklist_load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+    ip_trie_t *t = calloc(1, sizeof(ip_trie_t));
+    if (t) {
+        t->nodes_cap = 64;
+        t->nodes = calloc(t->nodes_cap, sizeof(t->nodes[0]));
+        t->nnodes = 1;
+    }
+    if (!t || !t->nodes) {
+        ip_trie_free(t);
+        fclose(fp);
+        return NULL;
+    }
+    char line[128];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *p = line + strspn(line, " \t");
+        p[strcspn(p, " \t")] = '\0';
+        if (*p == '\0') continue;
+
+        int bits = 32;
+        char *slash = strchr(p, '/');
+        if (slash) {
+            *slash = '\0';
+            char *end;
+            bits = (int)strtol(slash + 1, &end, 10);
+            if (*end || end == slash + 1 || bits < 0 || bits > 32) bits = -1;
+        }
+        struct in_addr in;
+        if (bits < 0 || inet_pton(AF_INET, p, &in) != 1) {
+            fprintf(stderr, "%s:%d: invalid address or prefix\n", path, lineno);
+            continue;
+        }
+        if (ip_trie_add(t, ntohl(in.s_addr), bits) < 0) {
+            ip_trie_free(t);
+            fclose(fp);
+            return NULL;
+        }
+    }
+    fclose(fp);
+    return t;
+}
+
+/**
+ * @brief Reloads the blocklist file and hands it to the accept loop.
+ */
+void blocklist_reload(void) {
+    if (!blocklist_path[0]) return;
+    ip_trie_t *fresh = blocklist_load(blocklist_path);
+    if (!fresh) return;
+    int nprefixes = fresh->nprefixes;
+    ip_trie_free(atomic_exchange(&blocklist_pending, fresh)); // the accept loop never saw the previous reload
+    atomic_store(&blocklist_prefixes, nprefixes);
+    atomic_fetch_add(&blocklist_reloads, 1);
+    printf("Blocklist loaded: %d prefixes\n", nprefixes);
+}
+
+/**
+ * @brief Returns the home slot of an address in ip_counts.
+ */
+static inline int ip_home(uint32_t addr) {
+    return (int)((uint32_t)hash_bytes(&addr, sizeof(addr)) & (IP_TABLE_SIZE - 1));
+}
+
+/**
+ * @brief Finds an address's slot in ip_counts (ip_mutex held).
+ * 
+ * @param addr The address.
+ * @return int The slot holding addr, or the empty slot where it would go.
+ */
+int ip_slot(uint32_t addr) {
+    int i = ip_home(addr);
+    while (ip_counts[i].addr != 0 && ip_counts[i].addr != addr) i = (i + 1) & (IP_TABLE_SIZE - 1);
+    return i;
+}
+
+/**
+ * @brief Counts a new connection from an address against max_per_ip.
+ * 
+ * @param addr The address (host byte order).
+ * @return int 0 if admitted, -1 if the address is at its cap.
+ */
+int ip_acquire(uint32_t addr) {
+    pthread_mutex_lock(&ip_mutex);
+    int i = ip_slot(addr);
+    int ok = 0;
+    if (ip_counts[i].addr == 0) {
+        // Keep one slot free so probes always terminate
+        if (ip_tracked < IP_TABLE_SIZE - 1) {
+            ip_counts[i].addr = addr;
+            ip_counts[i].count = 1;
+            ip_tracked++;
+        } else {
+            ok = -1;
+        }
+    } else if (ip_counts[i].count < max_per_ip) {
+        ip_counts[i].count++;
+    } else {
+        ok = -1;
+    }
+    pthread_mutex_unlock(&ip_mutex);
+    return ok;
+}
+
+/**
+ * @brief Releases a connection counted by ip_acquire().
+ * 
+ * @details An address whose count drops to zero is removed with backward-shift
+ * deletion, so the table never fills up with tombstones.
+ * 
+ * @param addr The address (host byte order).
+ */
+void ip_release(uint32_t addr) {
+    pthread_mutex_lock(&ip_mutex);
+    int i = ip_slot(addr);
+    if (ip_counts[i].addr == addr && --ip_counts[i].count == 0) {
+        ip_tracked--;
+        for (int j = (i + 1) & (IP_TABLE_SIZE - 1); ip_counts[j].addr != 0; j = (j + 1) & (IP_TABLE_SIZE - 1)) {
+            // An entry can fill the hole unless its home slot lies cyclically in (i, j]
+            int home = ip_home(ip_counts[j].addr);
+            int stays = i < j ? (home > i && home <= j) : (home > i || home <= j);
+            if (!stays) {
+                ip_counts[i] = ip_counts[j];
+                i = j;
+            }
+        }
+        ip_counts[i].addr = 0;
+        ip_counts[i].count = 0;
+    }
+    pthread_mutex_unlock(&ip_mutex);
+}
+
+/**
+ * @brief Decides whether to accept a connection, before any per-client state exists.
+ * 
+ * @details Called by the accept loop only, which also adopts a reloaded
+ * blocklist here. An admitted connection holds a slot in the per-address
+ * count until close_and_free_client().
+ * 
+ * @param addr The peer address (host byte order).
+ * @return int 1 to accept the connection, 0 to close it.
+ */
+int admit_connection(uint32_t addr) {
+    ip_trie_t *fresh = atomic_exchange(&blocklist_pending, NULL);
+    if (fresh) {
+        ip_trie_free(blocklist);
+        blocklist = fresh;
+    }
+    if (blocklist && ip_trie_match(blocklist, addr)) {
+        atomic_fetch_add_explicit(&conn_blocked, 1, memory_order_relaxed);
+        return 0;
+    }
+    if (max_per_ip > 0 && ip_acquire(addr) < 0) {
+        atomic_fetch_add_explicit(&conn_limited, 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Closes and frees a client structure.
+ *
+ * @details The client is unlinked before its socket is closed so a broadcast in
+ * progress never writes to a descriptor that has been closed (and maybe reused).
+ * 
+ * @param c Pointer to the client to close and free.
+ */
+void close_and_free_client(client_t *c) {
+    if (!c) return;
+    remove_client(c);
+    if (c->zc_head) zc_drain(c, ZC_CLOSE_WAIT_MS);
+    if (c->zc_head) {
+        // The peer never acknowledged data that still points into frames: reset instead of lingering
+        struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(c->sockfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(c->sockfd);
+    zc_release_all(c);
+    free(c->unacked);
+    free(c->held);
+    if (max_per_ip > 0) ip_release(c->addr);
+    pthread_mutex_destroy(&c->send_lock);
+    pthread_mutex_destroy(&c->hold_lock);
+    free(c);
+}
+
+/**
+ * @brief Builds the path of a segment file.
+ * 
+ * @param out Output buffer (MAX_LOG_PATH bytes).
+ * @param first_seq First sequence number of the segment.
+ * @param ext "log" or "idx".
+ */
+void segment_path(char *out, uint64_t first_seq, const char *ext) {
+    snprintf(out, MAX_LOG_PATH, "%s/%020llu.%s", log_dir, (unsigned long long)first_seq, ext);
+}
+
+/**
+ * @brief Appends one LZ sequence (literals, then an optional match) to a compressed block.
+ * 
+ * @return int 1 on success, 0 if it does not fit.
+ */
+static int lz_emit(unsigned char *dst, size_t cap, size_t *op, const unsigned char *lit, size_t nlit,
+                   size_t offset, size_t mlen) {
+    if (*op + 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1 > cap) return 0;
+    size_t ml = mlen ? mlen - 4 : 0;
+    dst[(*op)++] = (unsigned char)((nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15));
+    if (nlit >= 15) {
+        size_t r = nlit - 15;
+        for (; r >= 255; r -= 255) dst[(*op)++] = 255;
+        dst[(*op)++] = (unsigned char)r;
+    }
+    memcpy(dst + *op, lit, nlit);
+    *op += nlit;
+    if (!mlen) return 1;
+    dst[(*op)++] = (unsigned char)(offset & 0xff);
+    dst[(*op)++] = (unsigned char)(offset >> 8);
+    if (ml >= 15) {
+        size_t r = ml - 15;
+        for (; r >= 255; r -= 255) dst[(*op)++] = 255;
+        dst[(*op)++] = (unsigned char)r;
+    }
+    return 1;
+}
+
+/**
+ * @brief Compresses a block with a small LZ77 coder.
+ * 
+ * @details The output is a series of sequences, as in LZ4: a token byte
+ * with the literal count in the high nibble and the match length minus 4 in
+ * the low nibble (15 means more length bytes follow, each adding up to 255),
+ * the literals, then a 16-bit little-endian match offset. The last sequence
+ * has literals only. Matches are found through a hash table of 4-byte
+ * prefixes, which suits chat logs full of repeated names and phrases.
+ * 
+ * @param src The data (at most 64 KB).
+ * @param n Its length.
+ * @param dst Output buffer.
+ * @param cap Capacity of dst.
+ * @return size_t Compressed length, or 0 if it does not fit in cap.
+ */
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    static __thread uint32_t table[1 << LZ_HASH_BITS]; // position + 1 (0 = empty)
+    memset(table, 0, sizeof(table));
+    size_t ip = 0, anchor = 0, op = 0;
+    while (ip + 4 <= n) {
+        uint32_t v, r;
+        memcpy(&v, src + ip, 4);
+        uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = (uint32_t)ip + 1;
+        if (!ref || ip - (ref - 1) > 65535 || (memcpy(&r, src + ref - 1, 4), r != v)) {
+            ip++;
+            continue;
+        }
+        ref--;
+        size_t mlen = 4;
+        while (ip + mlen < n && src[ref + mlen] == src[ip + mlen]) mlen++;
+        if (!lz_emit(dst, cap, &op, src + anchor, ip - anchor, ip - ref, mlen)) return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!lz_emit(dst, cap, &op, src + anchor, n - anchor, 0, 0)) return 0;
+    return op;
+}
+
+/**
+ * @brief Reads an LZ length extension (bytes of 255 continue it).
+ * 
+ * @return int 0 on success, -1 if the input ends first.
+ */
+static int lz_length(const unsigned char *src, size_t n, size_t *ip, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= n) return -1;
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * @brief Decompresses a block made by lz_compress.
+ * 
+ * @param src The compressed block.
+ * @param n Its length.
+ * @param dst Output buffer.
+ * @param cap Capacity of dst.
+ * @return ssize_t Uncompressed length, or -1 if the block is corrupt.
+ */
+ssize_t lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    size_t ip = 0, op = 0;
+    while (ip < n) {
+        unsigned token = src[ip++];
+        size_t nlit = token >> 4, mlen = token & 15;
+        if (nlit == 15 && lz_length(src, n, &ip, &nlit) < 0) return -1;
+        if (nlit > n - ip || nlit > cap - op) return -1;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n) break; // the last sequence has no match
+
+        if (n - ip < 2) return -1;
+        size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        if (mlen == 15 && lz_length(src, n, &ip, &mlen) < 0) return -1;
+        mlen += 4;
+        if (offset == 0 || offset > op || mlen > cap - op) return -1;
+        for (size_t k = 0; k < mlen; k++, op++) dst[op] = dst[op - offset]; // may overlap
+    }
+    return (ssize_t)op;
+}
+
+/**
+ * @brief Opens a cold segment file and loads its block index.
+ * 
+ * @param path The .cold file.
+ * @return cold_segment_t* The segment, or NULL on error.
+ */
+cold_segment_t *cold_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    cold_header_t h;
+    struct stat st;
+    cold_segment_t *c = calloc(1, sizeof(cold_segment_t));
+    if (c && fstat(fd, &st) == 0 && pread(fd, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, COLD_MAGIC, 8) == 0 &&
+        h.block_size > 0 && h.block_size <= COLD_BLOCK && (uint64_t)h.nblocks * h.block_size >= h.raw_size) {
+        size_t bytes = (size_t)h.nblocks * sizeof(cold_block_t);
+        c->blocks = malloc(bytes ? bytes : 1);
+        if (c->blocks && pread(fd, c->blocks, bytes, h.index_offset) == (ssize_t)bytes) {
+            c->fd = fd;
+            c->file_size = st.st_size;
+            c->raw_size = h.raw_size;
+            c->nblocks = h.nblocks;
+            c->block_size = h.block_size;
+            return c;
+        }
+    }
+    if (c) free(c->blocks);
+    free(c);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Returns a decompressed cold block, from the cache if possible (cold_cache_mutex held).
+ * 
+ * @param c The cold segment.
+ * @param b The block number.
+ * @param len Output: uncompressed length.
+ * @return const unsigned char* The block, or NULL on error.
+ */
+static const unsigned char *cold_block(const cold_segment_t *c, uint32_t b, uint32_t *len) {
+    cold_cache_entry_t *victim = &cold_cache[0];
+    for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+        cold_cache_entry_t *e = &cold_cache[i];
+        if (e->seg == c && e->block == b) {
+            e->used = ++cold_cache_clock;
+            *len = e->len;
+            atomic_fetch_add_explicit(&cold_cache_hits, 1, memory_order_relaxed);
+            return e->data;
+        }
+        if (e->used < victim->used) victim = e;
+    }
+
+    const cold_block_t *blk = &c->blocks[b];
+    if (!victim->data) victim->data = malloc(COLD_BLOCK);
+    unsigned char *comp = malloc(blk->comp_len ? blk->comp_len : 1);
+    victim->seg = NULL;
+    int ok = victim->data && comp && blk->raw_len <= COLD_BLOCK &&
+             pread(c->fd, comp, blk->comp_len, blk->offset) == (ssize_t)blk->comp_len;
+    if (ok && blk->comp_len == blk->raw_len) memcpy(victim->data, comp, blk->raw_len);
+    else if (ok) ok = lz_decompress(comp, blk->comp_len, victim->data, COLD_BLOCK) == (ssize_t)blk->raw_len;
+    free(comp);
+    if (!ok) return NULL;
+
+    victim->seg = c;
+    victim->block = b;
+    victim->len = blk->raw_len;
+    victim->used = ++cold_cache_clock;
+    *len = victim->len;
+    atomic_fetch_add_explicit(&cold_block_reads, 1, memory_order_relaxed);
+    return victim->data;
+}
+
+/**
+ * @brief Reads a byte range of a segment's log data, whether hot or cold.
+ * 
+ * @details The caller holds log_mutex or segment_lock, so the segment
+ * cannot be compacted (and its .log closed) during the read.
+ * 
+ * @param seg The segment.
+ * @param off Offset in the log data.
+ * @param len Bytes to read.
+ * @param buf Output buffer.
+ * @return int 0 on success, -1 on error.
+ */
+int segment_read(const log_segment_t *seg, uint64_t off, size_t len, char *buf) {
+    uint64_t start = now_usec();
+    int rc = 0;
+    if (!seg->cold) {
+        rc = pread(seg->fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+        latency_record(&hot_read_latency, now_usec() - start);
+        return rc;
+    }
+
+    const cold_segment_t *c = seg->cold;
+    pthread_mutex_lock(&cold_cache_mutex);
+    while (len > 0) {
+        uint32_t b = (uint32_t)(off / c->block_size), blen = 0;
+        const unsigned char *data = b < c->nblocks ? cold_block(c, b, &blen) : NULL;
+        size_t at = off - (uint64_t)b * c->block_size;
+        if (!data || at >= blen) {
+            rc = -1;
+            break;
+        }
+        size_t n = blen - at < len ? blen - at : len;
+        memcpy(buf, data + at, n);
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&cold_cache_mutex);
+    latency_record(&cold_read_latency, now_usec() - start);
+    return rc;
+}
+
+/**
+ * @brief Opens (creating if needed) the files of a segment and appends it to the table.
+ * 
+ * @param first_seq First sequence number of the segment.
+ * @return log_segment_t* The segment, or NULL on error.
+ */
+log_segment_t *segment_open(uint64_t first_seq) {
+    if (log_nsegs == log_segs_cap) {
+        int cap = log_segs_cap ? log_segs_cap * 2 : 16;
+        log_segment_t *segs = realloc(log_segs, cap * sizeof(log_segment_t));
+        if (!segs) return NULL;
+        log_segs = segs;
+        log_segs_cap = cap;
+    }
+
+    char path[MAX_LOG_PATH];
+    log_segment_t *seg = &log_segs[log_nsegs];
+    memset(seg, 0, sizeof(*seg));
+    seg->first_seq = first_seq;
+
+    // A compacted segment has a .cold file instead of its .log (a leftover .log is a crash during compaction)
+    segment_path(path, first_seq, "cold");
+    if (access(path, F_OK) == 0) {
+        if (!(seg->cold = cold_open(path))) {
+            fprintf(stderr, "%s: not a valid cold segment\n", path);
+            return NULL;
+        }
+        seg->fd = -1;
+        segment_path(path, first_seq, "log");
+        if (!log_readonly) unlink(path);
+        atomic_fetch_add_explicit(&cold_segments, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cold_raw_bytes, seg->cold->raw_size, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cold_file_bytes, seg->cold->file_size, memory_order_relaxed);
+    } else {
+        segment_path(path, first_seq, "log");
+        seg->fd = open(path, log_readonly ? O_RDONLY : O_RDWR | O_CREAT | O_APPEND, 0644);
+    }
+    segment_path(path, first_seq, "idx");
+    seg->idx_fd = open(path, log_readonly ? O_RDONLY : O_RDWR | O_CREAT | O_APPEND, 0644);
+    if ((seg->fd < 0 && !seg->cold) || seg->idx_fd < 0) {
+        perror(path);
+        if (seg->fd >= 0) close(seg->fd);
+        if (seg->idx_fd >= 0) close(seg->idx_fd);
+        return NULL;
+    }
+
+    // Drop a torn trailing index record, then any data the index does not cover
+    struct stat st;
+    fstat(seg->idx_fd, &st);
+    seg->count = st.st_size / sizeof(log_record_t);
+    if ((off_t)(seg->count * sizeof(log_record_t)) != st.st_size && !log_readonly) {
+        ftruncate(seg->idx_fd, seg->count * sizeof(log_record_t));
+    }
+    if (seg->count > 0) {
+        log_record_t last;
+        pread(seg->idx_fd, &last, sizeof(last), (seg->count - 1) * sizeof(log_record_t));
+        seg->size = last.offset + last.len;
+    }
+    if (!seg->cold && !log_readonly) {
+        fstat(seg->fd, &st);
+        if ((uint64_t)st.st_size != seg->size) ftruncate(seg->fd, seg->size);
+    }
+
+    log_nsegs++;
+    return seg;
+}
+
+/**
+ * @brief Finds a message in the reaction table (react_mutex held).
+ * 
+ * @param seq Sequence number of the message.
+ * @param create 1 to add an empty entry if there is none.
+ * @return react_entry_t* The entry, or NULL if absent (or allocation failed).
+ */
+react_entry_t *react_lookup(uint64_t seq, int create) {
+    if (react_cap > 0) {
+        for (size_t i = hash_bytes(&seq, sizeof(seq)) & (react_cap - 1); react_table[i].seq;
+             i = (i + 1) & (react_cap - 1)) {
+            if (react_table[i].seq == seq) return &react_table[i];
+        }
+    }
+    if (!create) return NULL;
+
+    // Keep the table at most half full
+    if ((react_count + 1) * 2 > react_cap) {
+        size_t cap = react_cap ? react_cap * 2 : 256;
+        react_entry_t *table = calloc(cap, sizeof(react_entry_t));
+        if (!table) return NULL;
+        for (size_t j = 0; j < react_cap; j++) {
+            if (!react_table[j].seq) continue;
+            size_t i = hash_bytes(&react_table[j].seq, sizeof(uint64_t)) & (cap - 1);
+            while (table[i].seq) i = (i + 1) & (cap - 1);
+            table[i] = react_table[j];
+        }
+        free(react_table);
+        react_table = table;
+        react_cap = cap;
+    }
+    size_t i = hash_bytes(&seq, sizeof(seq)) & (react_cap - 1);
+    while (react_table[i].seq) i = (i + 1) & (react_cap - 1);
+    react_table[i].seq = seq;
+    react_count++;
+    return &react_table[i];
+}
+
+/**
+ * @brief Restores a message's reaction totals from a logged REACTS line (at startup).
+ * 
+ * @details Each REACTS line carries absolute totals, so the last one logged
+ * for a message is its current state.
+ * 
+ * @param target Sequence number of the message.
+ * @param line The line, "REACTS:<seq>:<name>=<count>,...".
+ */
+void react_restore(uint64_t target, char *line) {
+    char *totals = strchr(line + 7, ':');
+    if (!totals) return;
+    pthread_mutex_lock(&react_mutex);
+    react_entry_t *e = react_lookup(target, 1);
+    if (e) {
+        e->n = 0;
+        char *save;
+        for (char *t = strtok_r(totals + 1, ",\n", &save); t && e->n < REACT_KINDS; t = strtok_r(NULL, ",\n", &save)) {
+            char *eq = strchr(t, '=');
+            if (!eq || eq == t || eq - t >= MAX_REACTION) continue;
+            memcpy(e->names[e->n], t, eq - t);
+            e->names[e->n][eq - t] = '\0';
+            e->counts[e->n++] = (uint32_t)strtoul(eq + 1, NULL, 10);
+        }
+    }
+    pthread_mutex_unlock(&react_mutex);
+}
+
+/**
+ * @brief Finds a message in the edit table (log_mutex held).
+ * 
+ * @param seq Sequence number of the message.
+ * @param create 1 to add an empty entry if there is none.
+ * @return edit_entry_t* The entry, or NULL if absent (or allocation failed).
+ */
+edit_entry_t *edit_lookup(uint64_t seq, int create) {
+    if (edit_map_cap > 0) {
+        for (size_t i = hash_bytes(&seq, sizeof(seq)) & (edit_map_cap - 1); edit_map[i].seq;
+             i = (i + 1) & (edit_map_cap - 1)) {
+            if (edit_map[i].seq == seq) return &edit_map[i];
+        }
+    }
+    if (!create) return NULL;
+
+    // Keep the table at most half full
+    if ((edit_map_count + 1) * 2 > edit_map_cap) {
+        size_t cap = edit_map_cap ? edit_map_cap * 2 : 256;
+        edit_entry_t *map = calloc(cap, sizeof(edit_entry_t));
+        if (!map) return NULL;
+        for (size_t j = 0; j < edit_map_cap; j++) {
+            if (!edit_map[j].seq) continue;
+            size_t i = hash_bytes(&edit_map[j].seq, sizeof(uint64_t)) & (cap - 1);
+            while (map[i].seq) i = (i + 1) & (cap - 1);
+            map[i] = edit_map[j];
+        }
+        free(edit_map);
+        edit_map = map;
+        edit_map_cap = cap;
+    }
+    size_t i = hash_bytes(&seq, sizeof(seq)) & (edit_map_cap - 1);
+    while (edit_map[i].seq) i = (i + 1) & (edit_map_cap - 1);
+    edit_map[i].seq = seq;
+    edit_map_count++;
+    return &edit_map[i];
+}
+
+/**
+ * @brief Records a sequenced frame in the in-memory history (log_mutex held).
+ * 
+ * @details Every frame takes its slot in the ring. EDIT and DELETE deltas
+ * also update the state of the message they name, in the ring if it is
+ * still there and in the edit table either way.
+ * 
+ * @param seq Sequence number of the frame.
+ * @param ts_usec Time of the frame.
+ * @param flags The frame's log flags.
+ * @param target Message a delta applies to.
+ * @param data The frame's line.
+ * @param len Length of the line.
+ */
+void history_apply(uint64_t seq, int64_t ts_usec, uint32_t flags, uint64_t target, const char *data, size_t len) {
+    if (history_ring) {
+        history_entry_t *h = &history_ring[seq & (HISTORY_RING - 1)];
+        h->seq = seq;
+        h->ts_usec = ts_usec;
+        h->flags = flags;
+        h->state = 0;
+        h->len = (uint32_t)len;
+        memcpy(h->data, data, len);
+    }
+    if (flags == 0 || (flags & LOG_REACT)) return; // reaction totals live in the reaction table
+
+    edit_entry_t *e = edit_lookup(target, 1);
+    history_entry_t *h = history_ring ? &history_ring[target & (HISTORY_RING - 1)] : NULL;
+    if (h && (h->seq != target || h->flags != 0)) h = NULL;
+    if (flags & LOG_DELETE) {
+        if (e) e->state |= HIST_DELETED;
+        if (h) h->state |= HIST_DELETED;
+    } else {
+        if (e) {
+            e->state |= HIST_EDITED;
+            e->edit_seq = seq;
+        }
+        // The new line follows "EDIT:<seq>:"
+        const char *line = memchr(data + 5, ':', len - 5);
+        if (h && line) {
+            line++;
+            h->len = (uint32_t)(len - (line - data));
+            memmove(h->data, line, h->len);
+            h->state |= HIST_EDITED;
+        }
+    }
+}
+
+/**
+ * @brief Rebuilds the edit and reaction tables from the delta records of a segment (at startup).
+ * 
+ * @param seg The segment.
+ */
+void history_scan_segment(log_segment_t *seg) {
+    log_record_t recs[256];
+    for (uint64_t i = 0; i < seg->count; ) {
+        size_t want = seg->count - i < 256 ? seg->count - i : 256;
+        ssize_t got = pread(seg->idx_fd, recs, want * sizeof(log_record_t), i * sizeof(log_record_t));
+        if (got < (ssize_t)sizeof(log_record_t)) return;
+        size_t n = got / sizeof(log_record_t);
+        for (size_t j = 0; j < n; j++) {
+            if (!recs[j].flags) continue;
+            char line[FRAME_CAP];
+            size_t len = recs[j].len < sizeof(line) - 1 ? recs[j].len : sizeof(line) - 1;
+            if (segment_read(seg, recs[j].offset, len, line) < 0) continue;
+            line[len] = '\0';
+            uint64_t target = strtoull(strchr(line, ':') ? strchr(line, ':') + 1 : line, NULL, 10);
+            if (!target) continue;
+            if (recs[j].flags & LOG_REACT) react_restore(target, line);
+            else history_apply(recs[j].seq, recs[j].ts_usec, recs[j].flags, target, line, len);
+        }
+        i += n;
+    }
+}
+
+/**
+ * @brief Orders segment first sequence numbers for qsort.
+ */
+int compare_seq(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Opens the message log in log_dir, recovering existing segments.
+ * 
+ * @return int 0 on success, -1 on error.
+ */
+int log_open(void) {
+    if (!log_readonly && mkdir(log_dir, 0755) < 0 && errno != EEXIST) {
+        perror(log_dir);
+        return -1;
+    }
+    DIR *d = opendir(log_dir);
+    if (!d) {
+        perror(log_dir);
+        return -1;
+    }
+
+    // Collect the first sequence numbers of existing segments
+    uint64_t *firsts = NULL;
+    int n = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        size_t len = strlen(e->d_name);
+        if (!(len == 24 && strcmp(e->d_name + 20, ".log") == 0) && !(len == 25 && strcmp(e->d_name + 20, ".cold") == 0)) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *grown = realloc(firsts, cap * sizeof(uint64_t));
+            if (!grown) break;
+            firsts = grown;
+        }
+        firsts[n++] = strtoull(e->d_name, NULL, 10);
+    }
+    closedir(d);
+    qsort(firsts, n, sizeof(uint64_t), compare_seq);
+
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && firsts[i] == firsts[i - 1]) continue; // both .log and .cold
+        log_segment_t *seg = segment_open(firsts[i]);
+        if (!seg) {
+            free(firsts);
+            return -1;
+        }
+        history_scan_segment(seg);
+    }
+    free(firsts);
+
+    if (log_nsegs > 0) {
+        log_segment_t *last = &log_segs[log_nsegs - 1];
+        next_seq = last->first_seq + last->count;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the segment holding a sequence number (log_mutex held).
+ * 
+ * @param seq The sequence number.
+ * @return int Index into log_segs, or -1 if the sequence is not in the log.
+ */
+int segment_for_seq(uint64_t seq) {
+    int lo = 0, hi = log_nsegs - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        log_segment_t *seg = &log_segs[mid];
+        if (seq < seg->first_seq) hi = mid - 1;
+        else if (seq >= seg->first_seq + seg->count) lo = mid + 1;
+        else return mid;
+    }
+    return -1;
+}
+
+/**
+ * @brief Finds the segment and index record of a sequence number (log_mutex held).
+ * 
+ * @param seq The sequence number.
+ * @param rec Output: its index record.
+ * @param seg Output: a copy of its segment, usable while segment_lock is held.
+ * @return int 0 on success, -1 if the sequence is not in the log.
+ */
+int log_locate(uint64_t seq, log_record_t *rec, log_segment_t *seg) {
+    int si = segment_for_seq(seq);
+    if (si < 0) return -1;
+    *seg = log_segs[si];
+    return pread(seg->idx_fd, rec, sizeof(*rec), (seq - seg->first_seq) * sizeof(*rec)) == sizeof(*rec) ? 0 : -1;
+}
+
+/**
+ * @brief Reads the current line for a sequence number, from the ring when it is there.
+ * 
+ * @details Recent messages are answered from the in-memory ring. Older ones
+ * are located through the log: a binary search over segments, then the
+ * fixed-size index record, then the line itself. Messages come back with
+ * their latest edit applied; delta records come back as logged.
+ * 
+ * @param seq The sequence number.
+ * @param buf Output: the line (2 * FRAME_CAP bytes, half of it scratch).
+ * @param rec Output: seq, ts_usec and flags of its record.
+ * @param state Output: HIST_EDITED and HIST_DELETED bits (messages only).
+ * @return ssize_t Length of the line, or -1 if the sequence is unknown.
+ */
+ssize_t history_read(uint64_t seq, char *buf, log_record_t *rec, uint32_t *state) {
+    ssize_t len = -1;
+    log_segment_t seg, eseg;
+    log_record_t erec;
+    int disk = 0, edited = 0;
+    *state = 0;
+    pthread_rwlock_rdlock(&segment_lock);
+    pthread_mutex_lock(&log_mutex);
+    history_entry_t *h = history_ring ? &history_ring[seq & (HISTORY_RING - 1)] : NULL;
+    if (h && h->seq == seq) {
+        memcpy(buf, h->data, h->len);
+        len = h->len;
+        memset(rec, 0, sizeof(*rec));
+        rec->seq = seq;
+        rec->ts_usec = h->ts_usec;
+        rec->flags = h->flags;
+        *state = h->state;
+        atomic_fetch_add_explicit(&history_ring_hits, 1, memory_order_relaxed);
+    } else if (log_dir[0]) {
+        disk = log_locate(seq, rec, &seg) == 0;
+        edit_entry_t *e = (disk && rec->flags == 0) ? edit_lookup(seq, 0) : NULL;
+        if (e) {
+            *state = e->state;
+            edited = e->edit_seq && log_locate(e->edit_seq, &erec, &eseg) == 0;
+        }
+        atomic_fetch_add_explicit(&history_disk_lookups, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&log_mutex);
+
+    // Lines are read outside log_mutex, so a slow read (a cold block) does not hold up the dispatcher
+    if (disk) {
+        len = rec->len < FRAME_CAP ? rec->len : FRAME_CAP;
+        if (segment_read(&seg, rec->offset, len, buf) < 0) len = -1;
+    }
+    if (len >= 0 && edited) {
+        size_t n = erec.len < FRAME_CAP ? erec.len : FRAME_CAP;
+        // The edited line follows "EDIT:<seq>:"
+        char *line = (n > 5 && segment_read(&eseg, erec.offset, n, buf + len) == 0) ? memchr(buf + len + 5, ':', n - 5) : NULL;
+        if (line) {
+            line++;
+            n -= line - (buf + len);
+            memmove(buf, line, n);
+            len = n;
+        }
+    }
+    pthread_rwlock_unlock(&segment_lock);
+    return len;
+}
+
+/**
+ * @brief Looks up the author and state of a message by sequence number.
+ * 
+ * @param seq Sequence number of the message.
+ * @param sender Output: the author (MAX_USERNAME bytes), or NULL.
+ * @param state Output: HIST_EDITED and HIST_DELETED bits, or NULL.
+ * @return int 0 if found, -1 if there is no such message (or it is a delta).
+ */
+int history_lookup(uint64_t seq, char *sender, uint32_t *state) {
+    char line[2 * FRAME_CAP];
+    log_record_t rec;
+    uint32_t st;
+    ssize_t len = history_read(seq, line, &rec, &st);
+    if (len < 0 || rec.flags != 0) return -1;
+
+    // Usernames cannot contain ':', so the author is everything before the first one
+    char *colon = memchr(line, ':', len);
+    if (!colon) return -1;
+    if (sender) {
+        size_t n = colon - line < MAX_USERNAME ? (size_t)(colon - line) : MAX_USERNAME - 1;
+        memcpy(sender, line, n);
+        sender[n] = '\0';
+    }
+    if (state) *state = st;
+    return 0;
+}
+
+/**
+ * @brief Returns the latest EDIT delta of a message.
+ * 
+ * @param seq Sequence number of the message.
+ * @param state Output: HIST_EDITED and HIST_DELETED bits.
+ * @return uint64_t Sequence number of the delta, or 0 if never edited.
+ */
+uint64_t history_latest_edit(uint64_t seq, uint32_t *state) {
+    pthread_mutex_lock(&log_mutex);
+    edit_entry_t *e = edit_lookup(seq, 0);
+    uint64_t edit_seq = e ? e->edit_seq : 0;
+    *state = e ? e->state : 0;
+    pthread_mutex_unlock(&log_mutex);
+    return edit_seq;
+}
+
+/**
+ * @brief Assigns sequence numbers to a batch of frames and appends them to the log.
+ * 
+ * @details Called by a shard's dispatcher, before the batch is broadcast.
+ * The whole batch is numbered and written under log_mutex, so in per-core
+ * mode, where every shard sequences its own batches, the log still holds
+ * the lines in sequence order. Timestamps are kept from going backwards
+ * across batches for the same reason: HISTORY finds a time by bisection.
+ * The lines go to the current segment with one gathered write, followed by
+ * their index records; a new segment is started once the current one is
+ * full. Each frame is also recorded in the in-memory history.
+ * 
+ * @param all The frames, in order.
+ * @param nall Number of frames (at most BATCH_MAX).
+ */
+void log_frames(frame_t **all, int nall) {
+    // Ephemeral frames are neither sequenced nor logged
+    frame_t *frames[BATCH_MAX];
+    int n = 0;
+    for (int i = 0; i < nall; i++) {
+        if (!all[i]->ephemeral) frames[n++] = all[i];
+    }
+
+    static int64_t last_ts = 0; // log_mutex
+    pthread_mutex_lock(&log_mutex);
+    for (int i = 0; i < n; i++) {
+        frames[i]->seq = next_seq++;
+        if (frames[i]->ts_usec < last_ts) frames[i]->ts_usec = last_ts;
+        last_ts = frames[i]->ts_usec;
+        history_apply(frames[i]->seq, frames[i]->ts_usec, frames[i]->flags, frames[i]->target,
+                      frames[i]->data, frames[i]->len);
+    }
+
+    if (log_dir[0] && n > 0) {
+        log_segment_t *seg = log_nsegs ? &log_segs[log_nsegs - 1] : NULL;
+        if (!seg || seg->size >= log_segment_bytes) seg = segment_open(frames[0]->seq);
+
+        if (seg) {
+            struct iovec iov[BATCH_MAX];
+            log_record_t recs[BATCH_MAX];
+            uint64_t off = seg->size;
+            for (int i = 0; i < n; i++) {
+                iov[i].iov_base = frames[i]->data;
+                iov[i].iov_len = frames[i]->len;
+                recs[i].seq = frames[i]->seq;
+                recs[i].ts_usec = frames[i]->ts_usec;
+                recs[i].offset = off;
+                recs[i].len = (uint32_t)frames[i]->len;
+                recs[i].flags = frames[i]->flags;
+                off += frames[i]->len;
+            }
+            // Data first, so an index record never points past the end of the data
+            if (writev_all(seg->fd, iov, n) == 0 &&
+                write_all(seg->idx_fd, recs, n * sizeof(log_record_t)) == 0) {
+                seg->size = off;
+                seg->count += n;
+            } else {
+                perror("log write");
+            }
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+/**
+ * @brief Marks a newly logged-in client live, sends it "OK" and replays recent history.
+ * 
+ * @details The client is marked live with backfilling set, so broadcasts
+ * (and DMs) from then on are queued for it rather than written, and never
+ * wait on the backfill; the caller writes them out with client_release_held()
+ * once the backfill and the stored DMs have been sent. This happens before
+ * "OK" is sent, so nothing broadcast after the client sees "OK" is missed.
+ * Frames that were already logged when the snapshot was taken are skipped
+ * by the broadcaster (live_from), so nothing is delivered twice or lost. The
+ * history is streamed with sendfile() straight from the segment files, or
+ * decompressed block by block from cold ones. The descriptors are
+ * duplicated, so compaction can retire a .log meanwhile.
+ * 
+ * "OK" and the history are written under send_lock like any other output.
+ * While backfilling is set every other writer queues instead, so the lock
+ * is never contended; it is taken so that the socket has a single writer
+ * by construction rather than by that invariant alone.
+ * 
+ * @param c The client.
+ * @return int 0 on success, -1 if the history could not be sent in full
+ * (the caller disconnects rather than leave a gap before live output).
+ */
+int client_go_live(client_t *c) {
+    atomic_store_explicit(&c->backfilling, 1, memory_order_release);
+
+    // Snapshot the byte ranges to replay; segment files are append-only
+    int nranges = 0, ok = 1;
+    struct { log_segment_t seg; off_t off; size_t len; } *ranges = NULL;
+    pthread_mutex_lock(&log_mutex);
+    c->live_from = next_seq;
+    c->logged_in = 1;
+    if (log_dir[0] && backfill_count > 0) {
+        ranges = malloc(sizeof(*ranges) * (log_nsegs ? log_nsegs : 1));
+        if (!ranges) ok = 0;
+        uint64_t start = next_seq > (uint64_t)backfill_count ? next_seq - backfill_count : 1;
+        if (log_nsegs > 0 && start < log_segs[0].first_seq) start = log_segs[0].first_seq;
+        int si = segment_for_seq(start);
+        for (; ok && si >= 0 && si < log_nsegs; si++) {
+            log_segment_t *seg = &log_segs[si];
+            if (seg->count == 0) continue;
+            off_t off = 0;
+            if (start > seg->first_seq) {
+                log_record_t rec;
+                if (pread(seg->idx_fd, &rec, sizeof(rec), (start - seg->first_seq) * sizeof(rec)) != sizeof(rec)) {
+                    ok = 0;
+                    break;
+                }
+                off = rec.offset;
+            }
+            ranges[nranges].seg = *seg;
+            if (!seg->cold && (ranges[nranges].seg.fd = dup(seg->fd)) < 0) {
+                ok = 0;
+                break;
+            }
+            ranges[nranges].off = off;
+            ranges[nranges].len = seg->size - off;
+            nranges++;
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+
+    // Live output is held, so "OK" still comes first, and every broadcast after it reaches the client
+    pthread_mutex_lock(&c->send_lock);
+    if (ok && send_all(c->sockfd, "OK\n", 3) < 0) ok = 0;
+
+    size_t total = 0;
+    char *chunk = NULL;
+    for (int i = 0; i < nranges; i++) {
+        off_t off = ranges[i].off;
+        size_t left = ranges[i].len;
+        while (ok && left > 0 && !ranges[i].seg.cold) {
+            ssize_t n = sendfile(c->sockfd, ranges[i].seg.fd, &off, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                ok = 0; // a short file is as bad as a failed send: the history would have a hole
+                break;
+            }
+            left -= n;
+            total += n;
+        }
+        while (ok && left > 0) {
+            size_t n = left < COLD_BLOCK ? left : COLD_BLOCK;
+            if ((!chunk && !(chunk = malloc(COLD_BLOCK))) || segment_read(&ranges[i].seg, off, n, chunk) < 0 ||
+                send_all(c->sockfd, chunk, n) < 0) {
+                ok = 0;
+                break;
+            }
+            off += n;
+            left -= n;
+            total += n;
+        }
+        if (!ranges[i].seg.cold) close(ranges[i].seg.fd);
+    }
+    pthread_mutex_unlock(&c->send_lock);
+    free(chunk);
+    free(ranges);
+
+    if (!ok) return -1;
+    if (nranges > 0) {
+        atomic_fetch_add_explicit(&backfills, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&backfill_bytes, total, memory_order_relaxed);
+    }
+    return 0;
+}
+
+/**
+ * @brief Initializes an empty Aho-Corasick automaton.
+ * 
+ * @param ac The automaton.
+ * @param nocase 1 to match ASCII letters case-insensitively.
+ * @return int 0 on success, -1 if allocation failed.
+ */
+int ac_init(ac_automaton_t *ac, int nocase) {
+    memset(ac, 0, sizeof(*ac));
+    ac->nocase = nocase;
+    ac->nodes_cap = 64;
+    ac->nodes = malloc(ac->nodes_cap * sizeof(ac_node_t));
+    if (!ac->nodes) return -1;
+    ac->nodes[0] = (ac_node_t){ .child = -1, .sibling = -1, .fail = 0, .dict = -1, .pattern = -1 };
+    ac->nnodes = 1;
+    ac->compiled = 1;
+    return 0;
+}
+
+/**
+ * @brief Frees an automaton's memory.
+ * 
+ * @param ac The automaton.
+ */
+void ac_free(ac_automaton_t *ac) {
+    free(ac->nodes);
+    free(ac->pattern_len);
+    free(ac->pattern_active);
+    memset(ac, 0, sizeof(*ac));
+}
+
+/**
+ * @brief Normalizes an input byte for matching.
+ */
+static inline unsigned char ac_byte(const ac_automaton_t *ac, unsigned char ch) {
+    return (ac->nocase && ch >= 'A' && ch <= 'Z') ? ch - 'A' + 'a' : ch;
+}
+
+/**
+ * @brief Finds the child of a node along a byte.
+ * 
+ * @return int The child node, or -1.
+ */
+static inline int ac_child(const ac_automaton_t *ac, int node, unsigned char ch) {
+    for (int k = ac->nodes[node].child; k >= 0; k = ac->nodes[k].sibling) {
+        if (ac->nodes[k].label == ch) return k;
+    }
+    return -1;
+}
+
+/**
+ * @brief Finds the trie node spelling a pattern.
+ * 
+ * @return int The node, or -1 if the pattern is not in the trie.
+ */
+int ac_find(const ac_automaton_t *ac, const char *pat, size_t len) {
+    int node = 0;
+    for (size_t i = 0; i < len && node >= 0; i++) {
+        node = ac_child(ac, node, ac_byte(ac, (unsigned char)pat[i]));
+    }
+    return node;
+}
+
+/**
+ * @brief Adds a pattern (or reactivates it if it is already in the trie).
+ * 
+ * @details Only the new path is inserted; fail links are recomputed lazily
+ * by ac_compile() before the next scan.
+ * 
+ * @param ac The automaton.
+ * @param pat The pattern bytes.
+ * @param len Pattern length (at least 1).
+ * @return int The pattern id, or -1 on error.
+ */
+int ac_add(ac_automaton_t *ac, const char *pat, size_t len) {
+    if (len == 0) return -1;
+    int node = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = ac_byte(ac, (unsigned char)pat[i]);
+        int next = ac_child(ac, node, ch);
+        if (next < 0) {
+            if (ac->nnodes == ac->nodes_cap) {
+                ac_node_t *grown = realloc(ac->nodes, 2 * ac->nodes_cap * sizeof(ac_node_t));
+                if (!grown) return -1;
+                ac->nodes = grown;
+                ac->nodes_cap *= 2;
+            }
+            next = ac->nnodes++;
+            ac->nodes[next] = (ac_node_t){ .child = -1, .sibling = ac->nodes[node].child, .fail = 0,
+                                           .dict = -1, .pattern = -1, .label = ch };
+            ac->nodes[node].child = next;
+            ac->compiled = 0;
+        }
+        node = next;
+    }
+
+    int id = ac->nodes[node].pattern;
+    if (id >= 0) {
+        if (!ac->pattern_active[id]) ac->dead--;
+        ac->pattern_active[id] = 1;
+        return id;
+    }
+    if (ac->npatterns == ac->patterns_cap) {
+        int cap = ac->patterns_cap ? ac->patterns_cap * 2 : 16;
+        int *lens = realloc(ac->pattern_len, cap * sizeof(int));
+        if (!lens) return -1;
+        ac->pattern_len = lens;
+        unsigned char *active = realloc(ac->pattern_active, cap);
+        if (!active) return -1;
+        ac->pattern_active = active;
+        ac->patterns_cap = cap;
+    }
+    id = ac->npatterns++;
+    ac->pattern_len[id] = (int)len;
+    ac->pattern_active[id] = 1;
+    ac->nodes[node].pattern = id;
+    ac->compiled = 0; // dict links change when a node becomes terminal
+    return id;
+}
+
+/**
+ * @brief Deactivates a pattern without touching the trie.
+ * 
+ * @param ac The automaton.
+ * @param pat The pattern bytes.
+ * @param len Pattern length.
+ * @return int The pattern id, or -1 if it was not present.
+ */
+int ac_remove(ac_automaton_t *ac, const char *pat, size_t len) {
+    int node = ac_find(ac, pat, len);
+    if (node < 0 || ac->nodes[node].pattern < 0) return -1;
+    int id = ac->nodes[node].pattern;
+    if (ac->pattern_active[id]) {
+        ac->pattern_active[id] = 0;
+        ac->dead++;
+    }
+    return id;
+}
+
+/**
+ * @brief Computes fail and dictionary links breadth-first.
+ * 
+ * @param ac The automaton.
+ * @return int 0 on success, -1 if allocation failed.
+ */
+int ac_compile(ac_automaton_t *ac) {
+    if (ac->compiled) return 0;
+    int *queue = malloc(ac->nnodes * sizeof(int));
+    if (!queue) return -1;
+    int head = 0, tail = 0;
+    for (int k = ac->nodes[0].child; k >= 0; k = ac->nodes[k].sibling) {
+        ac->nodes[k].fail = 0;
+        ac->nodes[k].dict = -1;
+        queue[tail++] = k;
+    }
+    while (head < tail) {
+        int u = queue[head++];
+        for (int v = ac->nodes[u].child; v >= 0; v = ac->nodes[v].sibling) {
+            // Follow u's fail chain until some node has an edge on v's label
+            int f = ac->nodes[u].fail;
+            int next;
+            while ((next = ac_child(ac, f, ac->nodes[v].label)) < 0 && f != 0) f = ac->nodes[f].fail;
+            ac->nodes[v].fail = (next >= 0 && next != v) ? next : 0;
+            int fn = ac->nodes[v].fail;
+            ac->nodes[v].dict = ac->nodes[fn].pattern >= 0 ? fn : ac->nodes[fn].dict;
+            queue[tail++] = v;
+        }
+    }
+    free(queue);
+    ac->compiled = 1;
+    return 0;
+}
+
+/**
+ * @brief Scans text once, reporting every active pattern occurrence.
+ * 
+ * @param ac A compiled automaton.
+ * @param text The text.
+ * @param len Text length.
+ * @param hit Called with (pattern id, end offset one past the match, arg); returns non-zero to stop.
+ * @param arg Passed to hit.
+ */
+void ac_scan(const ac_automaton_t *ac, const char *text, size_t len,
+             int (*hit)(int pattern, size_t end, void *arg), void *arg) {
+    int state = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = ac_byte(ac, (unsigned char)text[i]);
+        int next;
+        while ((next = ac_child(ac, state, ch)) < 0 && state != 0) state = ac->nodes[state].fail;
+        state = next >= 0 ? next : 0;
+
+        // Report the pattern ending here plus those ending at shorter suffixes
+        for (int k = ac->nodes[state].pattern >= 0 ? state : ac->nodes[state].dict; k >= 0; k = ac->nodes[k].dict) {
+            int id = ac->nodes[k].pattern;
+            if (ac->pattern_active[id] && hit(id, i + 1, arg)) return;
+        }
+    }
+}
+
+/**
+ * @brief Registers a logged-in user for @mention matching.
+ * 
+ * @param username The user.
+ */
+void mention_add(const char *username) {
+    if (!mentions_enabled) return;
+    char pat[MAX_USERNAME + 1];
+    int len = snprintf(pat, sizeof(pat), "@%s", username);
+    pthread_mutex_lock(&mention_mutex);
+    int id = ac_add(&mention_ac, pat, len);
+    if (id >= mention_names_cap) {
+        char (*names)[MAX_USERNAME] = realloc(mention_names, mention_ac.patterns_cap * sizeof(*names));
+        if (names) {
+            mention_names = names;
+            mention_names_cap = mention_ac.patterns_cap;
+        }
+    }
+    if (id >= 0 && id < mention_names_cap) {
+        snprintf(mention_names[id], MAX_USERNAME, "%s", username);
+    } else if (id >= 0) {
+        // No room for the name: an active pattern without one would be read past the table
+        ac_remove(&mention_ac, pat, len);
+    }
+    pthread_mutex_unlock(&mention_mutex);
+}
+
+/**
+ * @brief Unregisters a user who logged out.
+ * 
+ * @param username The user.
+ */
+void mention_remove(const char *username) {
+    if (!mentions_enabled) return;
+    char pat[MAX_USERNAME + 1];
+    int len = snprintf(pat, sizeof(pat), "@%s", username);
+    pthread_mutex_lock(&mention_mutex);
+    ac_remove(&mention_ac, pat, len);
+    pthread_mutex_unlock(&mention_mutex);
+}
+
+/**
+ * @brief Rebuilds the mention automaton from the active users once most patterns are dead.
+ * 
+ * @details Logouts only deactivate patterns, so churn leaves dead paths in the
+ * trie; rebuilding when they outnumber the live ones keeps it proportional to
+ * the users online. Called with mention_mutex held.
+ */
+void mention_compact_locked(void) {
+    if (mention_ac.dead < 64 || mention_ac.dead < mention_ac.npatterns / 2) return;
+    ac_automaton_t fresh;
+    if (ac_init(&fresh, 0) < 0) return;
+    int cap = mention_ac.npatterns - mention_ac.dead + 1;
+    char (*names)[MAX_USERNAME] = malloc(cap * sizeof(*names));
+    if (!names) {
+        ac_free(&fresh);
+        return;
+    }
+    for (int id = 0; id < mention_ac.npatterns; id++) {
+        if (!mention_ac.pattern_active[id]) continue;
+        char pat[MAX_USERNAME + 1];
+        int len = snprintf(pat, sizeof(pat), "@%s", mention_names[id]);
+        int nid = ac_add(&fresh, pat, len);
+        if (nid >= 0) memcpy(names[nid], mention_names[id], MAX_USERNAME);
+    }
+    ac_free(&mention_ac);
+    free(mention_names);
+    mention_ac = fresh;
+    mention_names = names;
+    mention_names_cap = cap;
+    atomic_fetch_add_explicit(&mention_rebuilds, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief State for collecting the users mentioned in one message.
+ */
+typedef struct mention_scan {
+    const char *text;
+    size_t len;
+    int ids[MAX_MENTIONS];
+    int n;
+} mention_scan_t;
+
+/**
+ * @brief ac_scan callback: records a mention that ends on a word boundary.
+ */
+int mention_hit(int pattern, size_t end, void *arg) {
+    mention_scan_t *ms = arg;
+    // "@al" must not match inside "@alice"
+    if (end < ms->len) {
+        unsigned char next = (unsigned char)ms->text[end];
+        if ((next >= 'a' && next <= 'z') || (next >= 'A' && next <= 'Z') || (next >= '0' && next <= '9') || next == '_') return 0;
+    }
+    for (int i = 0; i < ms->n; i++) {
+        if (ms->ids[i] == pattern) return 0;
+    }
+    ms->ids[ms->n++] = pattern;
+    return ms->n == MAX_MENTIONS;
+}
+
+/**
+ * @brief Finds the users @mentioned in a message and queues notifications for them.
+ * 
+ * @param sender The message sender, who is never notified.
+ * @param text The message text.
+ * @param f The message's frame; each note takes a reference.
+ * @param notes Output notes.
+ * @param nnotes Number of notes so far; advanced for each mention.
+ * @param cap Capacity of notes.
+ */
+void find_mentions(const char *sender, const char *text, frame_t *f, mention_note_t *notes, int *nnotes, int cap) {
+    if (!mentions_enabled || !strchr(text, '@')) return;
+    mention_scan_t ms = { .text = text, .len = strlen(text), .n = 0 };
+
+    pthread_mutex_lock(&mention_mutex);
+    mention_compact_locked();
+    if (ac_compile(&mention_ac) == 0) ac_scan(&mention_ac, ms.text, ms.len, mention_hit, &ms);
+    for (int i = 0; i < ms.n && *nnotes < cap; i++) {
+        if (strcmp(mention_names[ms.ids[i]], sender) == 0) continue;
+        mention_note_t *note = &notes[(*nnotes)++];
+        memcpy(note->username, mention_names[ms.ids[i]], MAX_USERNAME);
+        atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+        note->frame = f;
+    }
+    pthread_mutex_unlock(&mention_mutex);
+}
+
+/**
+ * @brief Sends a buffer to the logged-in client with a given username.
+ * 
+ * @param username The recipient.
+ * @param buf The data.
+ * @param len Data length.
+ * @return int 0 if delivered, -1 if the user is not online or the send failed.
+ */
+int send_to_user(const char *username, const void *buf, size_t len) {
+    int rc = -1;
+    for (int i = 0; i < num_shards && rc < 0; i++) {
+        shard_t *s = shards[i];
+        pthread_mutex_lock(&s->clients_mutex);
+        for (client_t *c = s->clients_head; c; c = c->next) {
+            if (c->logged_in && strcmp(c->username, username) == 0) {
+                rc = client_send(c, buf, len) < 0 ? -1 : 0;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&s->clients_mutex);
+    }
+    return rc;
+}
+
+/**
+ * @brief Reports whether a user has a logged-in connection.
+ * 
+ * @param username The user to look for.
+ * @return int 1 if online, 0 otherwise.
+ */
+int user_online(const char *username) {
+    int found = 0;
+    for (int i = 0; i < num_shards && !found; i++) {
+        shard_t *s = shards[i];
+        pthread_mutex_lock(&s->clients_mutex);
+        for (client_t *c = s->clients_head; c && !found; c = c->next) {
+            found = c->logged_in && strcmp(c->username, username) == 0;
+        }
+        pthread_mutex_unlock(&s->clients_mutex);
+    }
+    return found;
+}
+
+/**
+ * @brief Delivers queued mention notifications as MENTION:<sender>: <text> lines.
+ * 
+ * @param notes The notes; their frame references are released.
+ * @param n Number of notes.
+ */
+void deliver_mentions(mention_note_t *notes, int n) {
+    for (int i = 0; i < n; i++) {
+        frame_t *f = notes[i].frame;
+        char out[FRAME_CAP + 16];
+        int len = snprintf(out, sizeof(out), "MENTION:%.*s", (int)f->len, f->data);
+        if (len > (int)sizeof(out) - 1) len = sizeof(out) - 1;
+        if (send_to_user(notes[i].username, out, len) == 0) {
+            atomic_fetch_add_explicit(&mentions_sent, 1, memory_order_relaxed);
+        }
+        frame_put(f);
+    }
+}
+
+/**
+ * @brief Loads and compiles a content filter word list.
+ * 
+ * @details One term per line; blank lines and lines starting with '#' are
+ * ignored. Matching is case-insensitive.
+ * 
+ * @param path The word list file.
+ * @param nterms Receives the number of terms.
+ * @return ac_automaton_t* The compiled automaton, or NULL on error.
+ */
+ac_automaton_t *filter_load(const char *path, int *nterms) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+    ac_automaton_t *ac = malloc(sizeof(ac_automaton_t));
+    if (!ac || ac_init(ac, 1) < 0) {
+        free(ac);
+        fclose(fp);
+        return NULL;
+    }
+    char term[256];
+    *nterms = 0;
+    while (fgets(term, sizeof(term), fp)) {
+        size_t len = strcspn(term, "\r\n");
+        if (len == 0 || term[0] == '#') continue;
+        if (ac_add(ac, term, len) >= 0) (*nterms)++;
+    }
+    fclose(fp);
+    if (ac_compile(ac) < 0) {
+        ac_free(ac);
+        free(ac);
+        return NULL;
+    }
+    return ac;
+}
+
+/**
+ * @brief Reloads the word list and hands it to the dispatchers.
+ * 
+ * @details The new automaton is built on the calling (reload) thread and
+ * published through filter_pending; the first dispatcher to filter a
+ * message swaps it in, so traffic never waits for a reload to compile.
+ */
+void filter_reload(void) {
+    if (!filter_path[0]) return;
+    int nterms;
+    ac_automaton_t *fresh = filter_load(filter_path, &nterms);
+    if (!fresh) return;
+    ac_automaton_t *stale = atomic_exchange(&filter_pending, fresh);
+    if (stale) {
+        // No dispatcher saw the previous reload
+        ac_free(stale);
+        free(stale);
+    }
+    atomic_store(&filter_terms, nterms);
+    atomic_fetch_add(&filter_reloads, 1);
+    printf("Content filter loaded: %d terms\n", nterms);
+}
+
+/**
+ * @brief State for one content filter scan.
+ */
+typedef struct filter_scan {
+    const ac_automaton_t *ac;
+    char *text;
+    size_t len;
+    int hits;
+    int mask;
+} filter_scan_t;
+
+/**
+ * @brief Checks whether a byte is part of a word.
+ */
+static inline int word_byte(unsigned char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+/**
+ * @brief ac_scan callback: masks (or just counts) a banned term that is a whole word.
+ */
+int filter_hit(int pattern, size_t end, void *arg) {
+    filter_scan_t *fs = arg;
+    size_t start = end - fs->ac->pattern_len[pattern];
+    if (start > 0 && word_byte((unsigned char)fs->text[start - 1])) return 0;
+    if (end < fs->len && word_byte((unsigned char)fs->text[end])) return 0;
+    fs->hits++;
+    if (fs->mask) memset(fs->text + start, '*', end - start);
+    return !fs->mask; // one hit is enough to drop
+}
+
+/**
+ * @brief Applies the content filter to a message text in place.
+ * 
+ * @details Called by the dispatchers. A reloaded word list is adopted under
+ * the write side of filter_lock, so it never replaces the automaton while
+ * another shard is scanning with it; scans share the read side.
+ * 
+ * @param text The message text (masked in place).
+ * @return int 1 if the message should be dropped, 0 otherwise.
+ */
+int filter_message(char *text) {
+    if (atomic_load_explicit(&filter_pending, memory_order_relaxed)) {
+        pthread_rwlock_wrlock(&filter_lock);
+        ac_automaton_t *fresh = atomic_exchange(&filter_pending, NULL);
+        if (fresh) {
+            if (filter_ac) {
+                ac_free(filter_ac);
+                free(filter_ac);
+            }
+            filter_ac = fresh;
+        }
+        pthread_rwlock_unlock(&filter_lock);
+    }
+
+    pthread_rwlock_rdlock(&filter_lock);
+    filter_scan_t fs = { .ac = filter_ac, .text = text, .len = strlen(text), .hits = 0,
+                         .mask = (filter_action == FILTER_MASK) };
+    // Masking never changes the length, so the scan can rewrite as it goes
+    if (filter_ac && filter_ac->npatterns > 0) ac_scan(filter_ac, text, fs.len, filter_hit, &fs);
+    pthread_rwlock_unlock(&filter_lock);
+    if (fs.hits == 0) return 0;
+    if (fs.mask) {
+        atomic_fetch_add_explicit(&filter_masked, 1, memory_order_relaxed);
+        return 0;
+    }
+    atomic_fetch_add_explicit(&filter_dropped, 1, memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * @brief Turns a dequeued message into a frame and releases the message.
+ * 
+ * @details Raw server lines become ephemeral frames as they are. For user
+ * messages and edits the content filter runs first and may mask the text or
+ * drop the message. Edits and deletions become delta frames. Mentions are
+ * found here too and delivered after the batch has been broadcast.
+ * 
+ * @param m The message.
+ * @param notes Mention notes for the current batch.
+ * @param nnotes Number of notes so far.
+ * @return frame_t* The frame, or NULL if allocation failed.
+ */
+frame_t *message_to_frame(message_t *m, mention_note_t *notes, int *nnotes) {
+    frame_t *f = NULL;
+    uint32_t state;
+    if (m->kind == MSG_RAW) {
+        f = frame_format_raw(m->text);
+    } else if (m->kind != MSG_CHAT &&
+               (history_lookup(m->target, NULL, &state) < 0 || (state & HIST_DELETED))) {
+        // Deleted before this delta was sequenced
+    } else if ((m->kind == MSG_CHAT || m->kind == MSG_EDIT) && filter_message(m->text)) {
+        const char *err = "ERR:Message blocked by content filter\n";
+        send_to_user(m->sender, err, strlen(err));
+    } else if (m->kind != MSG_CHAT) {
+        f = frame_format_delta(m->kind, m->target, m->sender, m->text);
+    } else {
+        f = frame_format(m->sender, m->text);
+        if (f) find_mentions(m->sender, m->text, f, notes, nnotes, BATCH_MAX * MAX_MENTIONS);
+    }
+    pool_free(m->pool, m);
+    return f;
+}
+
+/**
+ * @brief Dispatcher thread function: dequeues a shard's messages and broadcasts them.
+ * 
+ * @details There is one dispatcher per shard. With a batching budget it
+ * adapts to load. Messages already waiting in the queue are always coalesced
+ * into the current batch, which costs no latency. When the average queue
+ * depth shows sustained load it also holds the batch open for up to
+ * batch_budget_usec (measured from the first message) so one write per
+ * client carries many messages. When idle, every message goes out as soon as
+ * it arrives. In per-core mode the frames other shards hand over are written
+ * to this shard's clients between batches.
+ * 
+ * @param arg Pointer to the shard.
+ */
+void *dispatcher_thread(void *arg) {
+    shard_t *s = (shard_t *)arg;
+    thread_shard = s; // frames come out of this shard's pool
+    frame_t *batch[BATCH_MAX];
+    mention_note_t *notes = malloc(BATCH_MAX * MAX_MENTIONS * sizeof(mention_note_t)); // too big for the stack
+    if (!notes) {
+        perror("malloc");
+        exit(1);
+    }
+    while (server_running) {
+        shard_drain_rings(s);
+        message_t *m = dequeue_message(s);
+        if (!m) continue;
+        uint64_t first = now_usec();
+
+        int n = 0, nnotes = 0;
+        size_t bytes = 0;
+        if ((batch[n] = message_to_frame(m, notes, &nnotes)) != NULL) bytes += batch[n++]->len;
+
+        if (batch_budget_usec > 0) {
+            // Track load as a moving average of the backlog behind the first message
+            unsigned depth = (unsigned)atomic_load_explicit(&s->msg_pending, memory_order_relaxed);
+            s->depth_ewma += ((int)(depth * 16) - (int)s->depth_ewma) / 8;
+            int wait = s->depth_ewma >= BATCH_DEPTH_THRESHOLD * 16;
+            uint64_t deadline = wait ? first + batch_budget_usec : 0;
+            if (wait) atomic_fetch_add_explicit(&batches_waited, 1, memory_order_relaxed);
+
+            while (n < BATCH_MAX && bytes < BATCH_MAX_BYTES) {
+                m = dequeue_message_until(s, deadline);
+                if (!m) break;
+                if ((batch[n] = message_to_frame(m, notes, &nnotes)) != NULL) bytes += batch[n++]->len;
+            }
+        }
+
+        // Sequence and persist, then broadcast to all clients
+        if (n > 0) log_frames(batch, n);
+        broadcast_frames(s, batch, n);
+        deliver_mentions(notes, nnotes);
+    }
+    free(notes);
+    return NULL;
+}
+
+/**
+ * @brief Allocates and initializes a shard.
+ * 
+ * @details Its memory, pools and incoming rings are placed on the node of
+ * the CPU its threads will run on.
+ * 
+ * @param id The shard index.
+ * @return shard_t* The new shard, or NULL if allocation failed.
+ */
+shard_t *shard_create(int id) {
+    int cpu = cpu_for_slot(id);
+    shard_t *s = numa_alloc_on_cpu(sizeof(shard_t), cpu);
+    if (!s) return NULL;
+    s->id = id;
+    s->cpu = cpu;
+    s->listen_fd = -1;
+    if (per_core_mode && num_shards > 1) {
+        s->rings = numa_alloc_on_cpu(num_shards * sizeof(spsc_ring_t), cpu);
+        if (!s->rings) return NULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "messages.%d", id);
+    if (pool_init(&s->msg_pool, name, sizeof(message_t), pool_objects, cpu) < 0) return NULL;
+    snprintf(name, sizeof(name), "frames.%d", id);
+    if (pool_init(&s->frame_pool, name, sizeof(frame_t) + FRAME_CAP, pool_objects, cpu) < 0) return NULL;
+    pthread_mutex_init(&s->clients_mutex, NULL);
+    pthread_mutex_init(&s->msg_mutex, NULL);
+    pthread_cond_init(&s->msg_cond, NULL);
+    return s;
+}
+
+/**
+ * @brief Wakes a parked shard dispatcher (used at shutdown).
+ * 
+ * @param s The shard to wake.
+ */
+void shard_wake(shard_t *s) {
+    pthread_mutex_lock(&s->msg_mutex);
+    pthread_cond_signal(&s->msg_cond);
+    pthread_mutex_unlock(&s->msg_mutex);
+}
+
+/**
+ * @brief Receives more bytes into a reader's buffer.
+ * 
+ * @param r The reader.
+ * @return int Number of bytes added, or -1 on error or disconnect.
+ */
+int reader_fill(line_reader_t *r) {
+    if (r->start == r->end) {
+        r->start = r->end = 0;
+    } else if (r->end == READ_BUF && r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    ssize_t n;
+    do {
+        n = recv(r->fd, r->buf + r->end, READ_BUF - r->end, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return -1;
+    r->end += n;
+    return (int)n;
+}
+
+/**
+ * @brief Reads one line (without the newline) from a connection.
+ * 
+ * @details Lines longer than the output buffer are truncated and the rest of
+ * the line is skipped.
+ * 
+ * @param r The reader.
+ * @param line Output buffer.
+ * @param cap Capacity of line.
+ * @return int Length of the line, or -1 on error or disconnect.
+ */
+int reader_line(line_reader_t *r, char *line, size_t cap) {
+    while (1) {
+        char *start = r->buf + r->start;
+        char *nl = memchr(start, '\n', r->end - r->start);
+        size_t avail = nl ? (size_t)(nl - start) : r->end - r->start;
+
+        if (r->discarding) {
+            // Drop the rest of an overlong line
+            r->start = nl ? (size_t)(nl - r->buf) + 1 : r->end;
+            if (nl) r->discarding = 0;
+        } else if (nl || avail >= cap - 1 || avail == READ_BUF) {
+            size_t len = avail < cap - 1 ? avail : cap - 1;
+            memcpy(line, start, len);
+            line[len] = '\0';
+            if (nl && len == avail) {
+                r->start += avail + 1;
+            } else {
+                r->start += len;
+                r->discarding = 1;
+            }
+            return (int)len;
+        }
+        if (reader_fill(r) < 0) return -1;
+    }
+}
+
+/**
+ * @brief Reads raw bytes, taking buffered input first.
+ * 
+ * @param r The reader.
+ * @param out Output buffer.
+ * @param len Most bytes to read.
+ * @return ssize_t Bytes read, or -1 on error or disconnect.
+ */
+ssize_t reader_raw(line_reader_t *r, char *out, size_t len) {
+    if (r->start < r->end) {
+        size_t n = r->end - r->start;
+        if (n > len) n = len;
+        memcpy(out, r->buf + r->start, n);
+        r->start += n;
+        return n;
+    }
+    ssize_t n;
+    do {
+        n = recv(r->fd, out, len, 0);
+    } while (n < 0 && errno == EINTR);
+    return n > 0 ? n : -1;
+}
+
+/**
+ * @brief Builds the path of a blob file.
+ * 
+ * @param out Output buffer (MAX_LOG_PATH bytes).
+ * @param id The blob id.
+ * @param ext "blob", "meta" or "part".
+ */
+void blob_path(char *out, unsigned long id, const char *ext) {
+    snprintf(out, MAX_LOG_PATH, "%s/%lu.%s", blob_dir, id, ext);
+}
+
+/**
+ * @brief Creates the blob directory and finds the next free blob id.
+ * 
+ * @return int 0 on success, -1 on error.
+ */
+int blob_open(void) {
+    if (mkdir(blob_dir, 0755) < 0 && errno != EEXIST) {
+        perror(blob_dir);
+        return -1;
+    }
+    DIR *d = opendir(blob_dir);
+    if (!d) {
+        perror(blob_dir);
+        return -1;
+    }
+    unsigned long max = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        char *end;
+        unsigned long id = strtoul(e->d_name, &end, 10);
+        if (end != e->d_name && strcmp(end, ".blob") == 0 && id > max) max = id;
+    }
+    closedir(d);
+    atomic_store(&next_blob_id, max + 1);
+    return 0;
+}
+
+/**
+ * @brief Handles BLOB:<size>:<name> by storing the raw bytes that follow.
+ * 
+ * @details The upload is copied to disk in BLOB_CHUNK pieces, so it is never
+ * held in memory as a whole. It is written to a .part file that is renamed
+ * once complete, and announced to the room with its id. A rejected upload is
+ * still drained so the connection stays in sync, including one larger than
+ * --blob-max. A header without a size gets an error and the connection
+ * carries on: there is no way to tell where raw bytes would end, so any
+ * that follow are read as ordinary lines.
+ * 
+ * @param c The uploading client.
+ * @param r The client's reader, positioned after the BLOB line.
+ * @param args Text after "BLOB:".
+ * @return int 0 to keep the connection, -1 to disconnect.
+ */
+int receive_blob(client_t *c, line_reader_t *r, const char *args) {
+    char *end;
+    long long size = strtoll(args, &end, 10);
+    if (end == args || *end != ':' || size < 0) {
+        const char *err = "ERR:Usage BLOB:<size>:<name>\n";
+        client_send(c, err, strlen(err));
+        return 0;
+    }
+    const char *name = end + 1;
+    int too_large = size > blob_max;
+
+    char *chunk = malloc(BLOB_CHUNK);
+    if (!chunk) return -1;
+
+    // Without a blob store, or past the size limit, the bytes are read and dropped
+    unsigned long id = 0;
+    int fd = -1;
+    char part[MAX_LOG_PATH];
+    if (blob_dir[0] && !too_large) {
+        id = atomic_fetch_add(&next_blob_id, 1);
+        blob_path(part, id, "part");
+        fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    long long left = size;
+    int ok = (fd >= 0);
+    while (left > 0) {
+        ssize_t n = reader_raw(r, chunk, left < BLOB_CHUNK ? (size_t)left : BLOB_CHUNK);
+        if (n < 0) break;
+        if (ok && write_all(fd, chunk, n) < 0) ok = 0;
+        left -= n;
+    }
+    free(chunk);
+    if (fd >= 0) close(fd);
+
+    if (left > 0 || !ok) {
+        if (fd >= 0) unlink(part);
+        if (left > 0) return -1; // disconnected mid-upload
+        const char *err = !blob_dir[0] ? "ERR:Blobs disabled\n" : too_large ? "ERR:Blob too large\n" : "ERR:Blob store failed\n";
+        client_send(c, err, strlen(err));
+        return 0;
+    }
+
+    // Record the name, then publish the blob under its final name
+    char path[MAX_LOG_PATH];
+    blob_path(path, id, "meta");
+    FILE *meta = fopen(path, "w");
+    if (meta) {
+        fprintf(meta, "%s\n", name);
+        fclose(meta);
+    }
+    blob_path(path, id, "blob");
+    rename(part, path);
+    atomic_fetch_add_explicit(&blob_uploads, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&blob_bytes_in, size, memory_order_relaxed);
+
+    char reply[64];
+    int len = snprintf(reply, sizeof(reply), "OKBLOB:%lu\n", id);
+    client_send(c, reply, len);
+
+    char notice[MAX_MESSAGE];
+    snprintf(notice, sizeof(notice), "[shared blob #%lu: %.200s, %lld bytes - /get %lu to download]", id, name, size, id);
+    int rc = enqueue_message(c->username, notice, 0);
+    if (rc != 0) {
+        // The blob is stored either way; only the announcement is lost
+        const char *err = rc == 1 ? "ERR:Message dropped as spam\n" : "ERR:Out of memory\n";
+        client_send(c, err, strlen(err));
+    }
+    return 0;
+}
+
+/**
+ * @brief Handles GET:<id> by streaming a stored blob to the client.
+ * 
+ * @details The blob is sent as BLOBSTART:<id>:<size>:<name>, then
+ * BLOBCHUNK:<id>:<len> frames each followed by len raw bytes, then
+ * BLOBEND:<id>. Every chunk goes out with sendfile() and the send lock is
+ * taken per chunk, so broadcasts interleave between chunks rather than
+ * waiting for the whole blob; a slow reader only slows its own stream.
+ * 
+ * @param c The requesting client.
+ * @param args Text after "GET:".
+ */
+void send_blob(client_t *c, const char *args) {
+    unsigned long id = strtoul(args, NULL, 10);
+    char path[MAX_LOG_PATH];
+    int fd = -1;
+    if (blob_dir[0] && id > 0) {
+        blob_path(path, id, "blob");
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0) {
+        const char *err = "ERR:No such blob\n";
+        client_send(c, err, strlen(err));
+        return;
+    }
+
+    char name[256] = "blob";
+    blob_path(path, id, "meta");
+    FILE *meta = fopen(path, "r");
+    if (meta) {
+        if (fgets(name, sizeof(name), meta)) name[strcspn(name, "\n")] = '\0';
+        fclose(meta);
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    char hdr[MAX_LOG_PATH];
+    int len = snprintf(hdr, sizeof(hdr), "BLOBSTART:%lu:%lld:%s\n", id, (long long)st.st_size, name);
+    if (client_send(c, hdr, len) < 0) {
+        close(fd);
+        return;
+    }
+
+    off_t off = 0;
+    int ok = 1;
+    while (ok && off < st.st_size) {
+        size_t want = st.st_size - off < BLOB_CHUNK ? (size_t)(st.st_size - off) : BLOB_CHUNK;
+        len = snprintf(hdr, sizeof(hdr), "BLOBCHUNK:%lu:%zu\n", id, want);
+        pthread_mutex_lock(&c->send_lock);
+        ok = send_all(c->sockfd, hdr, len) >= 0;
+        size_t left = want;
+        while (ok && left > 0) {
+            ssize_t n = sendfile(c->sockfd, fd, &off, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) ok = 0;
+            else left -= n;
+        }
+        pthread_mutex_unlock(&c->send_lock);
+    }
+    close(fd);
+    if (!ok) return;
+
+    len = snprintf(hdr, sizeof(hdr), "BLOBEND:%lu\n", id);
+    client_send(c, hdr, len);
+    atomic_fetch_add_explicit(&blob_downloads, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&blob_bytes_out, st.st_size, memory_order_relaxed);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t ror32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/**
+ * @brief Hashes one 64-byte block into a SHA-256 state.
+ */
+static void sha256_compress(uint32_t state[8], const unsigned char *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/**
+ * @brief Starts a SHA-256 computation.
+ */
+void sha256_init(sha256_t *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->bytes = 0;
+    ctx->fill = 0;
+}
+
+/**
+ * @brief Feeds bytes into a SHA-256 computation.
+ */
+void sha256_update(sha256_t *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    ctx->bytes += len;
+    while (len > 0) {
+        size_t n = 64 - ctx->fill < len ? 64 - ctx->fill : len;
+        memcpy(ctx->block + ctx->fill, p, n);
+        ctx->fill += n;
+        p += n;
+        len -= n;
+        if (ctx->fill == 64) {
+            sha256_compress(ctx->state, ctx->block);
+            ctx->fill = 0;
+        }
+    }
+}
+
+/**
+ * @brief Finishes a SHA-256 computation.
+ * 
+ * @param ctx The state (no longer usable afterwards).
+ * @param out Receives the 32-byte digest.
+ */
+void sha256_final(sha256_t *ctx, unsigned char out[32]) {
+    uint64_t bits = ctx->bytes * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padlen = (ctx->fill < 56 ? 56 : 120) - ctx->fill;
+    for (int i = 0; i < 8; i++) pad[padlen + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_update(ctx, pad, padlen + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+        out[4 * i + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+/**
+ * @brief Derives a 32-byte key with PBKDF2-HMAC-SHA256.
+ * 
+ * @details The padded HMAC key states are hashed once up front, so each
+ * iteration costs two compressions.
+ * 
+ * @param pw The password.
+ * @param pwlen Password length.
+ * @param salt The salt.
+ * @param saltlen Salt length.
+ * @param iterations Iteration count.
+ * @param out Receives the derived key.
+ */
+void pbkdf2_sha256(const char *pw, size_t pwlen, const unsigned char *salt, size_t saltlen,
+                   uint32_t iterations, unsigned char out[32]) {
+    unsigned char key[64] = { 0 }, pad[64];
+    if (pwlen > 64) {
+        sha256_t kh;
+        sha256_init(&kh);
+        sha256_update(&kh, pw, pwlen);
+        sha256_final(&kh, key);
+    } else {
+        memcpy(key, pw, pwlen);
+    }
+    sha256_t inner, outer;
+    for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x36;
+    sha256_init(&inner);
+    sha256_update(&inner, pad, 64);
+    for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x5c;
+    sha256_init(&outer);
+    sha256_update(&outer, pad, 64);
+
+    // U1 = HMAC(pw, salt || INT(1)); only one output block is needed
+    unsigned char u[32];
+    sha256_t h = inner;
+    sha256_update(&h, salt, saltlen);
+    sha256_update(&h, "\0\0\0\1", 4);
+    sha256_final(&h, u);
+    h = outer;
+    sha256_update(&h, u, 32);
+    sha256_final(&h, u);
+    memcpy(out, u, 32);
+
+    for (uint32_t it = 1; it < iterations; it++) {
+        h = inner;
+        sha256_update(&h, u, 32);
+        sha256_final(&h, u);
+        h = outer;
+        sha256_update(&h, u, 32);
+        sha256_final(&h, u);
+        for (int i = 0; i < 32; i++) out[i] ^= u[i];
+    }
+}
+
+/**
+ * @brief Decodes a hex string.
+ * 
+ * @param hex The hex digits.
+ * @param len Number of digits.
+ * @param out Receives len / 2 bytes.
+ * @return int 0 on success, -1 on a bad digit or odd length.
+ */
+int hex_decode(const char *hex, size_t len, unsigned char *out) {
+    if (len % 2) return -1;
+    for (size_t i = 0; i < len; i++) {
+        char ch = hex[i];
+        int v = ch >= '0' && ch <= '9' ? ch - '0' : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+              : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+        if (v < 0) return -1;
+        if (i % 2) out[i / 2] |= v;
+        else out[i / 2] = v << 4;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a stored credential.
+ * 
+ * @param text "pbkdf2-sha256$<iterations>$<salt hex>$<hash hex>".
+ * @param cr Receives the credential.
+ * @return int 0 on success, -1 if the text is malformed.
+ */
+int credential_parse(const char *text, credential_t *cr) {
+    const char *prefix = "pbkdf2-sha256$";
+    if (strncmp(text, prefix, strlen(prefix)) != 0) return -1;
+    char *end;
+    unsigned long iter = strtoul(text + strlen(prefix), &end, 10);
+    if (*end != '$' || iter == 0 || iter > UINT32_MAX) return -1;
+    const char *salt = end + 1;
+    const char *hash = strchr(salt, '$');
+    if (!hash) return -1;
+    size_t salt_hex = hash - salt;
+    hash++;
+    size_t hash_hex = strcspn(hash, " \t\r\n");
+    if (salt_hex == 0 || salt_hex > 2 * SALT_MAX || hash_hex != 64) return -1;
+    if (hex_decode(salt, salt_hex, cr->salt) < 0 || hex_decode(hash, hash_hex, cr->hash) < 0) return -1;
+    cr->salt_len = salt_hex / 2;
+    cr->iterations = (uint32_t)iter;
+    return 0;
+}
+
+/**
+ * @brief Hashes a password with a fresh random salt.
+ * 
+ * @param password The password.
+ * @param cr Receives the credential.
+ * @return int 0 on success, -1 if no random bytes were available.
+ */
+int credential_create(const char *password, credential_t *cr) {
+    cr->salt_len = 16;
+    if (getrandom(cr->salt, cr->salt_len, 0) != (ssize_t)cr->salt_len) return -1;
+    cr->iterations = PBKDF2_ITERATIONS;
+    pbkdf2_sha256(password, strlen(password), cr->salt, cr->salt_len, cr->iterations, cr->hash);
+    return 0;
+}
+
+/**
+ * @brief Formats a credential in its stored form.
+ * 
+ * @param cr The credential.
+ * @param buf Output buffer (at least 200 bytes).
+ * @param cap Capacity of buf.
+ */
+void credential_format(const credential_t *cr, char *buf, size_t cap) {
+    size_t len = snprintf(buf, cap, "pbkdf2-sha256$%u$", cr->iterations);
+    for (size_t i = 0; i < cr->salt_len && len + 3 < cap; i++) len += snprintf(buf + len, cap - len, "%02x", cr->salt[i]);
+    if (len + 1 < cap) buf[len++] = '$';
+    for (int i = 0; i < 32 && len + 3 < cap; i++) len += snprintf(buf + len, cap - len, "%02x", cr->hash[i]);
+}
+
+/**
+ * @brief Checks a password against a credential (slow: runs the full PBKDF2).
+ * 
+ * @return int 1 if the password matches, 0 otherwise.
+ */
+int credential_check(const credential_t *cr, const char *password) {
+    unsigned char hash[32];
+    pbkdf2_sha256(password, strlen(password), cr->salt, cr->salt_len, cr->iterations, hash);
+    unsigned char diff = 0;
+    for (int i = 0; i < 32; i++) diff |= hash[i] ^ cr->hash[i]; // constant time
+    return diff == 0;
+}
+
+/**
+ * @brief Compares accounts by username (for qsort and bsearch).
+ */
+int compare_account(const void *a, const void *b) {
+    return strcmp(((const account_t *)a)->username, ((const account_t *)b)->username);
+}
+
+/**
+ * @brief Loads the accounts file: "username:credential" per line, '#' starts a comment.
+ * 
+ * @param path The accounts file.
+ * @return int 0 on success, -1 on error.
+ */
+int accounts_load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    char line[512];
+    int lineno = 0, cap = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') continue;
+        char *colon = strchr(line, ':');
+        account_t acct;
+        memset(&acct, 0, sizeof(acct));
+        if (!colon || colon == line || colon - line >= MAX_USERNAME || credential_parse(colon + 1, &acct.cred) < 0) {
+            fprintf(stderr, "%s:%d: expected username:pbkdf2-sha256$...\n", path, lineno);
+            continue;
+        }
+        memcpy(acct.username, line, colon - line);
+        if (num_accounts == cap) {
+            cap = cap ? cap * 2 : 16;
+            account_t *grown = realloc(accounts, cap * sizeof(account_t));
+            if (!grown) break;
+            accounts = grown;
+        }
+        accounts[num_accounts++] = acct;
+    }
+    fclose(fp);
+    qsort(accounts, num_accounts, sizeof(account_t), compare_account);
+    printf("Accounts loaded: %d\n", num_accounts);
+    return 0;
+}
+
+/**
+ * @brief Returns the slots that follow a store header.
+ */
+static inline store_slot_t *store_slots(store_header_t *h) {
+    return (store_slot_t *)(h + 1);
+}
+
+/**
+ * @brief Maps an account store file.
+ * 
+ * @param path The store file.
+ * @param writable 1 to map it for writing.
+ * @param len Receives the mapping length.
+ * @param ino Receives the file's inode.
+ * @return store_header_t* The mapping, or NULL on error.
+ */
+store_header_t *store_map_file(const char *path, int writable, size_t *len, ino_t *ino) {
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    store_header_t hdr;
+    if (fstat(fd, &st) < 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, STORE_MAGIC, 8) != 0 || hdr.capacity == 0 || (hdr.capacity & (hdr.capacity - 1)) ||
+        (size_t)st.st_size < sizeof(hdr) + (size_t)hdr.capacity * sizeof(store_slot_t)) {
+        fprintf(stderr, "%s: not an account store\n", path);
+        close(fd);
+        return NULL;
+    }
+    *len = sizeof(hdr) + (size_t)hdr.capacity * sizeof(store_slot_t);
+    *ino = st.st_ino;
+    void *map = mmap(NULL, *len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return map;
+}
+
+/**
+ * @brief Creates an empty account store file.
+ * 
+ * @param path The file to create (replaced if it exists).
+ * @param capacity Number of slots, a power of two.
+ * @return int 0 on success, -1 on error.
+ */
+int store_create(const char *path, uint32_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    store_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, STORE_MAGIC, 8);
+    hdr.capacity = capacity;
+    // ftruncate zero-fills, and zeroed slots are empty
+    int rc = (ftruncate(fd, sizeof(hdr) + (off_t)capacity * sizeof(store_slot_t)) == 0 &&
+              write_all(fd, &hdr, sizeof(hdr)) == 0 && fsync(fd) == 0) ? 0 : -1;
+    if (rc < 0) perror(path);
+    close(fd);
+    return rc;
+}
+
+/**
+ * @brief Copies a slot consistently, retrying while a writer is changing it.
+ */
+static void store_read_slot(store_slot_t *slot, store_slot_t *out) {
+    while (1) {
+        uint32_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (before & 1) {
+            cpu_relax();
+            continue;
+        }
+        memcpy((char *)out + sizeof(out->seq), (char *)slot + sizeof(slot->seq), sizeof(*out) - sizeof(out->seq));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == before) return;
+    }
+}
+
+/**
+ * @brief Finds the slot for a username.
+ * 
+ * @param h The mapped store.
+ * @param username The username.
+ * @param free_slot Receives the first empty or deleted slot on the probe path (may be NULL).
+ * @return long The slot holding username, or -1 if it is not in the store.
+ */
+long store_probe(store_header_t *h, const char *username, long *free_slot) {
+    uint32_t mask = h->capacity - 1;
+    uint32_t i = (uint32_t)hash_bytes(username, strlen(username)) & mask;
+    if (free_slot) *free_slot = -1;
+    for (uint32_t n = 0; n < h->capacity; n++, i = (i + 1) & mask) {
+        store_slot_t slot;
+        store_read_slot(&store_slots(h)[i], &slot);
+        if (slot.state != STORE_SLOT_USED && free_slot && *free_slot < 0) *free_slot = i;
+        if (slot.state == STORE_SLOT_EMPTY) return -1;
+        if (slot.state == STORE_SLOT_USED && strncmp(slot.username, username, MAX_USERNAME) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Maps the account store again if the file was replaced (e.g. after growing).
+ * 
+ * @param force 1 to remap even if the inode is unchanged.
+ * @return int 0 on success, -1 on error (the old mapping stays in use).
+ */
+int store_reload(int force) {
+    if (!store_path[0]) return 0;
+    struct stat st;
+    if (!force && (stat(store_path, &st) < 0 || st.st_ino == store_ino)) return 0;
+    size_t len;
+    ino_t ino;
+    store_header_t *fresh = store_map_file(store_path, 0, &len, &ino);
+    if (!fresh) return -1;
+
+    pthread_rwlock_wrlock(&store_lock);
+    store_header_t *old = store_map;
+    size_t old_len = store_map_len;
+    store_map = fresh;
+    store_map_len = len;
+    store_ino = ino;
+    pthread_rwlock_unlock(&store_lock);
+
+    if (old) {
+        munmap(old, old_len);
+        atomic_fetch_add(&store_remaps, 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Looks up an account in the account store.
+ * 
+ * @details One hash and a short probe in the mapped file, without locking
+ * out writers. A writer that replaces the file (to grow it) first marks the
+ * old header, so every lookup notices and remaps before probing; changes
+ * made to the new file are never missed. A miss also checks whether the
+ * file was replaced and retries once against the new mapping.
+ * 
+ * @param username The username.
+ * @param out Receives the account.
+ * @return int 0 if found, -1 otherwise.
+ */
+int store_find(const char *username, account_t *out) {
+    pthread_rwlock_rdlock(&store_lock);
+    int stale = store_map && atomic_load_explicit(&store_map->replaced, memory_order_acquire);
+    pthread_rwlock_unlock(&store_lock);
+    if (stale) store_reload(0);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        pthread_rwlock_rdlock(&store_lock);
+        long i = store_map ? store_probe(store_map, username, NULL) : -1;
+        store_slot_t slot;
+        if (i >= 0) store_read_slot(&store_slots(store_map)[i], &slot);
+        pthread_rwlock_unlock(&store_lock);
+
+        if (i >= 0 && slot.salt_len <= SALT_MAX) {
+            memset(out, 0, sizeof(*out));
+            memcpy(out->username, slot.username, MAX_USERNAME);
+            out->username[MAX_USERNAME - 1] = '\0';
+            out->cred.iterations = slot.iterations;
+            out->cred.salt_len = slot.salt_len;
+            memcpy(out->cred.salt, slot.salt, SALT_MAX);
+            memcpy(out->cred.hash, slot.hash, 32);
+            return 0;
+        }
+        if (attempt == 0 && store_reload(0) < 0) break;
+    }
+    return -1;
+}
+
+/**
+ * @brief Writes a slot under its sequence lock.
+ */
+static void store_write_slot(store_slot_t *slot, uint32_t state, const char *username, const credential_t *cr) {
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->state = state;
+    memset(slot->username, 0, MAX_USERNAME);
+    snprintf(slot->username, MAX_USERNAME, "%s", username);
+    if (cr) {
+        slot->iterations = cr->iterations;
+        slot->salt_len = (uint32_t)cr->salt_len;
+        memcpy(slot->salt, cr->salt, SALT_MAX);
+        memcpy(slot->hash, cr->hash, 32);
+    }
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * @brief Rebuilds a store with twice the capacity and no tombstones, replacing the file.
+ * 
+ * @param path The store file.
+ * @param h The current mapping (unmapped on success).
+ * @param len Length of the current mapping.
+ * @return store_header_t* The new writable mapping, or NULL on error.
+ */
+store_header_t *store_grow(const char *path, store_header_t *h, size_t len) {
+    char tmp[MAX_LOG_PATH + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (store_create(tmp, h->capacity * 2) < 0) return NULL;
+    size_t nlen;
+    ino_t ino;
+    store_header_t *n = store_map_file(tmp, 1, &nlen, &ino);
+    if (!n) return NULL;
+    for (uint32_t i = 0; i < h->capacity; i++) {
+        store_slot_t *slot = &store_slots(h)[i];
+        if (slot->state != STORE_SLOT_USED) continue;
+        long free_slot;
+        store_probe(n, slot->username, &free_slot);
+        store_slot_t *dst = &store_slots(n)[free_slot];
+        memcpy((char *)dst + sizeof(dst->seq), (char *)slot + sizeof(slot->seq), sizeof(*dst) - sizeof(dst->seq));
+        n->used++;
+    }
+    if (msync(n, nlen, MS_SYNC) < 0) {
+        perror(path);
+        munmap(n, nlen);
+        return NULL;
+    }
+    // Servers still reading the old file see this and switch to the new one
+    atomic_store_explicit(&h->replaced, 1, memory_order_release);
+    if (rename(tmp, path) < 0) {
+        perror(path);
+        atomic_store_explicit(&h->replaced, 0, memory_order_release);
+        munmap(n, nlen);
+        return NULL;
+    }
+    munmap(h, len);
+    return n;
+}
+
+/**
+ * @brief --set-account / --del-account mode: changes one account in the store and exits.
+ * 
+ * @details Writers take an exclusive flock() on the store, so admin commands
+ * never interleave; a running server keeps reading while the slot changes.
+ * The new password is read from stdin. The store is created if missing and
+ * grows (by replacing the file) before it is 70% full.
+ * 
+ * @return int Exit status.
+ */
+int account_admin_main(void) {
+    if (!store_path[0]) {
+        fprintf(stderr, "--set-account and --del-account need --account-store\n");
+        return 1;
+    }
+    if (strlen(store_admin_user) >= MAX_USERNAME || !username_valid(store_admin_user)) {
+        fprintf(stderr, "Invalid username: %s\n", store_admin_user);
+        return 1;
+    }
+    credential_t cr;
+    if (!store_admin_delete) {
+        char pw[MAX_MESSAGE];
+        if (!fgets(pw, sizeof(pw), stdin)) return 1;
+        pw[strcspn(pw, "\r\n")] = '\0';
+        if (credential_create(pw, &cr) < 0) {
+            perror("getrandom");
+            return 1;
+        }
+    }
+
+    // A lock file, because growing replaces the store itself
+    char lock_path[MAX_LOG_PATH + 8];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", store_path);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0600);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) < 0) {
+        perror(lock_path);
+        return 1;
+    }
+    if (access(store_path, F_OK) != 0 && store_create(store_path, STORE_MIN_SLOTS) < 0) return 1;
+    size_t len;
+    ino_t ino;
+    store_header_t *h = store_map_file(store_path, 1, &len, &ino);
+    if (!h) return 1;
+
+    long free_slot;
+    long i = store_probe(h, store_admin_user, &free_slot);
+    int rc = 0;
+    if (store_admin_delete) {
+        if (i < 0) {
+            fprintf(stderr, "No such account: %s\n", store_admin_user);
+            rc = 1;
+        } else {
+            store_write_slot(&store_slots(h)[i], STORE_SLOT_DELETED, "", NULL);
+            h->used--;
+            h->deleted++;
+        }
+    } else if (i >= 0) {
+        store_write_slot(&store_slots(h)[i], STORE_SLOT_USED, store_admin_user, &cr);
+    } else {
+        if ((uint64_t)(h->used + h->deleted + 1) * 10 > (uint64_t)h->capacity * 7) {
+            store_header_t *grown = store_grow(store_path, h, len);
+            if (!grown) return 1;
+            h = grown;
+            len = sizeof(store_header_t) + (size_t)h->capacity * sizeof(store_slot_t);
+            store_probe(h, store_admin_user, &free_slot);
+        }
+        store_slot_t *slot = &store_slots(h)[free_slot];
+        if (slot->state == STORE_SLOT_DELETED) h->deleted--;
+        store_write_slot(slot, STORE_SLOT_USED, store_admin_user, &cr);
+        h->used++;
+    }
+    if (msync(h, len, MS_SYNC) < 0) perror("msync");
+    if (rc == 0) printf("%s account %s (%u accounts)\n", store_admin_delete ? "Deleted" : "Saved", store_admin_user, h->used);
+    munmap(h, len);
+    close(lock_fd);
+    return rc;
+}
+
+/**
+ * @brief Looks up an account in the account store, then the accounts file.
+ * 
+ * @param username The username.
+ * @param out Receives the account.
+ * @return int 0 if found, -1 otherwise.
+ */
+int account_find(const char *username, account_t *out) {
+    if (store_path[0] && store_find(username, out) == 0) return 0;
+    account_t key;
+    snprintf(key.username, sizeof(key.username), "%s", username);
+    const account_t *acct = bsearch(&key, accounts, num_accounts, sizeof(account_t), compare_account);
+    if (!acct) return -1;
+    *out = *acct;
+    return 0;
+}
+
+/**
+ * @brief Auth worker thread: runs queued password verifications.
+ * 
+ * @details Hashing is deliberately slow, so it runs here on a fixed number of
+ * threads instead of on the connection threads; however many clients log in
+ * at once, at most auth_workers CPUs are busy hashing.
+ * 
+ * @param arg Unused parameter.
+ */
+void *auth_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&auth_mutex);
+    while (1) {
+        while (!auth_head && !auth_stopped) pthread_cond_wait(&auth_cond, &auth_mutex);
+        if (!auth_head) break; // stopped and drained
+        auth_job_t *job = auth_head;
+        auth_head = job->next;
+        if (!auth_head) auth_tail = NULL;
+        auth_queued--;
+        pthread_mutex_unlock(&auth_mutex);
+
+        int ok = credential_check(job->cred, job->password);
+        atomic_fetch_add_explicit(ok ? &auth_ok : &auth_failed, 1, memory_order_relaxed);
+
+        // Post the result back to the waiting connection
+        pthread_mutex_lock(&job->lock);
+        job->result = ok;
+        pthread_cond_signal(&job->done);
+        pthread_mutex_unlock(&job->lock);
+
+        pthread_mutex_lock(&auth_mutex);
+    }
+    pthread_mutex_unlock(&auth_mutex);
+    return NULL;
+}
+
+/**
+ * @brief Verifies a password on the auth worker pool and waits for the result.
+ * 
+ * @details Every connection has its own thread, so the caller simply sleeps
+ * here; there is no event loop that a blocked login could stall. What the
+ * pool bounds is the CPU spent hashing: at most auth_workers PBKDF2 runs at
+ * once, whatever the number of connections logging in, and a full queue
+ * answers "busy" at once instead of queueing without limit.
+ * 
+ * @param cr The stored credential.
+ * @param password The password to check.
+ * @return int 1 if it matches, 0 if not, -1 if the pool is saturated or stopped.
+ */
+int auth_verify(const credential_t *cr, const char *password) {
+    auth_job_t job = { .cred = cr, .password = password, .result = -1, .next = NULL };
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+
+    pthread_mutex_lock(&auth_mutex);
+    if (auth_stopped || auth_queued >= AUTH_QUEUE_MAX) {
+        pthread_mutex_unlock(&auth_mutex);
+        atomic_fetch_add_explicit(&auth_busy, 1, memory_order_relaxed);
+        pthread_cond_destroy(&job.done);
+        pthread_mutex_destroy(&job.lock);
+        return -1;
+    }
+    if (auth_tail) auth_tail->next = &job;
+    else auth_head = &job;
+    auth_tail = &job;
+    auth_queued++;
+    pthread_cond_signal(&auth_cond);
+    pthread_mutex_unlock(&auth_mutex);
+
+    pthread_mutex_lock(&job.lock);
+    while (job.result < 0) pthread_cond_wait(&job.done, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+
+    pthread_cond_destroy(&job.done);
+    pthread_mutex_destroy(&job.lock);
+    return job.result;
+}
+
+/**
+ * @brief Sets up the server password and accounts, and starts the auth workers.
+ * 
+ * @return int 0 on success, -1 on error.
+ */
+int auth_init(void) {
+    if (password_hash[0]) {
+        if (credential_parse(password_hash, &server_cred) < 0) {
+            fprintf(stderr, "Invalid --password-hash (expected pbkdf2-sha256$...)\n");
+            return -1;
+        }
+    } else if (credential_create(SERVER_PASSWORD, &server_cred) < 0) {
+        perror("getrandom");
+        return -1;
+    }
+    if (accounts_path[0] && accounts_load(accounts_path) < 0) return -1;
+    if (store_path[0]) {
+        if (store_reload(1) < 0) return -1;
+        printf("Account store: %u accounts in %u slots\n", store_map->used, store_map->capacity);
+    }
+
+    auth_tids = calloc(auth_workers, sizeof(pthread_t));
+    if (!auth_tids) return -1;
+    for (int i = 0; i < auth_workers; i++) {
+        if (pthread_create(&auth_tids[i], NULL, auth_worker, NULL) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Stops the auth workers once they have finished the queued jobs.
+ */
+void auth_shutdown(void) {
+    pthread_mutex_lock(&auth_mutex);
+    auth_stopped = 1;
+    pthread_cond_broadcast(&auth_cond);
+    pthread_mutex_unlock(&auth_mutex);
+    for (int i = 0; auth_tids && i < auth_workers; i++) pthread_join(auth_tids[i], NULL);
+}
+
+/**
+ * @brief --hash-password mode: reads a password from stdin and prints its stored form.
+ * 
+ * @return int Exit status.
+ */
+int hash_password_main(void) {
+    char pw[MAX_MESSAGE];
+    if (!fgets(pw, sizeof(pw), stdin)) return 1;
+    pw[strcspn(pw, "\r\n")] = '\0';
+    credential_t cr;
+    if (credential_create(pw, &cr) < 0) {
+        perror("getrandom");
+        return 1;
+    }
+    char out[256];
+    credential_format(&cr, out, sizeof(out));
+    printf("%s\n", out);
+    return 0;
+}
+
+/**
+ * @brief Creates the mailbox directory, initializes the mailbox locks and totals the stored mail.
+ * 
+ * @return int 0 on success, -1 on error.
+ */
+int mailbox_open(void) {
+    for (int i = 0; i < MAILBOX_LOCKS; i++) pthread_mutex_init(&mailbox_locks[i], NULL);
+    if (!mailbox_dir[0]) return 0;
+    if (mkdir(mailbox_dir, 0700) < 0 && errno != EEXIST) {
+        perror(mailbox_dir);
+        return -1;
+    }
+    DIR *d = opendir(mailbox_dir);
+    if (!d) {
+        perror(mailbox_dir);
+        return -1;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        struct stat st;
+        size_t n = strlen(e->d_name);
+        if (n > 5 && strcmp(e->d_name + n - 5, ".mbox") == 0 && fstatat(dirfd(d), e->d_name, &st, 0) == 0) {
+            mailbox_bytes += st.st_size;
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+/**
+ * @brief Returns the lock stripe guarding a user's mailbox.
+ */
+static inline pthread_mutex_t *mailbox_lock(const char *username) {
+    return &mailbox_locks[hash_bytes(username, strlen(username)) % MAILBOX_LOCKS];
+}
+
+/**
+ * @brief Builds the path of a user's mailbox file.
+ * 
+ * @details The name is hex-encoded so any username is a safe file name.
+ * 
+ * @param out Output buffer of MAX_LOG_PATH bytes.
+ * @param username The mailbox owner.
+ */
+void mailbox_path(char *out, const char *username) {
+    int len = snprintf(out, MAX_LOG_PATH, "%s/", mailbox_dir);
+    for (const unsigned char *p = (const unsigned char *)username; *p && len < MAX_LOG_PATH - 8; p++) {
+        len += snprintf(out + len, MAX_LOG_PATH - len, "%02x", *p);
+    }
+    snprintf(out + len, MAX_LOG_PATH - len, ".mbox");
+}
+
+/**
+ * @brief Handles DM:<user>:<text> (or DM:<user> <text>) from a client.
+ * 
+ * @details An online recipient gets "DM:<sender>:<text>" right away.
+ * Otherwise the line is appended to the recipient's mailbox file, which
+ * already holds wire-ready lines, unless that would exceed the quota or the
+ * total for all mailboxes (which is what bounds the disk when there are no
+ * accounts and any name gets a mailbox). The online check and the append
+ * happen under the recipient's mailbox lock, the same lock login takes to
+ * drain the mailbox, so a DM is never appended after its recipient has
+ * collected their mail. The live send happens after the lock is dropped, so
+ * a slow recipient never stalls other DMs on the same stripe; if the
+ * recipient went offline in between, the decision is taken again. A
+ * recipient whose socket keeps failing gets the DM stored instead.
+ * 
+ * @param c The sender.
+ * @param args The text after "DM:".
+ */
+void send_dm(client_t *c, const char *args) {
+    size_t nlen = strcspn(args, ": ");
+    if (nlen == 0 || nlen >= MAX_USERNAME || args[nlen] == '\0' || args[nlen + 1] == '\0') {
+        const char *err = "ERR:Usage DM:<user>:<text>\n";
+        client_send(c, err, strlen(err));
+        return;
+    }
+    char to[MAX_USERNAME];
+    memcpy(to, args, nlen);
+    to[nlen] = '\0';
+    char line[FRAME_CAP + 8];
+    int len = snprintf(line, sizeof(line) - 1, "DM:%s:%s\n", c->username, args + nlen + 1);
+    if (len >= (int)sizeof(line) - 1) {
+        len = sizeof(line) - 2;
+        line[len++] = '\n';
+    }
+
+    const char *reply = NULL;
+    pthread_mutex_t *lock = mailbox_lock(to);
+    account_t acct;
+    for (int attempt = 0; !reply; attempt++) {
+        pthread_mutex_lock(lock);
+        if (attempt < 2 && user_online(to)) {
+            pthread_mutex_unlock(lock);
+            if (send_to_user(to, line, len) == 0) {
+                reply = "OKDM:delivered\n";
+                atomic_fetch_add_explicit(&dm_live, 1, memory_order_relaxed);
+            }
+            continue;
+        }
+        if (!mailbox_dir[0]) {
+            reply = "ERR:User not online\n";
+        } else if ((accounts_path[0] || store_path[0]) && account_find(to, &acct) < 0) {
+            reply = "ERR:No such user\n";
+        } else if (atomic_fetch_add(&mailbox_bytes, len) + len > mailbox_total) {
+            // Reserved before the file is created, so a full server creates no new mailboxes
+            atomic_fetch_sub(&mailbox_bytes, len);
+            reply = "ERR:Mailbox full\n";
+            atomic_fetch_add_explicit(&dm_rejected, 1, memory_order_relaxed);
+        } else {
+            char path[MAX_LOG_PATH];
+            mailbox_path(path, to);
+            int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+            struct stat st;
+            int stored = 0;
+            if (fd < 0 || fstat(fd, &st) < 0) {
+                perror(path);
+                reply = "ERR:Mailbox unavailable\n";
+            } else if (st.st_size + len > mailbox_quota) {
+                reply = "ERR:Mailbox full\n";
+                atomic_fetch_add_explicit(&dm_rejected, 1, memory_order_relaxed);
+            } else if (write_all(fd, line, len) < 0) {
+                perror(path);
+                reply = "ERR:Mailbox unavailable\n";
+            } else {
+                reply = "OKDM:stored\n";
+                atomic_fetch_add_explicit(&dm_stored, 1, memory_order_relaxed);
+                stored = 1;
+            }
+            if (!stored) atomic_fetch_sub(&mailbox_bytes, len);
+            if (fd >= 0) close(fd);
+        }
+        pthread_mutex_unlock(lock);
+    }
+    client_send(c, reply, strlen(reply));
+}
+
+/**
+ * @brief Delivers a user's stored DMs right after login, in one write, and empties the mailbox.
+ * 
+ * @details Called while the client's live output is still held (between
+ * client_go_live() and client_release_held()), so the mail is written
+ * directly and lands ahead of any DM that arrived live in the meantime:
+ * those were routed to the held queue, and everything in the mailbox was
+ * stored before the client went live.
+ * 
+ * @param c The client that just logged in.
+ */
+void mailbox_deliver(client_t *c) {
+    if (!mailbox_dir[0]) return;
+    char path[MAX_LOG_PATH];
+    mailbox_path(path, c->username);
+    pthread_mutex_t *lock = mailbox_lock(c->username);
+    pthread_mutex_lock(lock);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        // The quota bounds the size, so the whole mailbox fits in one buffer
+        char *mail = malloc(st.st_size);
+        ssize_t sent = -1;
+        if (mail && pread(fd, mail, st.st_size, 0) == st.st_size) {
+            pthread_mutex_lock(&c->send_lock);
+            sent = send_all(c->sockfd, mail, st.st_size);
+            pthread_mutex_unlock(&c->send_lock);
+        }
+        if (sent == st.st_size) {
+            unsigned long n = 0;
+            for (off_t i = 0; i < st.st_size; i++) n += mail[i] == '\n';
+            atomic_fetch_add_explicit(&dm_delivered, n, memory_order_relaxed);
+            if (unlink(path) == 0) atomic_fetch_sub(&mailbox_bytes, st.st_size);
+        }
+        free(mail);
+    }
+    if (fd >= 0) close(fd);
+    pthread_mutex_unlock(lock);
+}
+
+/**
+ * @brief Compresses a sealed segment's log data into NNN.cold.
+ * 
+ * @details The cold file is written beside the .log and renamed into place
+ * once complete. The segment then switches to it under segment_lock (so no
+ * reader is using the .log) and the .log is removed. Reads keep working
+ * throughout: first from the .log, then through the cold block index.
+ * 
+ * @param i Index of the segment in log_segs.
+ * @return int 0 on success, -1 on error.
+ */
+int compact_segment(int i) {
+    pthread_mutex_lock(&log_mutex);
+    log_segment_t seg = log_segs[i];
+    pthread_mutex_unlock(&log_mutex);
+    if (seg.cold) return 0;
+
+    char path[MAX_LOG_PATH], tmp[MAX_LOG_PATH + 8];
+    segment_path(path, seg.first_seq, "cold");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) return -1;
+
+    cold_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, COLD_MAGIC, 8);
+    h.raw_size = seg.size;
+    h.block_size = COLD_BLOCK;
+    h.nblocks = (uint32_t)((seg.size + COLD_BLOCK - 1) / COLD_BLOCK);
+    size_t comp_cap = COLD_BLOCK + COLD_BLOCK / 255 + 64;
+    cold_block_t *blocks = malloc((h.nblocks ? h.nblocks : 1) * sizeof(cold_block_t));
+    unsigned char *raw = malloc(COLD_BLOCK), *comp = malloc(comp_cap);
+    int ok = blocks && raw && comp && write_all(out, &h, sizeof(h)) == 0;
+
+    uint64_t off = sizeof(h);
+    for (uint32_t b = 0; ok && b < h.nblocks; b++) {
+        uint64_t at = (uint64_t)b * COLD_BLOCK;
+        uint32_t rl = (uint32_t)(seg.size - at < COLD_BLOCK ? seg.size - at : COLD_BLOCK);
+        ok = pread(seg.fd, raw, rl, at) == (ssize_t)rl;
+        size_t cl = ok ? lz_compress(raw, rl, comp, comp_cap) : 0;
+        if (cl == 0 || cl >= rl) cl = rl; // incompressible: store as is
+        ok = ok && write_all(out, cl == rl ? raw : comp, cl) == 0;
+        blocks[b].offset = off;
+        blocks[b].comp_len = (uint32_t)cl;
+        blocks[b].raw_len = rl;
+        off += cl;
+    }
+    h.index_offset = off;
+    ok = ok && write_all(out, blocks, h.nblocks * sizeof(cold_block_t)) == 0 &&
+         pwrite(out, &h, sizeof(h), 0) == sizeof(h) && fsync(out) == 0;
+    free(blocks);
+    free(raw);
+    free(comp);
+    if (close(out) < 0 || !ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    cold_segment_t *cold = cold_open(path);
+    if (!cold) {
+        unlink(path);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&segment_lock);
+    pthread_mutex_lock(&log_mutex);
+    log_segs[i].cold = cold;
+    close(log_segs[i].fd);
+    log_segs[i].fd = -1;
+    pthread_mutex_unlock(&log_mutex);
+    pthread_rwlock_unlock(&segment_lock);
+
+    segment_path(path, seg.first_seq, "log");
+    unlink(path);
+    atomic_fetch_add_explicit(&cold_segments, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cold_raw_bytes, cold->raw_size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cold_file_bytes, cold->file_size, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * @brief Compactor thread: compresses sealed segments older than the newest compact_keep.
+ * 
+ * @param arg Unused parameter.
+ */
+void *compactor_thread(void *arg) {
+    (void)arg;
+    struct timespec period = { .tv_sec = COMPACT_POLL_MS / 1000, .tv_nsec = (COMPACT_POLL_MS % 1000) * 1000000L };
+    while (server_running) {
+        nanosleep(&period, NULL);
+        for (int i = 0; server_running; i++) {
+            pthread_mutex_lock(&log_mutex);
+            int eligible = i < log_nsegs - 1 - compact_keep; // the active segment is never compacted
+            int hot = eligible && !log_segs[i].cold;
+            pthread_mutex_unlock(&log_mutex);
+            if (!eligible) break;
+            if (hot && compact_segment(i) < 0) {
+                perror("compact_segment");
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Extracts the next search term from text.
+ * 
+ * @details Terms are runs of letters, digits and '_', lowercased. Single
+ * characters are skipped and long words are cut to MAX_TERM - 1 bytes, the
+ * same way for indexing and for queries.
+ * 
+ * @param p In/out: position in the text.
+ * @param end End of the text.
+ * @param term Output (MAX_TERM bytes).
+ * @return size_t Length of the term, or 0 at the end of the text.
+ */
+size_t next_term(const char **p, const char *end, char *term) {
+    while (*p < end) {
+        size_t n = 0;
+        while (*p < end && !word_byte(**p)) (*p)++;
+        for (; *p < end && word_byte(**p); (*p)++) {
+            unsigned char ch = **p;
+            if (n < MAX_TERM - 1) term[n++] = (ch >= 'A' && ch <= 'Z') ? ch + 32 : ch;
+        }
+        if (n >= 2) {
+            term[n] = '\0';
+            return n;
+        }
+    }
+    return 0;
+}
+
 /**
- * @brief Client structure representing a connected client.
+ * @brief Finds a term in a segment index (search_lock held).
  * 
+ * @param x The segment index.
+ * @param term The term.
+ * @param create 1 to add an empty posting list if there is none (write lock).
+ * @return term_postings_t* The posting list, or NULL if absent (or allocation failed).
  */
-typedef struct client {
-    // socket file descriptor
-    int sockfd; 
-
-    // username of the client
-    char username[MAX_USERNAME];
+term_postings_t *segment_term(segment_index_t *x, const char *term, int create) {
+    uint64_t h = hash_bytes(term, strlen(term));
+    if (x->cap > 0) {
+        for (size_t i = h & (x->cap - 1); x->terms[i].hash; i = (i + 1) & (x->cap - 1)) {
+            if (x->terms[i].hash == h && strcmp(x->terms[i].term, term) == 0) return &x->terms[i];
+        }
+    }
+    if (!create) return NULL;
 
-    // 0 = not logged in yet, 1 = logged in
-    int logged_in; 
+    // Keep the table at most half full
+    if ((x->nterms + 1) * 2 > x->cap) {
+        size_t cap = x->cap ? x->cap * 2 : 1024;
+        term_postings_t *terms = calloc(cap, sizeof(term_postings_t));
+        if (!terms) return NULL;
+        for (size_t j = 0; j < x->cap; j++) {
+            if (!x->terms[j].hash) continue;
+            size_t i = x->terms[j].hash & (cap - 1);
+            while (terms[i].hash) i = (i + 1) & (cap - 1);
+            terms[i] = x->terms[j];
+        }
+        free(x->terms);
+        x->terms = terms;
+        x->cap = cap;
+    }
+    size_t i = h & (x->cap - 1);
+    while (x->terms[i].hash) i = (i + 1) & (x->cap - 1);
+    x->terms[i].hash = h;
+    snprintf(x->terms[i].term, MAX_TERM, "%s", term);
+    x->nterms++;
+    atomic_fetch_add_explicit(&search_terms, 1, memory_order_relaxed);
+    return &x->terms[i];
+}
 
-    // next client in the list
-    struct client *next; 
-} client_t;
+/**
+ * @brief Appends a sequence number to a posting list (write lock held).
+ * 
+ * @param t The posting list.
+ * @param seq The sequence number, not below any already in the list.
+ * @return int 0 on success, -1 if allocation failed.
+ */
+int postings_add(term_postings_t *t, uint64_t seq) {
+    if (t->count > 0 && t->last_seq == seq) return 0; // term repeated within one message
+    if (t->len + 10 > t->cap) {
+        uint32_t cap = t->cap ? t->cap * 2 : 16;
+        unsigned char *data = realloc(t->data, cap);
+        if (!data) return -1;
+        t->data = data;
+        t->cap = cap;
+    }
+    uint32_t start = t->len;
+    for (uint64_t gap = seq - t->last_seq; ; gap >>= 7) {
+        if (gap < 0x80) {
+            t->data[t->len++] = (unsigned char)gap;
+            break;
+        }
+        t->data[t->len++] = (unsigned char)(gap & 0x7f) | 0x80;
+    }
+    atomic_fetch_add_explicit(&search_bytes, t->len - start, memory_order_relaxed);
+    t->last_seq = seq;
+    t->count++;
+    return 0;
+}
 
 /**
- * @brief Message structure representing a message in the queue.
+ * @brief Decodes a posting list.
+ * 
+ * @param t The posting list.
+ * @return uint64_t* Its sequence numbers, ascending (t->count entries), or NULL.
  */
-typedef struct message {
-    // sender username
-    char sender[MAX_USERNAME];
+uint64_t *postings_decode(const term_postings_t *t) {
+    uint64_t *seqs = malloc((t->count ? t->count : 1) * sizeof(uint64_t));
+    if (!seqs) return NULL;
+    uint64_t seq = 0;
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < t->count; i++) {
+        uint64_t gap = 0;
+        for (int shift = 0; pos < t->len; shift += 7) {
+            unsigned char b = t->data[pos++];
+            gap |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        seq += gap;
+        seqs[i] = seq;
+    }
+    return seqs;
+}
 
-    // message text
-    char text[MAX_MESSAGE];
+/**
+ * @brief Adds the terms of one logged line to a segment index (write lock held).
+ * 
+ * @details Messages are indexed by their text. An EDIT delta is indexed
+ * under its own sequence number with the new text, so an edited message is
+ * found by what it says now; searches map the hit back to the message.
+ * 
+ * @param x The segment index.
+ * @param rec The line's index record.
+ * @param line The line.
+ */
+void index_line(segment_index_t *x, const log_record_t *rec, const char *line) {
+    const char *end = line + rec->len, *p = line;
+    if (rec->flags & LOG_EDIT) p = memchr(line + 5, ':', rec->len - 5); // skip "EDIT:<seq>:"
+    else if (rec->flags) return;
+    p = p ? memchr(p, ':', end - p) : NULL; // skip "username:"
+    if (!p) return;
+    p++;
 
-    // next message in the queue
-    struct message *next;
-} message_t;
+    char term[MAX_TERM];
+    while (next_term(&p, end, term) > 0) {
+        term_postings_t *t = segment_term(x, term, 1);
+        if (t) postings_add(t, rec->seq);
+    }
+}
 
+/**
+ * @brief Chains one term of a segment index into the index file checksum.
+ * 
+ * @param check The checksum so far.
+ * @param t The term.
+ * @return uint64_t The updated checksum.
+ */
+uint64_t index_entry_check(uint64_t check, const term_postings_t *t) {
+    uint64_t meta[3] = { t->count, t->last_seq, t->len };
+    check = check * 31 + hash_bytes(t->term, strlen(t->term));
+    check = check * 31 + hash_bytes(meta, sizeof(meta));
+    return check * 31 + hash_bytes(t->data, t->len);
+}
 
-// Global client list (linked list)
-static client_t *clients_head = NULL; // Defines the client list head
-static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for client list to protect concurrent access
+/**
+ * @brief Saves the index of a sealed segment to NNN.fts.
+ * 
+ * @details The file is written beside the target with its header last (so
+ * a torn write never carries a valid one), synced, then renamed into place.
+ * 
+ * @param x The segment index.
+ * @return int 0 on success, -1 on error.
+ */
+int index_save(const segment_index_t *x) {
+    char path[MAX_LOG_PATH], tmp[MAX_LOG_PATH + 8];
+    segment_path(path, x->first_seq, "fts");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
 
-// Message queue (linked list)
-static message_t *msg_head = NULL; // Start of the message queue
-static message_t *msg_tail = NULL; // End of the message queue
-static pthread_mutex_t msg_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for message queue
-static pthread_cond_t msg_cond = PTHREAD_COND_INITIALIZER; // Condition variable for message queue that signals when new messages arrive
+    index_header_t h;
+    memset(&h, 0, sizeof(h));
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (size_t i = 0; ok && i < x->cap; i++) {
+        const term_postings_t *t = &x->terms[i];
+        if (!t->hash) continue;
+        unsigned char tlen = (unsigned char)strlen(t->term);
+        ok = fwrite(&tlen, 1, 1, f) == 1 && fwrite(t->term, 1, tlen, f) == tlen &&
+             fwrite(&t->count, sizeof(t->count), 1, f) == 1 && fwrite(&t->last_seq, sizeof(t->last_seq), 1, f) == 1 &&
+             fwrite(&t->len, sizeof(t->len), 1, f) == 1 && fwrite(t->data, 1, t->len, f) == t->len;
+        h.check = index_entry_check(h.check, t);
+    }
 
-static int server_sock = -1; // Server socket file descriptor
-static volatile int server_running = 1; // Server running flag
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.version = INDEX_VERSION;
+    h.indexed = x->indexed;
+    h.nterms = x->nterms;
+    ok = ok && fflush(f) == 0 && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1 &&
+         fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
 
 /**
- *  @brief Sends all bytes in the buffer to the specified file descriptor.
+ * @brief Loads the saved index of a sealed segment (write lock held).
  * 
- * @details This function attempts to send the entire buffer of length 'len' to the
+ * @details A file with the wrong magic or version, a short one, or one whose
+ * terms do not match the checksum is refused and the segment is reindexed.
  * 
- * @param fd The file descriptor to send data to.
- * @param buf Pointer to the buffer containing data to send.
- * @param len The length of the buffer in bytes.
- * @return ssize_t : The total number of bytes sent, or -1 on error.
+ * @param x The segment index (empty).
+ * @param records Records in the segment; an index covering fewer is rebuilt.
+ * @return int 0 on success, -1 if there is no usable saved index (the caller clears x).
+ */
+int index_load(segment_index_t *x, uint64_t records) {
+    char path[MAX_LOG_PATH];
+    segment_path(path, x->first_seq, "fts");
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+
+    index_header_t h;
+    uint64_t check = 0;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, INDEX_MAGIC, 8) == 0 &&
+             h.version == INDEX_VERSION && h.indexed == records;
+    for (uint64_t i = 0; ok && i < h.nterms; i++) {
+        char term[MAX_TERM];
+        unsigned char tlen;
+        term_postings_t in;
+        ok = fread(&tlen, 1, 1, f) == 1 && tlen < MAX_TERM && fread(term, 1, tlen, f) == tlen &&
+             fread(&in.count, sizeof(in.count), 1, f) == 1 && fread(&in.last_seq, sizeof(in.last_seq), 1, f) == 1 &&
+             fread(&in.len, sizeof(in.len), 1, f) == 1;
+        if (!ok) break;
+        term[tlen] = '\0';
+        term_postings_t *t = segment_term(x, term, 1);
+        unsigned char *data = malloc(in.len ? in.len : 1);
+        ok = t && data && fread(data, 1, in.len, f) == in.len;
+        if (!ok) {
+            free(data);
+            break;
+        }
+        t->data = data;
+        t->len = t->cap = in.len;
+        t->count = in.count;
+        t->last_seq = in.last_seq;
+        atomic_fetch_add_explicit(&search_bytes, in.len, memory_order_relaxed);
+        check = index_entry_check(check, t);
+    }
+    ok = ok && check == h.check && fgetc(f) == EOF;
+    fclose(f);
+    if (ok) {
+        x->indexed = records;
+        x->saved = 1;
+        atomic_fetch_add_explicit(&search_records, records, memory_order_relaxed);
+    }
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Releases the term table of a segment index.
+ */
+void index_clear(segment_index_t *x) {
+    for (size_t i = 0; i < x->cap; i++) {
+        atomic_fetch_sub_explicit(&search_bytes, x->terms[i].len, memory_order_relaxed);
+        free(x->terms[i].data);
+    }
+    atomic_fetch_sub_explicit(&search_terms, x->nterms, memory_order_relaxed);
+    free(x->terms);
+    x->terms = NULL;
+    x->cap = x->nterms = 0;
+}
+
+/**
+ * @brief Indexes the log records that are not indexed yet.
  * 
+ * @details Runs on the indexer thread, never on the dispatch path. Records
+ * are read in chunks straight from the segment files (which are append-only,
+ * or compressed) and added under the write lock one chunk at a time, so
+ * searches are only held up briefly. Sealed segments load their saved index when it is
+ * complete and save it once they are fully indexed.
  */
-ssize_t send_all(int fd, const void *buf, size_t len) {
-    size_t total = 0;
-    const char *p = buf;
-    while (total < len) {
-        ssize_t n = send(fd, p + total, len - total, 0);
-        if (n <= 0) {
-            if (errno == EINTR) continue;
-            return -1;
+void index_catch_up(void) {
+    log_record_t recs[256];
+    for (int i = 0; server_running; i++) {
+        pthread_mutex_lock(&log_mutex);
+        if (i >= log_nsegs) {
+            pthread_mutex_unlock(&log_mutex);
+            break;
+        }
+        log_segment_t seg = log_segs[i];
+        int sealed = i < log_nsegs - 1;
+        pthread_mutex_unlock(&log_mutex);
+
+        if (i == search_nsegs) {
+            pthread_rwlock_wrlock(&search_lock);
+            segment_index_t *segs = realloc(search_segs, (i + 1) * sizeof(segment_index_t));
+            if (!segs) {
+                pthread_rwlock_unlock(&search_lock);
+                break;
+            }
+            search_segs = segs;
+            memset(&search_segs[i], 0, sizeof(segment_index_t));
+            search_segs[i].first_seq = seg.first_seq;
+            if (sealed && index_load(&search_segs[i], seg.count) < 0) index_clear(&search_segs[i]);
+            search_nsegs++;
+            pthread_rwlock_unlock(&search_lock);
+        }
+        segment_index_t *x = &search_segs[i];
+
+        while (x->indexed < seg.count && server_running) {
+            size_t want = seg.count - x->indexed < 256 ? seg.count - x->indexed : 256;
+            ssize_t got = pread(seg.idx_fd, recs, want * sizeof(log_record_t), x->indexed * sizeof(log_record_t));
+            if (got < (ssize_t)sizeof(log_record_t)) break;
+            size_t n = got / sizeof(log_record_t);
+            uint64_t base = recs[0].offset, span = recs[n - 1].offset + recs[n - 1].len - base;
+            char *data = malloc(span ? span : 1);
+            pthread_rwlock_rdlock(&segment_lock);
+            pthread_mutex_lock(&log_mutex);
+            seg = log_segs[i]; // the segment may have been compacted since
+            pthread_mutex_unlock(&log_mutex);
+            int rc = data ? segment_read(&seg, base, span, data) : -1;
+            pthread_rwlock_unlock(&segment_lock);
+            if (rc < 0) {
+                free(data);
+                break;
+            }
+            pthread_rwlock_wrlock(&search_lock);
+            for (size_t j = 0; j < n; j++) index_line(x, &recs[j], data + (recs[j].offset - base));
+            x->indexed += n;
+            pthread_rwlock_unlock(&search_lock);
+            free(data);
+            atomic_fetch_add_explicit(&search_records, n, memory_order_relaxed);
+        }
+
+        if (sealed && !x->saved && x->indexed == seg.count) {
+            if (index_save(x) < 0) perror("index_save");
+            x->saved = 1;
         }
-        total += n;
     }
-    return total;
 }
 
 /**
- * @brief Broadcasts a formatted message to all logged-in clients.
+ * @brief Indexer thread: keeps the search index up to date with the log.
  * 
- * @param sender The username of the sender.
- * @param text The message text to broadcast.
+ * @param arg Unused parameter.
+ */
+void *indexer_thread(void *arg) {
+    (void)arg;
+    struct timespec period = { .tv_sec = 0, .tv_nsec = INDEX_POLL_MS * 1000000L };
+    while (server_running) {
+        index_catch_up();
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Checks a posting against the current history and reads what to show for it.
+ * 
+ * @details Deleted messages are dropped. An edited message is represented
+ * by its latest EDIT delta only, so it matches on what it says now and is
+ * shown with its current text under its own sequence number.
  * 
+ * @param seq The posting.
+ * @param line Output: the current line (2 * FRAME_CAP bytes).
+ * @param shown Output: the message's sequence number.
+ * @return ssize_t Length of the line, or -1 if the posting is stale.
  */
-void broadcast_formatted(const char *sender, const char *text) {
-    // format: username: text\n
-    char out[MAX_USERNAME + 2 + MAX_MESSAGE + 2];
-    snprintf(out, sizeof(out), "%s: %s\n", sender, text);
+ssize_t search_resolve(uint64_t seq, char *line, uint64_t *shown) {
+    log_record_t rec;
+    uint32_t state;
+    ssize_t len = history_read(seq, line, &rec, &state);
+    if (len < 0) return -1;
+    if (rec.flags == 0) {
+        if (state & (HIST_EDITED | HIST_DELETED)) return -1;
+        *shown = seq;
+        return len;
+    }
+    if (!(rec.flags & LOG_EDIT)) return -1;
+    uint64_t target = strtoull(line + 5, NULL, 10);
+    if (history_latest_edit(target, &state) != seq || (state & HIST_DELETED)) return -1;
+    *shown = target;
+    return history_read(target, line, &rec, &state);
+}
+
+/**
+ * @brief Handles SEARCH:[before=<seq>] [limit=<n>] <words> from a client.
+ * 
+ * @details Matches messages containing every word, newest first. Each match
+ * is sent as "RESULT:<seq>:<line>", followed by "SEARCHEND:<count>:<next>";
+ * a nonzero next is the before= value for the following page.
+ * 
+ * @param c The client.
+ * @param args Everything after "SEARCH:".
+ */
+void search_command(client_t *c, const char *args) {
+    uint64_t start = now_usec();
+    uint64_t before = UINT64_MAX, next = 0;
+    int limit = SEARCH_PAGE;
+    char reply[64];
+    if (!search_enabled) {
+        snprintf(reply, sizeof(reply), "ERR:Search is not enabled\n");
+        client_send(c, reply, strlen(reply));
+        return;
+    }
 
-    pthread_mutex_lock(&clients_mutex);
-    client_t *c = clients_head;
+    // Paging options come first
+    for (;;) {
+        while (*args == ' ') args++;
+        if (strncmp(args, "before=", 7) == 0) before = strtoull(args + 7, (char **)&args, 10);
+        else if (strncmp(args, "limit=", 6) == 0) limit = (int)strtol(args + 6, (char **)&args, 10);
+        else break;
+    }
+    if (limit < 1) limit = 1;
+    if (limit > SEARCH_PAGE_MAX) limit = SEARCH_PAGE_MAX;
 
-    // While the client is active, check to see if the other clients are active.
-    // We can make this into a function later in the future if we want to specify a minumum number of clients
-    while (c) {
-        if (c->logged_in) {
-            if (send_all(c->sockfd, out, strlen(out)) < 0) {
-                // ignore error here; the client thread will handle closure
+    char terms[MAX_QUERY_TERMS][MAX_TERM];
+    int nterms = 0;
+    const char *p = args, *end = args + strlen(args);
+    while (nterms < MAX_QUERY_TERMS && next_term(&p, end, terms[nterms]) > 0) {
+        int dup = 0;
+        for (int k = 0; k < nterms; k++) dup |= strcmp(terms[k], terms[nterms]) == 0;
+        if (!dup) nterms++;
+    }
+    if (nterms == 0) {
+        snprintf(reply, sizeof(reply), "ERR:Usage SEARCH:[before=<seq>] [limit=<n>] <words>\n");
+        client_send(c, reply, strlen(reply));
+        return;
+    }
+
+    // Results are collected under the lock and sent after it, so a slow reader never holds up the indexer
+    int found = 0;
+    char line[2 * FRAME_CAP];
+    char (*lines)[2 * FRAME_CAP + 32] = malloc(limit * sizeof(*lines));
+    size_t *lens = malloc(limit * sizeof(size_t));
+    if (!lines || !lens) limit = 0;
+    pthread_rwlock_rdlock(&search_lock);
+    for (int si = search_nsegs - 1; si >= 0 && found < limit; si--) {
+        segment_index_t *x = &search_segs[si];
+        if (x->first_seq >= before) continue;
+
+        // Walk the shortest posting list backwards, probing the others
+        term_postings_t *lists[MAX_QUERY_TERMS];
+        int shortest = 0, k;
+        for (k = 0; k < nterms; k++) {
+            if (!(lists[k] = segment_term(x, terms[k], 0))) break;
+            if (lists[k]->count < lists[shortest]->count) shortest = k;
+        }
+        if (k < nterms) continue;
+        uint64_t *seqs[MAX_QUERY_TERMS];
+        for (k = 0; k < nterms; k++) seqs[k] = postings_decode(lists[k]);
+
+        for (int64_t i = (int64_t)lists[shortest]->count - 1; i >= 0 && found < limit; i--) {
+            uint64_t seq = seqs[shortest] ? seqs[shortest][i] : 0;
+            if (seq == 0 || seq >= before) continue;
+            int all = 1;
+            for (k = 0; k < nterms && all; k++) {
+                if (k == shortest) continue;
+                uint32_t lo = 0, hi = lists[k]->count;
+                while (seqs[k] && lo < hi) {
+                    uint32_t mid = (lo + hi) / 2;
+                    if (seqs[k][mid] < seq) lo = mid + 1;
+                    else hi = mid;
+                }
+                all = seqs[k] && lo < lists[k]->count && seqs[k][lo] == seq;
             }
+            uint64_t shown;
+            ssize_t len = all ? search_resolve(seq, line, &shown) : -1;
+            if (len < 0) continue;
+            int n = snprintf(lines[found], sizeof(lines[found]), "RESULT:%llu:%.*s", (unsigned long long)shown, (int)len, line);
+            lens[found++] = n < (int)sizeof(lines[0]) ? (size_t)n : sizeof(lines[0]) - 1;
+            next = seq;
         }
-        c = c->next;
+        for (k = 0; k < nterms; k++) free(seqs[k]);
+    }
+    pthread_rwlock_unlock(&search_lock);
+
+    for (int i = 0; i < found; i++) client_send(c, lines[i], lens[i]);
+    free(lines);
+    free(lens);
+    snprintf(reply, sizeof(reply), "SEARCHEND:%d:%llu\n", found, (unsigned long long)(found == limit && limit ? next : 0));
+    client_send(c, reply, strlen(reply));
+    latency_record(&search_latency, now_usec() - start);
+}
+
+/**
+ * @brief Returns the oldest sequence number history can still be read for (log_mutex held).
+ */
+uint64_t history_first_seq(void) {
+    if (log_dir[0]) return log_nsegs > 0 ? log_segs[0].first_seq : next_seq;
+    return next_seq > HISTORY_RING ? next_seq - HISTORY_RING : 1;
+}
+
+/**
+ * @brief Finds the first sequence number broadcast at or after a time.
+ * 
+ * @details Sequence numbers are assigned in time order, so this is a binary
+ * search over the readable range; each probe reads one timestamp from the
+ * ring or one index record from the log.
+ * 
+ * @param ts_usec The time, microseconds since the epoch.
+ * @return uint64_t The sequence number, or the next one to be assigned if none.
+ */
+uint64_t history_seq_at(int64_t ts_usec) {
+    pthread_mutex_lock(&log_mutex);
+    uint64_t lo = history_first_seq(), hi = next_seq;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int64_t ts = INT64_MIN;
+        history_entry_t *h = history_ring ? &history_ring[mid & (HISTORY_RING - 1)] : NULL;
+        int si;
+        log_record_t rec;
+        if (h && h->seq == mid) {
+            ts = h->ts_usec;
+        } else if (log_dir[0] && (si = segment_for_seq(mid)) >= 0 &&
+                   pread(log_segs[si].idx_fd, &rec, sizeof(rec), (mid - log_segs[si].first_seq) * sizeof(rec)) == sizeof(rec)) {
+            ts = rec.ts_usec;
+        }
+        if (ts < ts_usec) lo = mid + 1;
+        else hi = mid;
     }
-    pthread_mutex_unlock(&clients_mutex);
+    pthread_mutex_unlock(&log_mutex);
+    return lo;
 }
 
+/**
+ * @brief Handles HISTORY:[before=<seq>] [after=<seq>] [before_ts=<t>] [after_ts=<t>] [limit=<n>].
+ * 
+ * @details Returns up to limit messages strictly between the bounds, in
+ * order, each as "HIST:<seq>:<ts_usec>:<line>", then
+ * "HISTEND:<count>:<next>". Times are Unix seconds (fractions allowed).
+ * Without an after bound the newest messages below before are returned and
+ * a nonzero next is the before= value for the previous page; with one the
+ * oldest messages above after are returned and next is the after= value
+ * for the following page. Messages come with their latest edit applied;
+ * deleted messages and delta records are left out. Recent lines are served
+ * from the in-memory ring, older ones from the log.
+ * 
+ * @param c The client.
+ * @param args Everything after "HISTORY:" (may be empty).
+ */
+void history_command(client_t *c, const char *args) {
+    uint64_t start = now_usec();
+    uint64_t before = UINT64_MAX, after = 0;
+    int64_t before_ts = 0, after_ts = 0;
+    int limit = HISTORY_PAGE, forward = 0;
+    char reply[128];
+
+    for (;;) {
+        while (*args == ' ') args++;
+        if (strncmp(args, "before=", 7) == 0) before = strtoull(args + 7, (char **)&args, 10);
+        else if (strncmp(args, "after=", 6) == 0) after = strtoull(args + 6, (char **)&args, 10), forward = 1;
+        else if (strncmp(args, "before_ts=", 10) == 0) before_ts = (int64_t)(strtod(args + 10, (char **)&args) * 1e6);
+        else if (strncmp(args, "after_ts=", 9) == 0) after_ts = (int64_t)(strtod(args + 9, (char **)&args) * 1e6), forward = 1;
+        else if (strncmp(args, "limit=", 6) == 0) limit = (int)strtol(args + 6, (char **)&args, 10);
+        else break;
+    }
+    if (*args) {
+        snprintf(reply, sizeof(reply), "ERR:Usage HISTORY:[before=|after=<seq>] [before_ts=|after_ts=<t>] [limit=<n>]\n");
+        client_send(c, reply, strlen(reply));
+        return;
+    }
+    if (limit < 1) limit = 1;
+    if (limit > HISTORY_PAGE_MAX) limit = HISTORY_PAGE_MAX;
+
+    // Turn times into sequence bounds, then clamp to what can still be read
+    if (before_ts > 0) {
+        uint64_t seq = history_seq_at(before_ts);
+        if (seq < before) before = seq;
+    }
+    if (after_ts > 0) {
+        uint64_t seq = history_seq_at(after_ts);
+        if (seq > 0 && seq - 1 > after) after = seq - 1;
+    }
+    pthread_mutex_lock(&log_mutex);
+    uint64_t first = history_first_seq(), end = next_seq;
+    pthread_mutex_unlock(&log_mutex);
+    if (before > end) before = end;
+    if (after + 1 < first) after = first - 1;
+
+    char (*lines)[2 * FRAME_CAP + 48] = malloc(limit * sizeof(*lines));
+    size_t *lens = malloc(limit * sizeof(size_t));
+    int n = 0;
+    uint64_t last = 0;
+    char line[2 * FRAME_CAP];
+    for (uint64_t seq = forward ? after + 1 : before - 1; lines && lens && n < limit && seq > after && seq < before;
+         seq = forward ? seq + 1 : seq - 1) {
+        log_record_t rec;
+        uint32_t state;
+        ssize_t len = history_read(seq, line, &rec, &state);
+        if (len < 0 || rec.flags != 0 || (state & HIST_DELETED)) continue;
+        int k = snprintf(lines[n], sizeof(lines[n]), "HIST:%llu:%lld:%.*s", (unsigned long long)seq,
+                         (long long)rec.ts_usec, (int)len, line);
+        lens[n++] = k < (int)sizeof(lines[n]) ? (size_t)k : sizeof(lines[n]) - 1;
+        last = seq;
+    }
+
+    // Pages are always sent oldest first
+    for (int i = 0; i < n; i++) {
+        int j = forward ? i : n - 1 - i;
+        client_send(c, lines[j], lens[j]);
+    }
+    free(lines);
+    free(lens);
+    snprintf(reply, sizeof(reply), "HISTEND:%d:%llu\n", n, (unsigned long long)(n == limit ? last : 0));
+    client_send(c, reply, strlen(reply));
+    latency_record(&history_latency, now_usec() - start);
+}
 
 /**
- * @brief Enqueues a message to the message queue.
+ * @brief Handles EDIT:<seq>:<text> and DELETE:<seq> from a client.
  * 
- * @param sender The username of the sender.
- * @param text The message text.
+ * @details Only the author may edit or delete a message, and a deleted
+ * message stays deleted. The change reaches everyone as a small delta frame
+ * naming the message, which is logged like any other broadcast.
+ * 
+ * @param c The client.
+ * @param args Everything after "EDIT:" or "DELETE:".
+ * @param del 1 for DELETE, 0 for EDIT.
  */
-void enqueue_message(const char *sender, const char *text) {
-    message_t *m = calloc(1, sizeof(message_t));
-    if (!m) return; // allocation failed
-    strncpy(m->sender, sender, MAX_USERNAME-1); // Send the sender username
-    strncpy(m->text, text, MAX_MESSAGE-1); // Send text
-    m->next = NULL;
+void edit_command(client_t *c, const char *args, int del) {
+    char reply[96], owner[MAX_USERNAME];
+    char *end;
+    uint32_t state;
+    uint64_t seq = strtoull(args, &end, 10);
+    if (seq == 0 || end == args || (del ? *end != '\0' : (*end != ':' && *end != ' '))) {
+        snprintf(reply, sizeof(reply), del ? "ERR:Usage DELETE:<seq>\n" : "ERR:Usage EDIT:<seq>:<text>\n");
+    } else if (history_lookup(seq, owner, &state) < 0) {
+        snprintf(reply, sizeof(reply), "ERR:No such message\n");
+    } else if (strcmp(owner, c->username) != 0) {
+        snprintf(reply, sizeof(reply), "ERR:Not your message\n");
+    } else if (state & HIST_DELETED) {
+        snprintf(reply, sizeof(reply), "ERR:Message deleted\n");
+    } else if (enqueue_delta(del ? MSG_DELETE : MSG_EDIT, c->username, seq, del ? NULL : end + 1) < 0) {
+        snprintf(reply, sizeof(reply), "ERR:Out of memory\n");
+    } else {
+        atomic_fetch_add_explicit(del ? &history_deletes : &history_edits, 1, memory_order_relaxed);
+        snprintf(reply, sizeof(reply), "%s:%llu\n", del ? "OKDELETE" : "OKEDIT", (unsigned long long)seq);
+    }
+    client_send(c, reply, strlen(reply));
+}
 
-    pthread_mutex_lock(&msg_mutex);
-    if (!msg_tail) {
-        msg_head = msg_tail = m;
+/**
+ * @brief Handles TYPING[:0|1] and STATUS:<text> from a client.
+ * 
+ * @details Only the client's current state is recorded here. Repeating the
+ * same state changes nothing, so a client that sends TYPING on every
+ * keystroke costs no broadcast traffic; the ticker sends what changed.
+ * 
+ * @param c The client.
+ * @param cmd The command line.
+ */
+void presence_command(client_t *c, const char *cmd) {
+    pthread_mutex_t *lock = &c->shard->clients_mutex;
+    atomic_fetch_add_explicit(&presence_updates, 1, memory_order_relaxed);
+    pthread_mutex_lock(lock);
+    if (strncmp(cmd, "TYPING", 6) == 0) {
+        int on = strcmp(cmd + 6, ":0") != 0;
+        if (on) c->typing_until = now_usec() + TYPING_TIMEOUT_USEC;
+        if (on != c->typing) {
+            c->typing = on;
+            c->presence_dirty = 1;
+        }
     } else {
-        msg_tail->next = m;
-        msg_tail = m;
+        // STATUS:<text>; the delta separators ',', ';' and '=' are not allowed in it
+        char status[MAX_STATUS];
+        snprintf(status, sizeof(status), "%s", cmd + 7);
+        for (char *p = status; *p; p++) {
+            if (*p == ',' || *p == ';' || *p == '=') *p = ' ';
+        }
+        if (strcmp(status, c->status) != 0) {
+            memcpy(c->status, status, MAX_STATUS);
+            c->presence_dirty = 1;
+        }
     }
-    pthread_cond_signal(&msg_cond);
-    pthread_mutex_unlock(&msg_mutex);
+    pthread_mutex_unlock(lock);
 }
 
 /**
- * @brief Dequeues a message from the message queue.
+ * @brief Sends a packed PRESENCE line to one client, or broadcasts it, and empties it.
  * 
- * @return message_t* Pointer to the dequeued message, or NULL if server is shutting down.
+ * @param line The line, MAX_MESSAGE + 1 bytes.
+ * @param len Its length, reset to 0.
+ * @param to The recipient, or NULL to broadcast.
  */
-message_t *dequeue_message() {
-    pthread_mutex_lock(&msg_mutex);
-    while (!msg_head && server_running) {
-        pthread_cond_wait(&msg_cond, &msg_mutex);
+static void presence_flush(char *line, size_t *len, client_t *to) {
+    if (*len == 0) return;
+    if (to) {
+        line[(*len)++] = '\n';
+        client_send(to, line, *len);
+    } else {
+        enqueue_raw(line);
+        atomic_fetch_add_explicit(&presence_deltas, 1, memory_order_relaxed);
     }
-    if (!server_running) {
-        pthread_mutex_unlock(&msg_mutex);
-        return NULL;
+    *len = 0;
+}
+
+/**
+ * @brief Appends one "user=state" entry to a PRESENCE line, flushing the line first if it is full.
+ * 
+ * @param line The line, MAX_MESSAGE + 1 bytes.
+ * @param len Its length.
+ * @param entry The entry.
+ * @param to The recipient, or NULL to broadcast.
+ */
+static void presence_add(char *line, size_t *len, const char *entry, client_t *to) {
+    size_t n = strlen(entry);
+    if (*len > 0 && *len + 1 + n >= MAX_MESSAGE) presence_flush(line, len, to);
+    *len += snprintf(line + *len, MAX_MESSAGE - *len, "%s%s", *len ? ";" : "PRESENCE:", entry);
+}
+
+/**
+ * @brief Broadcasts the presence changes of the last window as compact deltas.
+ * 
+ * @details Each changed user appears once per window, however many updates
+ * they sent, as "user=status" with ",typing" appended while typing, e.g.
+ * "PRESENCE:alice=away;bob=online,typing". Users who left appear as
+ * "user=offline". Expired typing indicators are cleared here too. Entries
+ * are packed into as few lines as fit.
+ */
+void presence_tick(void) {
+    char line[MAX_MESSAGE + 1];
+    size_t len = 0;
+    uint64_t now = now_usec();
+
+    pthread_mutex_lock(&presence_gone_lock);
+    char (*gone)[MAX_USERNAME] = presence_gone;
+    int ngone = presence_gone_count;
+    presence_gone = NULL;
+    presence_gone_count = presence_gone_cap = 0;
+    pthread_mutex_unlock(&presence_gone_lock);
+    for (int i = 0; i < ngone; i++) {
+        char entry[MAX_USERNAME + 16];
+        snprintf(entry, sizeof(entry), "%s=offline", gone[i]);
+        presence_add(line, &len, entry, NULL);
+        atomic_fetch_add_explicit(&presence_entries, 1, memory_order_relaxed);
     }
-    message_t *m = msg_head;
-    msg_head = msg_head->next;
-    if (!msg_head) msg_tail = NULL;
-    pthread_mutex_unlock(&msg_mutex);
-    return m;
+    free(gone);
+
+    for (int i = 0; i < num_shards; i++) {
+        shard_t *s = shards[i];
+        pthread_mutex_lock(&s->clients_mutex);
+        for (client_t *c = s->clients_head; c; c = c->next) {
+            if (c->typing && now >= c->typing_until) {
+                c->typing = 0;
+                c->presence_dirty = 1;
+            }
+            if (!c->presence_dirty || !c->logged_in) continue;
+            c->presence_dirty = 0;
+            c->presence_shown = 1;
+
+            char entry[MAX_USERNAME + MAX_STATUS + 16];
+            snprintf(entry, sizeof(entry), "%s=%s%s", c->username,
+                     c->status[0] ? c->status : "online", c->typing ? ",typing" : "");
+            presence_add(line, &len, entry, NULL);
+            atomic_fetch_add_explicit(&presence_entries, 1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&s->clients_mutex);
+    }
+    presence_flush(line, &len, NULL);
 }
 
+/**
+ * @brief Sends a client that just logged in the current presence of everyone else.
+ * 
+ * @details Only users with a status or typing are listed; anyone not listed
+ * is plainly online. Later changes reach the client as deltas.
+ * 
+ * @param to The new client.
+ */
+void presence_snapshot(client_t *to) {
+    char line[MAX_MESSAGE + 1];
+    size_t len = 0;
+    for (int i = 0; i < num_shards; i++) {
+        shard_t *s = shards[i];
+        pthread_mutex_lock(&s->clients_mutex);
+        for (client_t *c = s->clients_head; c; c = c->next) {
+            if (c == to || !c->logged_in || (!c->status[0] && !c->typing)) continue;
+            char entry[MAX_USERNAME + MAX_STATUS + 16];
+            snprintf(entry, sizeof(entry), "%s=%s%s", c->username,
+                     c->status[0] ? c->status : "online", c->typing ? ",typing" : "");
+            presence_add(line, &len, entry, to);
+        }
+        pthread_mutex_unlock(&s->clients_mutex);
+    }
+    presence_flush(line, &len, to);
+}
 
 /**
- * @brief Receives a line of text from the specified file descriptor.
+ * @brief Handles REACT:<seq>:<name> from a client.
  * 
- * @param fd The file descriptor to receive data from.
- * @param buf Pointer to the buffer to store the received line.
- * @param maxlen The maximum length of the buffer.
+ * @details Only the counter changes here; the message is queued for the
+ * next reaction update at most once per window, however many reactions
+ * it gets in the meantime.
  * 
- * @return int The number of bytes received, or -1 on error.
+ * @param c The client.
+ * @param args Everything after "REACT:".
  */
-int recv_line(int fd, char *buf, size_t maxlen) {
-    // ssize is for signed size
-    // size_t is for unsigned size
-    size_t idx = 0; // current index in buffer
-    while (idx < maxlen - 1) {
-        char c;
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n <= 0) return -1;
-        buf[idx++] = c;
-        if (c == '\n') break;
+void react_command(client_t *c, const char *args) {
+    char reply[64];
+    char *end;
+    uint32_t state;
+    uint64_t seq = strtoull(args, &end, 10);
+    const char *name = end + 1;
+    size_t nlen = (*end == ':' || *end == ' ') ? strlen(name) : 0;
+    if (seq == 0 || end == args || nlen == 0 || nlen >= MAX_REACTION || name[strcspn(name, ":;,= ")]) {
+        snprintf(reply, sizeof(reply), "ERR:Usage REACT:<seq>:<name>\n");
+    } else if (history_lookup(seq, NULL, &state) < 0) {
+        snprintf(reply, sizeof(reply), "ERR:No such message\n");
+    } else if (state & HIST_DELETED) {
+        snprintf(reply, sizeof(reply), "ERR:Message deleted\n");
+    } else {
+        pthread_mutex_lock(&react_mutex);
+        react_entry_t *e = react_lookup(seq, 1);
+        int k = 0;
+        while (e && k < e->n && strcmp(e->names[k], name) != 0) k++;
+        if (e && k == e->n && k < REACT_KINDS) {
+            memcpy(e->names[k], name, nlen + 1);
+            e->counts[k] = 0;
+            e->n++;
+        }
+        if (!e || k == REACT_KINDS) {
+            snprintf(reply, sizeof(reply), e ? "ERR:Too many reactions\n" : "ERR:Out of memory\n");
+        } else {
+            e->counts[k]++;
+            if (!e->dirty) {
+                if (react_ndirty == react_dirty_cap) {
+                    size_t cap = react_dirty_cap ? react_dirty_cap * 2 : 64;
+                    uint64_t *grown = realloc(react_dirty, cap * sizeof(uint64_t));
+                    if (grown) {
+                        react_dirty = grown;
+                        react_dirty_cap = cap;
+                    }
+                }
+                if (react_ndirty < react_dirty_cap) {
+                    react_dirty[react_ndirty++] = seq;
+                    e->dirty = 1;
+                }
+            }
+            atomic_fetch_add_explicit(&react_received, 1, memory_order_relaxed);
+            snprintf(reply, sizeof(reply), "OKREACT:%llu\n", (unsigned long long)seq);
+        }
+        pthread_mutex_unlock(&react_mutex);
     }
-    buf[idx] = '\0';
-    return idx;
+    client_send(c, reply, strlen(reply));
 }
 
 /**
- * @brief Adds a client to the global client list.
+ * @brief Broadcasts the reaction totals of every message that changed this window.
  * 
- * @param c Pointer to the client to add.
+ * @details One "REACTS:<seq>:<name>=<count>,..." line per message carries
+ * absolute totals, so a client that misses one update is corrected by the
+ * next. The lines are logged, which keeps the totals across restarts.
  */
-void add_client(client_t *c) {
-    pthread_mutex_lock(&clients_mutex);
-    c->next = clients_head;
-    clients_head = c;
-    pthread_mutex_unlock(&clients_mutex);
+void react_tick(void) {
+    pthread_mutex_lock(&react_mutex);
+    for (size_t i = 0; i < react_ndirty; i++) {
+        react_entry_t *e = react_lookup(react_dirty[i], 0);
+        if (!e) continue;
+        e->dirty = 0;
+        char totals[REACT_KINDS * (MAX_REACTION + 12)];
+        size_t len = 0;
+        totals[0] = '\0';
+        for (int k = 0; k < e->n; k++) {
+            len += snprintf(totals + len, sizeof(totals) - len, "%s%s=%u", k ? "," : "", e->names[k], e->counts[k]);
+        }
+        if (enqueue_delta(MSG_REACTS, "", e->seq, totals) == 0) {
+            atomic_fetch_add_explicit(&react_updates, 1, memory_order_relaxed);
+        }
+    }
+    react_ndirty = 0;
+    pthread_mutex_unlock(&react_mutex);
 }
 
 /**
- * @brief Removes a client from the global client list.
+ * @brief Ticker thread: runs periodic coalesced work (presence deltas, reaction totals, zerocopy reaping).
  * 
- * @param c Pointer to the client, which we will remove.
+ * @param arg Unused parameter.
  */
-void remove_client(client_t *c) {
-    pthread_mutex_lock(&clients_mutex);
-    client_t **p = &clients_head;
-    while (*p) {
-        if (*p == c) {
-            *p = c->next;
-            break;
+void *ticker_thread(void *arg) {
+    (void)arg;
+    int tick_ms = presence_ms < react_ms ? presence_ms : react_ms;
+    struct timespec period = { .tv_sec = tick_ms / 1000, .tv_nsec = (long)(tick_ms % 1000) * 1000000 };
+    uint64_t next_presence = 0, next_react = 0;
+    while (server_running) {
+        nanosleep(&period, NULL);
+        uint64_t now = now_usec();
+        if (now >= next_presence) {
+            presence_tick();
+            next_presence = now + (uint64_t)presence_ms * 1000 - 1000; // 1ms slack for timer jitter
         }
-        p = &(*p)->next;
+        if (now >= next_react) {
+            react_tick();
+            next_react = now + (uint64_t)react_ms * 1000 - 1000;
+        }
+        if (zerocopy_min > 0) zc_tick();
     }
-    pthread_mutex_unlock(&clients_mutex);
+    return NULL;
 }
 
 /**
- * @brief Checks if a username is already taken by a logged-in client.
+ * @brief Appends one "STAT:key=value" line to a stats buffer.
  * 
- * @param username The username to check.
+ * @param buf The stats buffer.
+ * @param cap Capacity of buf.
+ * @param len Current length of buf; advanced past the new line.
+ * @param fmt printf-style "key=value" format.
+ */
+void stat_line(char *buf, size_t cap, size_t *len, const char *fmt, ...) {
+    if (*len + 6 >= cap) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len + 5, cap - *len - 5, fmt, ap);
+    va_end(ap);
+    // A line that does not fit is left out whole rather than cut short
+    if (n < 0 || (size_t)n + 1 >= cap - *len - 5) {
+        buf[*len] = '\0';
+        return;
+    }
+    memcpy(buf + *len, "STAT:", 5);
+    *len += 5 + n;
+    buf[(*len)++] = '\n';
+    buf[*len] = '\0';
+}
+
+/**
+ * @brief Appends the count, average and percentiles of a histogram to a stats buffer.
  * 
- * @return int 1 if taken, 0 if available.
+ * @param buf The buffer.
+ * @param cap Capacity of the buffer.
+ * @param len In/out: bytes used.
+ * @param name Key prefix, e.g. "history.query_us".
+ * @param h The histogram.
  */
-int username_taken(const char *username) {
-    int taken = 0;
-    pthread_mutex_lock(&clients_mutex);
-    client_t *c = clients_head;
-    while (c) {
-        if (c->logged_in && strcmp(c->username, username) == 0) {
-            taken = 1;
-            break;
-        }
-        c = c->next;
+void latency_stats(char *buf, size_t cap, size_t *len, const char *name, latency_hist_t *h) {
+    uint64_t count = atomic_load(&h->count);
+    stat_line(buf, cap, len, "%s.count=%llu", name, (unsigned long long)count);
+    stat_line(buf, cap, len, "%s.avg=%llu", name, (unsigned long long)(count ? atomic_load(&h->total_usec) / count : 0));
+    stat_line(buf, cap, len, "%s.p50=%llu", name, (unsigned long long)latency_percentile(h, 50));
+    stat_line(buf, cap, len, "%s.p99=%llu", name, (unsigned long long)latency_percentile(h, 99));
+}
+
+/**
+ * @brief Appends the stats of one pool.
+ * 
+ * @param buf The stats buffer.
+ * @param cap Capacity of buf.
+ * @param len Current length of buf.
+ * @param pl The pool to report.
+ */
+void pool_stats(char *buf, size_t cap, size_t *len, pool_t *pl) {
+    pthread_mutex_lock(&pl->lock);
+    size_t in_use = pl->in_use;
+    pthread_mutex_unlock(&pl->lock);
+    stat_line(buf, cap, len, "pool.%s.backing=%s", pl->name, pl->backing);
+    stat_line(buf, cap, len, "pool.%s.capacity=%zu", pl->name, pl->capacity);
+    stat_line(buf, cap, len, "pool.%s.in_use=%zu", pl->name, in_use);
+    stat_line(buf, cap, len, "pool.%s.overflow=%zu", pl->name, atomic_load(&pl->overflow));
+}
+
+/**
+ * @brief Appends a top-k table, heaviest first, skipping empty slots.
+ * 
+ * @param buf The stats buffer.
+ * @param cap Capacity of buf.
+ * @param len Current length of buf.
+ * @param name Key prefix for the lines.
+ * @param top The table (sorted in place).
+ */
+void top_k_stats(char *buf, size_t cap, size_t *len, const char *name, heavy_hitter_t *top) {
+    for (int i = 1; i < TOP_K; i++) {
+        heavy_hitter_t h = top[i];
+        int j = i;
+        for (; j > 0 && top[j - 1].count < h.count; j--) top[j] = top[j - 1];
+        top[j] = h;
+    }
+    for (int i = 0; i < TOP_K && top[i].key; i++) {
+        stat_line(buf, cap, len, "%s.%d=%u %s", name, i + 1, top[i].count, top[i].label);
     }
-    pthread_mutex_unlock(&clients_mutex);
-    return taken;
 }
 
 /**
- * @brief Closes and frees a client structure.
+ * @brief Appends ACK totals and the delivery lag of every ACK-mode client.
  * 
- * @param c Pointer to the client to close and free.
+ * @details seq_lag is how many sequence numbers the client has not
+ * acknowledged yet; lag_us is how long its oldest unacknowledged write has
+ * been waiting (0 once everything is acknowledged).
+ * 
+ * @param buf The stats buffer.
+ * @param cap Capacity of buf.
+ * @param len Current length of buf.
  */
-void close_and_free_client(client_t *c) {
-    if (!c) return;
-    close(c->sockfd);
-    remove_client(c);
-    free(c);
+void ack_stats(char *buf, size_t cap, size_t *len) {
+    stat_line(buf, cap, len, "ack.received=%lu", atomic_load(&acks_received));
+    stat_line(buf, cap, len, "ack.overflows=%lu", atomic_load(&ack_overflows));
+    stat_line(buf, cap, len, "ack.rtt_avg_us=%lu", atomic_load(&ack_rtt_avg));
+    uint64_t now = now_usec();
+    int listed = 0;
+    for (int i = 0; i < num_shards; i++) {
+        pthread_mutex_lock(&shards[i]->clients_mutex);
+        for (client_t *c = shards[i]->clients_head; c; c = c->next) {
+            if (!c->logged_in || !atomic_load(&c->ack_mode)) continue;
+            if (++listed > ACK_STATS_CLIENTS) continue;
+            pthread_mutex_lock(&c->send_lock);
+            uint64_t seq_lag = c->sent_seq - c->acked_seq;
+            uint64_t lag = c->unacked_count ? now - c->unacked[c->unacked_head].sent_usec : 0;
+            pthread_mutex_unlock(&c->send_lock);
+            stat_line(buf, cap, len, "ack.%s.seq_lag=%llu", c->username, (unsigned long long)seq_lag);
+            stat_line(buf, cap, len, "ack.%s.lag_us=%llu", c->username, (unsigned long long)lag);
+        }
+        pthread_mutex_unlock(&shards[i]->clients_mutex);
+    }
+    stat_line(buf, cap, len, "ack.clients=%d", listed);
+    if (listed > ACK_STATS_CLIENTS) stat_line(buf, cap, len, "ack.clients_omitted=%d", listed - ACK_STATS_CLIENTS);
 }
 
 /**
- * @brief Dispatcher thread function: dequeues messages and broadcasts them.
+ * @brief Formats the server statistics reply (STAT lines terminated by STAT:END).
  * 
- * @param arg Unused parameter.
+ * @details Room for STAT:END is always kept, so a client waiting for the
+ * terminator gets it even when lines had to be left out.
+ * 
+ * @param buf Output buffer.
+ * @param size Capacity of buf.
+ * @return size_t Length of the reply.
  */
-void *dispatcher_thread(void *arg) {
-    (void)arg; // For unused parameter warning
-    while (server_running) {
-        message_t *m = dequeue_message();
-        if (!m) break;
-        // Broadcast to all clients
-        broadcast_formatted(m->sender, m->text);
-        free(m);
+size_t format_stats(char *buf, size_t size) {
+    size_t cap = size - sizeof("STAT:END\n"); // for every line but END
+    size_t len = 0;
+    buf[0] = '\0';
+    stat_line(buf, cap, &len, "shards=%d", num_shards);
+    stat_line(buf, cap, &len, "wait.spin_us=%d", spin_usec);
+    stat_line(buf, cap, &len, "wait.spin_hits=%lu", atomic_load(&spin_hits));
+    stat_line(buf, cap, &len, "wait.parks=%lu", atomic_load(&parks));
+    stat_line(buf, cap, &len, "tcp.profile=%s", tcp_profile == TCP_PROFILE_LATENCY ? "latency"
+                                                : tcp_profile == TCP_PROFILE_THROUGHPUT ? "throughput" : "default");
+    stat_line(buf, cap, &len, "zerocopy.min=%zu", zerocopy_min);
+    stat_line(buf, cap, &len, "zerocopy.sends=%lu", atomic_load(&zc_sends));
+    stat_line(buf, cap, &len, "zerocopy.copied=%lu", atomic_load(&zc_copied));
+    stat_line(buf, cap, &len, "zerocopy.fallbacks=%lu", atomic_load(&zc_fallbacks));
+    pthread_mutex_lock(&log_mutex);
+    uint64_t seq = next_seq;
+    int nsegs = log_nsegs;
+    pthread_mutex_unlock(&log_mutex);
+    stat_line(buf, cap, &len, "log.next_seq=%llu", (unsigned long long)seq);
+    stat_line(buf, cap, &len, "log.segments=%d", nsegs);
+    stat_line(buf, cap, &len, "log.backfills=%lu", atomic_load(&backfills));
+    stat_line(buf, cap, &len, "log.backfill_bytes=%lu", atomic_load(&backfill_bytes));
+    stat_line(buf, cap, &len, "log.backfill_held=%lu", atomic_load(&backfill_held));
+    stat_line(buf, cap, &len, "log.backfill_overflows=%lu", atomic_load(&backfill_overflows));
+    pthread_mutex_lock(&log_mutex);
+    size_t edited = edit_map_count;
+    pthread_mutex_unlock(&log_mutex);
+    stat_line(buf, cap, &len, "history.edits=%lu", atomic_load(&history_edits));
+    stat_line(buf, cap, &len, "history.deletes=%lu", atomic_load(&history_deletes));
+    stat_line(buf, cap, &len, "history.edited_tracked=%zu", edited);
+    stat_line(buf, cap, &len, "history.ring_hits=%lu", atomic_load(&history_ring_hits));
+    stat_line(buf, cap, &len, "history.disk_lookups=%lu", atomic_load(&history_disk_lookups));
+    latency_stats(buf, cap, &len, "history.query_us", &history_latency);
+    uint64_t raw = atomic_load(&cold_raw_bytes), stored = atomic_load(&cold_file_bytes);
+    stat_line(buf, cap, &len, "cold.segments=%lu", atomic_load(&cold_segments));
+    stat_line(buf, cap, &len, "cold.raw_bytes=%llu", (unsigned long long)raw);
+    stat_line(buf, cap, &len, "cold.file_bytes=%llu", (unsigned long long)stored);
+    stat_line(buf, cap, &len, "cold.ratio=%.2f", stored ? (double)raw / stored : 0.0);
+    stat_line(buf, cap, &len, "cold.block_reads=%lu", atomic_load(&cold_block_reads));
+    stat_line(buf, cap, &len, "cold.cache_hits=%lu", atomic_load(&cold_cache_hits));
+    latency_stats(buf, cap, &len, "log.read_us", &hot_read_latency);
+    latency_stats(buf, cap, &len, "cold.read_us", &cold_read_latency);
+    stat_line(buf, cap, &len, "blob.uploads=%lu", atomic_load(&blob_uploads));
+    stat_line(buf, cap, &len, "blob.bytes_in=%lu", atomic_load(&blob_bytes_in));
+    stat_line(buf, cap, &len, "blob.downloads=%lu", atomic_load(&blob_downloads));
+    stat_line(buf, cap, &len, "blob.bytes_out=%lu", atomic_load(&blob_bytes_out));
+    pthread_mutex_lock(&mention_mutex);
+    int live = mention_ac.npatterns - mention_ac.dead, nodes = mention_ac.nnodes;
+    pthread_mutex_unlock(&mention_mutex);
+    stat_line(buf, cap, &len, "mentions.users=%d", mentions_enabled ? live : 0);
+    stat_line(buf, cap, &len, "mentions.nodes=%d", mentions_enabled ? nodes : 0);
+    stat_line(buf, cap, &len, "mentions.sent=%lu", atomic_load(&mentions_sent));
+    stat_line(buf, cap, &len, "mentions.rebuilds=%lu", atomic_load(&mention_rebuilds));
+    stat_line(buf, cap, &len, "filter.terms=%d", atomic_load(&filter_terms));
+    stat_line(buf, cap, &len, "filter.masked=%lu", atomic_load(&filter_masked));
+    stat_line(buf, cap, &len, "filter.dropped=%lu", atomic_load(&filter_dropped));
+    stat_line(buf, cap, &len, "filter.reloads=%lu", atomic_load(&filter_reloads));
+    pthread_mutex_lock(&ip_mutex);
+    int tracked = ip_tracked;
+    pthread_mutex_unlock(&ip_mutex);
+    stat_line(buf, cap, &len, "conn.max_per_ip=%d", max_per_ip);
+    stat_line(buf, cap, &len, "conn.addresses=%d", tracked);
+    stat_line(buf, cap, &len, "conn.limited=%lu", atomic_load(&conn_limited));
+    stat_line(buf, cap, &len, "conn.blocked=%lu", atomic_load(&conn_blocked));
+    stat_line(buf, cap, &len, "blocklist.prefixes=%d", atomic_load(&blocklist_prefixes));
+    stat_line(buf, cap, &len, "blocklist.reloads=%lu", atomic_load(&blocklist_reloads));
+    pthread_mutex_lock(&auth_mutex);
+    int queued = auth_queued;
+    pthread_mutex_unlock(&auth_mutex);
+    stat_line(buf, cap, &len, "auth.workers=%d", auth_workers);
+    stat_line(buf, cap, &len, "auth.accounts=%d", num_accounts);
+    pthread_rwlock_rdlock(&store_lock);
+    uint32_t store_used = store_map ? store_map->used : 0, store_cap = store_map ? store_map->capacity : 0;
+    pthread_rwlock_unlock(&store_lock);
+    stat_line(buf, cap, &len, "auth.store_accounts=%u", store_used);
+    stat_line(buf, cap, &len, "auth.store_slots=%u", store_cap);
+    stat_line(buf, cap, &len, "auth.store_remaps=%lu", atomic_load(&store_remaps));
+    stat_line(buf, cap, &len, "auth.queued=%d", queued);
+    stat_line(buf, cap, &len, "auth.ok=%lu", atomic_load(&auth_ok));
+    stat_line(buf, cap, &len, "auth.failed=%lu", atomic_load(&auth_failed));
+    stat_line(buf, cap, &len, "auth.busy=%lu", atomic_load(&auth_busy));
+    stat_line(buf, cap, &len, "presence.updates=%lu", atomic_load(&presence_updates));
+    stat_line(buf, cap, &len, "presence.entries=%lu", atomic_load(&presence_entries));
+    stat_line(buf, cap, &len, "presence.deltas=%lu", atomic_load(&presence_deltas));
+    stat_line(buf, cap, &len, "search.records=%lu", atomic_load(&search_records));
+    stat_line(buf, cap, &len, "search.terms=%lu", atomic_load(&search_terms));
+    stat_line(buf, cap, &len, "search.posting_bytes=%lu", atomic_load(&search_bytes));
+    latency_stats(buf, cap, &len, "search.query_us", &search_latency);
+    pthread_mutex_lock(&react_mutex);
+    size_t reacted = react_count;
+    pthread_mutex_unlock(&react_mutex);
+    stat_line(buf, cap, &len, "react.received=%lu", atomic_load(&react_received));
+    stat_line(buf, cap, &len, "react.messages=%zu", reacted);
+    stat_line(buf, cap, &len, "react.updates=%lu", atomic_load(&react_updates));
+    stat_line(buf, cap, &len, "dedup.checked=%lu", atomic_load(&dedup_checked));
+    stat_line(buf, cap, &len, "dedup.dropped=%lu", atomic_load(&dedup_dropped));
+    stat_line(buf, cap, &len, "dedup.evictions=%lu", atomic_load(&dedup_evictions));
+    ack_stats(buf, cap, &len);
+    stat_line(buf, cap, &len, "dm.live=%lu", atomic_load(&dm_live));
+    stat_line(buf, cap, &len, "dm.stored=%lu", atomic_load(&dm_stored));
+    stat_line(buf, cap, &len, "dm.delivered=%lu", atomic_load(&dm_delivered));
+    stat_line(buf, cap, &len, "dm.rejected=%lu", atomic_load(&dm_rejected));
+    stat_line(buf, cap, &len, "dm.mailbox_bytes=%ld", atomic_load(&mailbox_bytes));
+    stat_line(buf, cap, &len, "spam.threshold=%d", spam_threshold);
+    stat_line(buf, cap, &len, "spam.dropped=%lu", atomic_load(&spam_dropped));
+    stat_line(buf, cap, &len, "spam.throttled=%lu", atomic_load(&spam_throttled));
+    if (spam_threshold > 0) {
+        pthread_mutex_lock(&spam_mutex);
+        heavy_hitter_t texts[TOP_K], senders[TOP_K];
+        memcpy(texts, spam_texts.top, sizeof(texts));
+        memcpy(senders, spam_senders.top, sizeof(senders));
+        pthread_mutex_unlock(&spam_mutex);
+        top_k_stats(buf, cap, &len, "spam.top_text", texts);
+        top_k_stats(buf, cap, &len, "spam.top_sender", senders);
     }
-    return NULL;
+    stat_line(buf, cap, &len, "batch.budget_us=%d", batch_budget_usec);
+    stat_line(buf, cap, &len, "batch.count=%lu", atomic_load(&batches));
+    stat_line(buf, cap, &len, "batch.frames=%lu", atomic_load(&batched_frames));
+    stat_line(buf, cap, &len, "batch.waited=%lu", atomic_load(&batches_waited));
+    unsigned depth = 0;
+    for (int i = 0; i < num_shards; i++) depth += shards[i]->depth_ewma;
+    stat_line(buf, cap, &len, "batch.depth_avg=%.2f", depth / 16.0 / num_shards);
+    for (int i = 0; i < num_shards; i++) {
+        pool_stats(buf, cap, &len, &shards[i]->frame_pool);
+        pool_stats(buf, cap, &len, &shards[i]->msg_pool);
+    }
+    stat_line(buf, size, &len, "END");
+    return len;
 }
 
 /**
@@ -277,7 +7119,9 @@ void *dispatcher_thread(void *arg) {
 void *client_thread(void *arg) {
     client_t *c = (client_t *)arg;
     char buf[MAX_MESSAGE + 64];
-    ssize_t n;
+
+    // Messages from this thread come out of the shard's pool and go to its queue
+    thread_shard = c->shard;
 
 // ------------ PASSWORD PHASE WITH RETRIES -------------- //
 
@@ -305,11 +7149,17 @@ void *client_thread(void *arg) {
         // Extract password text after PASS:
         const char *pw = buf + 5;
 
-        // Check password
-        if (strcmp(pw, SERVER_PASSWORD) == 0) {
+        // Check password (hashed on the auth workers)
+        int ok = auth_verify(&server_cred, pw);
+        if (ok == 1) {
             send_all(c->sockfd, "OKPASS\n", 7);
             break;  // SUCCESS
         }
+        if (ok < 0) {
+            attempts++;
+            send_all(c->sockfd, "ERR:Server busy\n", 16);
+            continue;
+        }
 
         // Wrong password
         attempts++;
@@ -359,22 +7209,26 @@ void *client_thread(void *arg) {
 */
     
 
-    // Expect LOGIN:<username>\n
-    n = recv(c->sockfd, buf, sizeof(buf)-1, 0); // What the user types
-    if (n <= 0) {
+    // Everything after the password phase is read through a buffered reader
+    line_reader_t *rd = calloc(1, sizeof(line_reader_t));
+    if (!rd) {
         close_and_free_client(c);
         return NULL;
     }
-    buf[n] = '\0';
+    rd->fd = c->sockfd;
 
-    // Trim newline for fair comparison
-    char *newline = strchr(buf, '\n');
-    if (newline) *newline = '\0';
+    // Expect LOGIN:<username>\n
+    if (reader_line(rd, buf, sizeof(buf)) < 0) { // What the user types
+        free(rd);
+        close_and_free_client(c);
+        return NULL;
+    }
 
     // Validate LOGIN format
     if (strncmp(buf, "LOGIN:", 6) != 0) {
         const char *err = "ERR:Invalid login. Send LOGIN:<username>\\n\n";
         send_all(c->sockfd, err, strlen(err));
+        free(rd);
         close_and_free_client(c);
         return NULL;
     }
@@ -382,83 +7236,168 @@ void *client_thread(void *arg) {
     // Username buffer
     char uname[MAX_USERNAME]; 
 
+    // LOGIN:<username>:<password> for accounts; the password is never part of the name
+    char *upw = strchr(buf + 6, ':');
+    if (upw) *upw++ = '\0';
+
     // Check username validity
     strncpy(uname, buf + 6, MAX_USERNAME-1);
     uname[MAX_USERNAME-1] = '\0';
     if (strlen(uname) == 0) {
         const char *err = "ERR:Empty username\n";
         send_all(c->sockfd, err, strlen(err));
+        free(rd);
         close_and_free_client(c);
         return NULL;
     }
+    if (!username_valid(uname)) {
+        const char *err = "ERR:Invalid username\n";
+        send_all(c->sockfd, err, strlen(err));
+        free(rd);
+        close_and_free_client(c);
+        return NULL;
+    }
+
+    // With accounts configured every user needs an account and its password
+    if (accounts_path[0] || store_path[0]) {
+        account_t acct;
+        int found = account_find(uname, &acct) == 0;
+        // Unknown names are hashed too, so timing does not reveal which accounts exist
+        int ok = auth_verify(found ? &acct.cred : &server_cred, upw ? upw : "");
+        if (ok != 1 || !found) {
+            const char *err = ok < 0 ? "ERR:Server busy\n" : "ERR:Bad username or password\n";
+            send_all(c->sockfd, err, strlen(err));
+            free(rd);
+            close_and_free_client(c);
+            return NULL;
+        }
+    }
 
     // Check to see if the username is already taken
     if (username_taken(uname)) {
         const char *err = "ERR:Username taken\n";
         send_all(c->sockfd, err, strlen(err));
+        free(rd);
         close_and_free_client(c);
         return NULL;
     }
     
     // Accept login
     strncpy(c->username, uname, MAX_USERNAME-1);
-    c->logged_in = 1;
-    send_all(c->sockfd, "OK\n", 3);
+    if (client_go_live(c) < 0) {
+        free(rd);
+        close_and_free_client(c);
+        return NULL;
+    }
+    mailbox_deliver(c);
+    presence_snapshot(c);
+    client_release_held(c);
+    mention_add(c->username);
 
     // Announce join
     char joinmsg[MAX_MESSAGE];
     snprintf(joinmsg, sizeof(joinmsg), "*** %s has joined the chat ***", c->username);
-    enqueue_message("Server", joinmsg);
+    enqueue_message("Server", joinmsg, 1);
 
     // Receive loop //
-    char recvbuf[MAX_MESSAGE+1]; // Buffer for receiving messages
-    size_t offset = 0;
+    char line[MAX_MESSAGE+1]; // Buffer for a single line
     while (server_running) {
-        n = recv(c->sockfd, recvbuf, sizeof(recvbuf)-1, 0);
-        if (n <= 0) break; // If error or disconnect
-        recvbuf[n] = '\0';
-
-        // Line processing. Clients should send complete lines ending with \n
-        char *p = recvbuf;
-        // Process each line
-        while (p && *p) {
-            char *nl = strchr(p, '\n'); // Find newline with strchr, which returns pointer to first occurrence
-            char line[MAX_MESSAGE+1]; // Buffer for a single line
-
-            // Extract line
-            if (nl) {
-                size_t len = nl - p;
-                if (len > MAX_MESSAGE-1) len = MAX_MESSAGE-1;
-                memcpy(line, p, len);
-                line[len] = '\0';
-                p = nl + 1;
-            } else { // No newline found, take the rest
-                strncpy(line, p, MAX_MESSAGE-1);
-                line[MAX_MESSAGE-1] = '\0';
-                p += strlen(p);
-            }
-
-            // Process commands in the line sent by the client
-            if (strncmp(line, "MSG:", 4) == 0) {
-                enqueue_message(c->username, line + 4);
-            } else if (strcmp(line, "QUIT") == 0) {
-                goto disconnect;
+        // Clients should send complete lines ending with \n; longer lines are truncated
+        if (reader_line(rd, line, MAX_MESSAGE) < 0) break; // If error or disconnect
+
+        // Process commands in the line sent by the client
+        if (strncmp(line, "MSG:", 4) == 0) {
+            if (enqueue_message(c->username, line + 4, 0) == 1) {
+                const char *err = "ERR:Message dropped as spam\n";
+                client_send(c, err, strlen(err));
+            }
+        } else if (strncmp(line, "MSGID:", 6) == 0) {
+            // MSGID:<id>:<text>, confirmed with OKMSG:<id> whether new or a resend
+            char *text = strchr(line + 6, ':');
+            char reply[MAX_MESSAGE + 16];
+            if (!text || text == line + 6 || text - (line + 6) > DEDUP_ID_MAX) {
+                snprintf(reply, sizeof(reply), "ERR:Usage MSGID:<id>:<text> (id at most %d bytes)\n", DEDUP_ID_MAX);
             } else {
-                // Unknown command, ignore or inform
-                const char *err = "ERR:Unknown command\n";
-                send_all(c->sockfd, err, strlen(err));
+                *text++ = '\0';
+                int rc = dedup_seen(c->username, line + 6) ? 0 : enqueue_message(c->username, text, 0);
+                if (rc == 0) dedup_record(c->username, line + 6);
+                if (rc == 1) snprintf(reply, sizeof(reply), "ERR:Message dropped as spam\n");
+                else if (rc < 0) snprintf(reply, sizeof(reply), "ERR:Out of memory\n");
+                else snprintf(reply, sizeof(reply), "OKMSG:%s\n", line + 6);
             }
+            client_send(c, reply, strlen(reply));
+        } else if (strcmp(line, "QUIT") == 0) {
+            goto disconnect;
+        } else if (strcmp(line, "STATS") == 0) {
+            char stats[STATS_BUF];
+            size_t len = format_stats(stats, sizeof(stats));
+            client_send(c, stats, len);
+        } else if (strncmp(line, "BLOB:", 5) == 0) {
+            if (receive_blob(c, rd, line + 5) < 0) goto disconnect;
+        } else if (strncmp(line, "GET:", 4) == 0) {
+            send_blob(c, line + 4);
+        } else if (strncmp(line, "DM:", 3) == 0) {
+            send_dm(c, line + 3);
+        } else if (strncmp(line, "EDIT:", 5) == 0) {
+            edit_command(c, line + 5, 0);
+        } else if (strncmp(line, "DELETE:", 7) == 0) {
+            edit_command(c, line + 7, 1);
+        } else if (strcmp(line, "HISTORY") == 0 || strncmp(line, "HISTORY:", 8) == 0) {
+            history_command(c, line[7] ? line + 8 : "");
+        } else if (strncmp(line, "SEARCH:", 7) == 0) {
+            search_command(c, line + 7);
+        } else if (strncmp(line, "REACT:", 6) == 0) {
+            react_command(c, line + 6);
+        } else if (strcmp(line, "TYPING") == 0 || strncmp(line, "TYPING:", 7) == 0 || strncmp(line, "STATUS:", 7) == 0) {
+            presence_command(c, line);
+        } else if (strncmp(line, "ACK:", 4) == 0) {
+            ack_receive(c, strtoull(line + 4, NULL, 10));
+        } else if (strncasecmp(line, "ACKS:", 5) == 0) {
+            int on = strcasecmp(line + 5, "on") == 0;
+            const char *reply = ack_set_mode(c, on) < 0 ? "ERR:Out of memory\n" : on ? "OKACKS:ON\n" : "OKACKS:OFF\n";
+            client_send(c, reply, strlen(reply));
+        } else {
+            // Unknown command, ignore or inform
+            const char *err = "ERR:Unknown command\n";
+            client_send(c, err, strlen(err));
         }
     }
 
 disconnect:
+    free(rd);
+    mention_remove(c->username);
     // Announce leave
     snprintf(joinmsg, sizeof(joinmsg), "*** %s has left the chat ***", c->username);
-    enqueue_message("Server", joinmsg);
+    enqueue_message("Server", joinmsg, 1);
     close_and_free_client(c);
     return NULL;
 }
 
+/**
+ * @brief Reload thread: reloads hot-reloadable configuration on SIGHUP.
+ * 
+ * @details SIGHUP is blocked in every thread and collected here with
+ * sigwait(), so reloads run in normal thread context rather than in a signal
+ * handler.
+ * 
+ * @param arg Unused parameter.
+ */
+void *reload_thread(void *arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) continue;
+        if (!server_running) break;
+        filter_reload();
+        blocklist_reload();
+        store_reload(1);
+    }
+    return NULL;
+}
+
 /**
  * @brief Signal handler for SIGINT to gracefully shut down the server.
  * 
@@ -467,28 +7406,831 @@ disconnect:
 void sigint_handler(int sig) {
     (void)sig;
     server_running = 0;
-    if (server_sock >= 0) close(server_sock);
-    // Wake dispatcher if waiting
-    pthread_mutex_lock(&msg_mutex);
-    pthread_cond_signal(&msg_cond);
-    pthread_mutex_unlock(&msg_mutex);
+    for (int i = 0; i < num_shards; i++) {
+        // Unblocks the shard's accept(); the fd is closed once the acceptor has returned
+        if (shards[i]->listen_fd >= 0) shutdown(shards[i]->listen_fd, SHUT_RDWR);
+        // Wake the dispatcher if waiting
+        pthread_mutex_lock(&shards[i]->msg_mutex);
+        pthread_cond_signal(&shards[i]->msg_cond);
+        pthread_mutex_unlock(&shards[i]->msg_mutex);
+    }
 }
 
-int main(int argc, char **argv) {
-    int port = DEFAULT_PORT;
-    if (argc >= 2) port = atoi(argv[1]);
+/**
+ * @brief Returns the value of a "--name=value" argument.
+ * 
+ * @param arg The command line argument.
+ * @param name The option name including the leading dashes.
+ * 
+ * @return const char* The text after '=', "" for a bare "--name", or NULL if arg is a different option.
+ */
+const char *option_value(const char *arg, const char *name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0) return NULL;
+    if (arg[len] == '\0') return "";
+    if (arg[len] == '=') return arg + len + 1;
+    return NULL;
+}
 
-    signal(SIGINT, sigint_handler);
-    signal(SIGPIPE, SIG_IGN);
+/**
+ * @brief Appends bytes to an export column.
+ * 
+ * @return int 0 on success, -1 if allocation failed.
+ */
+int export_put(export_buf_t *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) cap *= 2;
+        unsigned char *grown = realloc(b->data, cap);
+        if (!grown) return -1;
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+/**
+ * @brief Appends a varint (7 bits per byte, low bits first) to an export column.
+ * 
+ * @return int 0 on success, -1 if allocation failed.
+ */
+int export_varint(export_buf_t *b, uint64_t v) {
+    unsigned char tmp[10];
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7) tmp[n++] = (unsigned char)(v & 0x7f) | 0x80;
+    tmp[n++] = (unsigned char)v;
+    return export_put(b, tmp, n);
+}
+
+/**
+ * @brief Reads a varint from an export column.
+ * 
+ * @param b The column.
+ * @param pos Read position, advanced past the varint.
+ * @param v Output: the value.
+ * @return int 0 on success, -1 if the column ends first.
+ */
+int export_get_varint(const export_buf_t *b, size_t *pos, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*pos >= b->len) return -1;
+        unsigned char c = b->data[(*pos)++];
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Compresses the pending text block and appends it to the export file.
+ * 
+ * @param fd The export file.
+ * @param raw The block's text.
+ * @param len Its length.
+ * @param at File offset of the block, advanced past it.
+ * @param blocks The block index, extended by one entry.
+ * @param check Text checksum, updated with the block.
+ * @return int 0 on success, -1 on error.
+ */
+int export_flush_text(int fd, const unsigned char *raw, size_t len, uint64_t *at, export_buf_t *blocks, uint64_t *check) {
+    static unsigned char comp[COLD_BLOCK + COLD_BLOCK / 255 + 64];
+    size_t cl = lz_compress(raw, len, comp, sizeof(comp));
+    if (cl == 0 || cl >= len) cl = len; // incompressible: store as is
+    cold_block_t blk = { .offset = *at, .comp_len = (uint32_t)cl, .raw_len = (uint32_t)len };
+    if (write_all(fd, cl == len ? raw : comp, cl) < 0 || export_put(blocks, &blk, sizeof(blk)) < 0) return -1;
+    *at += cl;
+    *check = *check * 31 + hash_bytes(raw, len);
+    return 0;
+}
+
+/**
+ * @brief --export mode: converts the message log into a columnar file and exits.
+ * 
+ * @details Messages are read the way HISTORY reads them: with their latest
+ * edit applied, deleted ones left out, and deltas folded in rather than
+ * exported. The log is opened read-only, so this can run next to a live
+ * server; it exports what was logged when it started. The file is written
+ * beside the target and renamed into place when complete.
+ * 
+ * @return int Exit status.
+ */
+int export_main(void) {
+    char tmp[MAX_LOG_PATH + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", export_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(tmp);
+        return 1;
+    }
+
+    export_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, EXPORT_MAGIC, 8);
+    export_buf_t col[EXPORT_SECTIONS];
+    memset(col, 0, sizeof(col));
+    int ok = write_all(fd, &h, sizeof(h)) == 0;
+
+    // Senders are few, so a small open-addressing table maps names to dictionary ids
+    uint32_t nslots = 1024, *slots = calloc(nslots, sizeof(uint32_t)); // id + 1 (0 = empty)
+    char (*names)[MAX_USERNAME] = NULL;
+    unsigned char *raw = malloc(COLD_BLOCK);
+    size_t raw_len = 0;
+    uint64_t at = sizeof(h), prev_seq = 0, text_bytes = 0;
+    int64_t prev_ts = 0;
+    char line[2 * FRAME_CAP];
+    ok = ok && slots && raw;
+
+    pthread_mutex_lock(&log_mutex);
+    uint64_t first = history_first_seq(), end = next_seq;
+    pthread_mutex_unlock(&log_mutex);
+    for (uint64_t seq = first; ok && seq < end; seq++) {
+        log_record_t rec;
+        uint32_t state;
+        ssize_t len = history_read(seq, line, &rec, &state);
+        if (len < 0 || rec.flags != 0 || (state & HIST_DELETED)) continue;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+
+        // "user: text"; server notices have no author
+        char *colon = memchr(line, ':', len);
+        size_t ulen = colon && colon - line < MAX_USERNAME ? (size_t)(colon - line) : 0;
+        const char *text = ulen ? colon + 1 : line;
+        if (ulen && text < line + len && *text == ' ') text++;
+        size_t tlen = line + len - text;
+
+        uint64_t hv = hash_bytes(line, ulen);
+        uint32_t slot = (uint32_t)hv & (nslots - 1);
+        while (slots[slot] && (strlen(names[slots[slot] - 1]) != ulen || memcmp(names[slots[slot] - 1], line, ulen) != 0)) {
+            slot = (slot + 1) & (nslots - 1);
+        }
+        if (!slots[slot]) {
+            if ((h.nsenders + 1) * 2 > nslots) { // keep the table at most half full
+                uint32_t *grown = calloc(nslots * 2, sizeof(uint32_t));
+                if (!grown) {
+                    ok = 0;
+                    break;
+                }
+                for (uint32_t i = 0; i < h.nsenders; i++) {
+                    uint32_t j = (uint32_t)hash_bytes(names[i], strlen(names[i])) & (nslots * 2 - 1);
+                    while (grown[j]) j = (j + 1) & (nslots * 2 - 1);
+                    grown[j] = i + 1;
+                }
+                free(slots);
+                slots = grown;
+                nslots *= 2;
+                slot = (uint32_t)hv & (nslots - 1);
+                while (slots[slot]) slot = (slot + 1) & (nslots - 1);
+            }
+            char (*grown)[MAX_USERNAME] = realloc(names, (h.nsenders + 1) * sizeof(*names));
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            names = grown;
+            memcpy(names[h.nsenders], line, ulen);
+            names[h.nsenders][ulen] = '\0';
+            unsigned char nlen = (unsigned char)ulen;
+            ok = export_put(&col[EXPORT_DICT], &nlen, 1) == 0 && export_put(&col[EXPORT_DICT], line, ulen) == 0;
+            slots[slot] = ++h.nsenders;
+        }
+
+        int64_t dts = rec.ts_usec - prev_ts;
+        unsigned char st = (unsigned char)state;
+        ok = ok && export_varint(&col[EXPORT_SEQ], seq - prev_seq) == 0 &&
+             export_varint(&col[EXPORT_TS], ((uint64_t)dts << 1) ^ (uint64_t)(dts >> 63)) == 0 &&
+             export_varint(&col[EXPORT_SENDER], slots[slot] - 1) == 0 && export_put(&col[EXPORT_STATE], &st, 1) == 0 &&
+             export_varint(&col[EXPORT_TEXT_LEN], tlen) == 0;
+        prev_seq = seq;
+        prev_ts = rec.ts_usec;
+        h.rows++;
+        text_bytes += tlen;
+
+        // Texts run on from one block into the next
+        while (ok && tlen > 0) {
+            size_t n = COLD_BLOCK - raw_len < tlen ? COLD_BLOCK - raw_len : tlen;
+            memcpy(raw + raw_len, text, n);
+            raw_len += n;
+            text += n;
+            tlen -= n;
+            if (raw_len == COLD_BLOCK) {
+                ok = export_flush_text(fd, raw, raw_len, &at, &col[EXPORT_BLOCKS], &h.check[EXPORT_TEXT]) == 0;
+                raw_len = 0;
+            }
+        }
+    }
+    if (ok && raw_len > 0) ok = export_flush_text(fd, raw, raw_len, &at, &col[EXPORT_BLOCKS], &h.check[EXPORT_TEXT]) == 0;
+    h.offset[EXPORT_TEXT] = sizeof(h);
+    h.length[EXPORT_TEXT] = at - sizeof(h);
+    h.nblocks = (uint32_t)(col[EXPORT_BLOCKS].len / sizeof(cold_block_t));
+
+    for (int i = EXPORT_TEXT + 1; ok && i < EXPORT_SECTIONS; i++) {
+        h.offset[i] = at;
+        h.length[i] = col[i].len;
+        h.check[i] = hash_bytes(col[i].data, col[i].len);
+        ok = col[i].len == 0 || write_all(fd, col[i].data, col[i].len) == 0;
+        at += col[i].len;
+    }
+    ok = ok && pwrite(fd, &h, sizeof(h), 0) == sizeof(h) && fsync(fd) == 0;
+    for (int i = 0; i < EXPORT_SECTIONS; i++) free(col[i].data);
+    free(slots);
+    free(names);
+    free(raw);
+    if (close(fd) < 0 || !ok || rename(tmp, export_path) < 0) {
+        perror(export_path);
+        unlink(tmp);
+        return 1;
+    }
+    printf("Exported %llu messages from %u senders to %s (%llu bytes; text %llu bytes compressed to %llu)\n",
+           (unsigned long long)h.rows, h.nsenders, export_path, (unsigned long long)at, (unsigned long long)text_bytes,
+           (unsigned long long)h.length[EXPORT_TEXT]);
+    return 0;
+}
+
+/**
+ * @brief --read-export mode: checks a columnar file and prints its rows.
+ * 
+ * @details Rows are printed as they are decoded, as
+ * "seq<TAB>ts_usec<TAB>sender<TAB>state<TAB>text", one per line. Every
+ * column is checked against its checksum and the others (row counts, sender
+ * ids, block lengths, text lengths against the text column); the exit status
+ * and a summary on stderr say whether the whole file checked out. This is
+ * the reference reader for the format.
+ * 
+ * @return int Exit status: 0 if the file is valid.
+ */
+int read_export_main(void) {
+    int fd = open(read_export_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(read_export_path);
+        return 1;
+    }
+    const char *err = NULL;
+    export_header_t h;
+    export_buf_t col[EXPORT_SECTIONS];
+    memset(col, 0, sizeof(col));
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, EXPORT_MAGIC, 8) != 0) err = "not an export file";
+    for (int i = 0; !err && i < EXPORT_SECTIONS; i++) {
+        if (h.offset[i] > (uint64_t)st.st_size || h.length[i] > (uint64_t)st.st_size - h.offset[i]) {
+            err = "section outside the file";
+        } else if (i != EXPORT_TEXT) { // text is read block by block
+            col[i].len = col[i].cap = h.length[i];
+            col[i].data = malloc(h.length[i] ? h.length[i] : 1);
+            if (!col[i].data || pread(fd, col[i].data, h.length[i], h.offset[i]) != (ssize_t)h.length[i]) err = "read error";
+            else if (hash_bytes(col[i].data, col[i].len) != h.check[i]) err = "column checksum mismatch";
+        }
+    }
+    if (!err && (col[EXPORT_STATE].len != h.rows || col[EXPORT_BLOCKS].len != (uint64_t)h.nblocks * sizeof(cold_block_t))) {
+        err = "column sizes do not match the header";
+    }
+
+    // Sender dictionary
+    char (*names)[MAX_USERNAME] = err ? NULL : calloc(h.nsenders ? h.nsenders : 1, MAX_USERNAME);
+    size_t pos = 0;
+    if (!err && !names) err = "out of memory";
+    for (uint32_t i = 0; !err && i < h.nsenders; i++) {
+        size_t n = pos < col[EXPORT_DICT].len ? col[EXPORT_DICT].data[pos++] : MAX_USERNAME;
+        if (n >= MAX_USERNAME || n > col[EXPORT_DICT].len - pos) err = "bad sender dictionary";
+        else memcpy(names[i], col[EXPORT_DICT].data + pos, n);
+        pos += n;
+    }
+
+    // Rows, decompressing text blocks as the rows reach them
+    const cold_block_t *blocks = (const cold_block_t *)col[EXPORT_BLOCKS].data;
+    unsigned char *block = malloc(COLD_BLOCK), *comp = malloc(COLD_BLOCK), text[FRAME_CAP];
+    size_t spos = 0, tpos = 0, lpos = 0, bpos = 0, boff = 0, blen = 0; // blen - boff bytes of block are unread
+    uint32_t next_block = 0;
+    uint64_t seq = 0, text_bytes = 0, check = 0;
+    int64_t ts = 0;
+    if (!err && (!block || !comp)) err = "out of memory";
+    for (uint64_t r = 0; !err && r < h.rows; r++) {
+        uint64_t gap, dts, sender, tlen;
+        if (export_get_varint(&col[EXPORT_SEQ], &spos, &gap) < 0 || export_get_varint(&col[EXPORT_TS], &tpos, &dts) < 0 ||
+            export_get_varint(&col[EXPORT_SENDER], &lpos, &sender) < 0 ||
+            export_get_varint(&col[EXPORT_TEXT_LEN], &bpos, &tlen) < 0) {
+            err = "column ends early";
+            break;
+        }
+        if (gap == 0 || sender >= h.nsenders || tlen > MAX_MESSAGE) {
+            err = "bad row";
+            break;
+        }
+        seq += gap;
+        ts += (int64_t)(dts >> 1) ^ -(int64_t)(dts & 1);
+
+        for (size_t got = 0; got < tlen;) {
+            if (boff == blen) {
+                if (next_block >= h.nblocks) {
+                    err = "text column ends early";
+                    break;
+                }
+                const cold_block_t *b = &blocks[next_block++];
+                if (b->raw_len == 0 || b->raw_len > COLD_BLOCK || b->comp_len > b->raw_len ||
+                    pread(fd, comp, b->comp_len, b->offset) != (ssize_t)b->comp_len) {
+                    err = "bad text block";
+                    break;
+                }
+                if (b->comp_len == b->raw_len) memcpy(block, comp, b->raw_len);
+                else if (lz_decompress(comp, b->comp_len, block, COLD_BLOCK) != (ssize_t)b->raw_len) {
+                    err = "corrupt text block";
+                    break;
+                }
+                blen = b->raw_len;
+                boff = 0;
+                check = check * 31 + hash_bytes(block, blen);
+            }
+            size_t n = blen - boff < tlen - got ? blen - boff : tlen - got;
+            memcpy(text + got, block + boff, n);
+            boff += n;
+            got += n;
+        }
+        if (err) break;
+        text_bytes += tlen;
+        printf("%llu\t%lld\t%s\t%u\t%.*s\n", (unsigned long long)seq, (long long)ts, names[sender],
+               col[EXPORT_STATE].data[r], (int)tlen, text);
+    }
+    if (!err && (spos != col[EXPORT_SEQ].len || tpos != col[EXPORT_TS].len || lpos != col[EXPORT_SENDER].len ||
+                 bpos != col[EXPORT_TEXT_LEN].len || boff != blen || next_block != h.nblocks)) {
+        err = "trailing data in a column";
+    } else if (!err && check != h.check[EXPORT_TEXT]) {
+        err = "text checksum mismatch";
+    }
+
+    for (int i = 0; i < EXPORT_SECTIONS; i++) free(col[i].data);
+    free(names);
+    free(block);
+    free(comp);
+    close(fd);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", read_export_path, err);
+        return 1;
+    }
+    fprintf(stderr, "%s: %llu rows, %u senders, %u text blocks (%llu bytes of text), ok\n", read_export_path,
+            (unsigned long long)h.rows, h.nsenders, h.nblocks, (unsigned long long)text_bytes);
+    return 0;
+}
+
+/**
+ * @brief Reports one self-test check.
+ * 
+ * @param what What was checked.
+ * @param ok Non-zero if it passed.
+ * @return int 0 if it passed, 1 otherwise (summed into the failure count).
+ */
+int self_check(const char *what, int ok) {
+    printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+    return !ok;
+}
+
+/**
+ * @brief Compares a digest against a hex string.
+ */
+static int digest_is(const unsigned char *digest, const char *hex) {
+    unsigned char want[32];
+    return hex_decode(hex, 64, want) == 0 && memcmp(digest, want, 32) == 0;
+}
+
+/**
+ * @brief Counts Aho-Corasick hits for the self-test (arg: int[2] of hits and end offsets summed).
+ */
+static int self_test_hit(int pattern, size_t end, void *arg) {
+    int *acc = arg;
+    acc[0]++;
+    acc[1] += (int)end * (pattern + 1);
+    return 0;
+}
+
+/**
+ * @brief --self-test mode: checks the self-contained building blocks and exits.
+ * 
+ * @details Covers the block compressor, SHA-256 and PBKDF2 (against the
+ * published test vectors), the Aho-Corasick automaton, the count-min sketch
+ * and its top-k table, the IPv4 radix trie, varint posting lists, and an
+ * export round trip: a few messages are logged to a scratch directory,
+ * exported, and read back by read_export_main(). The scratch directory is
+ * removed afterwards.
+ * 
+ * @return int Exit status: 0 if every check passed.
+ */
+int self_test_main(void) {
+    int fails = 0;
+
+    // Block compressor: repetitive, incompressible and empty input
+    unsigned char *raw = malloc(COLD_BLOCK), *comp = malloc(COLD_BLOCK), *back = malloc(COLD_BLOCK);
+    if (!raw || !comp || !back) {
+        perror("malloc");
+        return 1;
+    }
+    size_t n = 0;
+    for (int i = 0; n + 64 < COLD_BLOCK; i++) n += snprintf((char *)raw + n, 64, "alice: message %d, again and again\n", i % 97);
+    size_t cl = lz_compress(raw, n, comp, COLD_BLOCK);
+    fails += self_check("lz: text compresses", cl > 0 && cl < n / 2);
+    fails += self_check("lz: text round trip", lz_decompress(comp, cl, back, COLD_BLOCK) == (ssize_t)n && memcmp(raw, back, n) == 0);
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < 4096; i++) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        raw[i] = (unsigned char)x;
+    }
+    cl = lz_compress(raw, 4096, comp, COLD_BLOCK);
+    fails += self_check("lz: random round trip", cl > 0 && lz_decompress(comp, cl, back, COLD_BLOCK) == 4096 && memcmp(raw, back, 4096) == 0);
+    fails += self_check("lz: output too small", lz_compress(raw, 4096, comp, 64) == 0);
+    cl = lz_compress(raw, 0, comp, COLD_BLOCK);
+    fails += self_check("lz: empty round trip", cl > 0 && lz_decompress(comp, cl, back, COLD_BLOCK) == 0);
+    comp[0] = 0x00; // a match reaching back before the start of the block
+    comp[1] = 0x05;
+    comp[2] = 0x00;
+    fails += self_check("lz: corrupt block refused", lz_decompress(comp, 3, back, COLD_BLOCK) < 0);
+
+    // SHA-256 (FIPS 180-2) and PBKDF2-HMAC-SHA256 (RFC 7914 style vectors)
+    unsigned char d[32];
+    sha256_t h;
+    sha256_init(&h);
+    sha256_update(&h, "abc", 3);
+    sha256_final(&h, d);
+    fails += self_check("sha256: \"abc\"", digest_is(d, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+    const char *two = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    sha256_init(&h);
+    sha256_update(&h, two, strlen(two));
+    sha256_final(&h, d);
+    fails += self_check("sha256: two blocks", digest_is(d, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"));
+    memset(raw, 'a', 1000);
+    sha256_init(&h);
+    for (int i = 0; i < 1000; i++) sha256_update(&h, raw, 1000);
+    sha256_final(&h, d);
+    fails += self_check("sha256: a million \"a\"", digest_is(d, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"));
+    pbkdf2_sha256("password", 8, (const unsigned char *)"salt", 4, 1, d);
+    fails += self_check("pbkdf2: 1 iteration", digest_is(d, "120fb6cffcf8b32c43e7225256c4f837a86548c92ccc35480805987cb70be17b"));
+    pbkdf2_sha256("password", 8, (const unsigned char *)"salt", 4, 4096, d);
+    fails += self_check("pbkdf2: 4096 iterations", digest_is(d, "c5e478d59288c841aa530db6845c4c8d962893a001ce4e11a4963873aa98134a"));
+    memset(raw, 'x', 100);
+    pbkdf2_sha256((const char *)raw, 100, (const unsigned char *)"salt", 4, 2, d);
+    fails += self_check("pbkdf2: long password", digest_is(d, "d43a18cd77bafc1a4b0c6025dbbf29c7e6d67acce6ad02a736d4a3003b6a3c26"));
+
+    // Aho-Corasick: overlapping patterns, case folding and removal
+    ac_automaton_t ac;
+    int acc[2] = { 0, 0 };
+    int ok = ac_init(&ac, 1) == 0 && ac_add(&ac, "he", 2) == 0 && ac_add(&ac, "she", 3) == 1 &&
+             ac_add(&ac, "hers", 4) == 2 && ac_add(&ac, "his", 3) == 3 && ac_compile(&ac) == 0;
+    if (ok) ac_scan(&ac, "uSHErs", 6, self_test_hit, acc);
+    fails += self_check("aho-corasick: overlapping matches", ok && acc[0] == 3 && acc[1] == 4 * 1 + 4 * 2 + 6 * 3);
+    ok = ok && ac_remove(&ac, "she", 3) == 1 && ac_compile(&ac) == 0;
+    acc[0] = acc[1] = 0;
+    if (ok) ac_scan(&ac, "ushers", 6, self_test_hit, acc);
+    fails += self_check("aho-corasick: removed pattern", ok && acc[0] == 2 && ac_add(&ac, "she", 3) == 1);
+    ac_free(&ac);
+
+    // Count-min sketch: never underestimates, and the top-k holds the heavy keys
+    sketch_t *sk = calloc(1, sizeof(sketch_t));
+    if (!sk) {
+        perror("calloc");
+        return 1;
+    }
+    char label[32];
+    static uint32_t counts[2003];
+    for (int i = 0; i < 20000; i++) {
+        int k = i % 10 == 0 ? i % 30 / 10 : 3 + i % 2000; // keys 0-2 are heavy
+        snprintf(label, sizeof(label), "key%d", k);
+        sketch_add(sk, hash_bytes(label, strlen(label)), label);
+        counts[k]++;
+    }
+    ok = 1;
+    for (int k = 0; k < 2003; k++) {
+        snprintf(label, sizeof(label), "key%d", k);
+        ok = ok && sketch_estimate(sk, hash_bytes(label, strlen(label))) >= counts[k];
+    }
+    fails += self_check("sketch: no underestimates", ok);
+    int heavy = 0;
+    for (int i = 0; i < TOP_K; i++) heavy += strcmp(sk->top[i].label, "key0") == 0 || strcmp(sk->top[i].label, "key1") == 0 ||
+                                             strcmp(sk->top[i].label, "key2") == 0;
+    fails += self_check("sketch: heavy hitters in the top-k", heavy == 3);
+    sketch_decay(sk, 1);
+    snprintf(label, sizeof(label), "key0");
+    uint32_t before = sk->top[0].count;
+    sketch_decay(sk, 40);
+    fails += self_check("sketch: decay", before > 0 && sk->top[0].count == 0 && sketch_estimate(sk, hash_bytes(label, 4)) == 0);
+    free(sk);
+
+    // IPv4 radix trie: host routes, covering prefixes and the default route
+    ip_trie_t trie = { .nodes_cap = 64, .nnodes = 1 };
+    trie.nodes = calloc(trie.nodes_cap, sizeof(trie.nodes[0]));
+    ok = trie.nodes && ip_trie_add(&trie, 0x0a000000, 8) == 0 && ip_trie_add(&trie, 0xc0a80105, 32) == 0;
+    fails += self_check("trie: prefix match", ok && ip_trie_match(&trie, 0x0a010203) && ip_trie_match(&trie, 0xc0a80105));
+    fails += self_check("trie: no match", ok && !ip_trie_match(&trie, 0x0b000001) && !ip_trie_match(&trie, 0xc0a80104));
+    ok = ok && ip_trie_add(&trie, 0, 0) == 0;
+    fails += self_check("trie: default route", ok && ip_trie_match(&trie, 0x01020304));
+    free(trie.nodes);
+
+    // Varint posting lists: small and multi-byte gaps, repeats within a message
+    term_postings_t tp;
+    memset(&tp, 0, sizeof(tp));
+    uint64_t seqs[] = { 1, 2, 2, 130, 20000, 20000, 1ULL << 40, (1ULL << 40) + 1 };
+    ok = 1;
+    for (size_t i = 0; i < sizeof(seqs) / sizeof(seqs[0]); i++) ok = ok && postings_add(&tp, seqs[i]) == 0;
+    uint64_t *dec = ok ? postings_decode(&tp) : NULL;
+    fails += self_check("postings: round trip", dec && tp.count == 6 && dec[0] == 1 && dec[1] == 2 && dec[2] == 130 &&
+                                                    dec[3] == 20000 && dec[4] == 1ULL << 40 && dec[5] == (1ULL << 40) + 1);
+    fails += self_check("postings: varint gap sizes", tp.len == 1 + 1 + 2 + 3 + 6 + 1);
+    free(dec);
+    free(tp.data);
+
+    // Export round trip through a scratch log
+    char dir[] = "/tmp/chat-selftest.XXXXXX", path[MAX_LOG_PATH], rows[MAX_LOG_PATH];
+    int made = mkdtemp(dir) != NULL;
+    ok = made;
+    if (ok) {
+        snprintf(log_dir, sizeof(log_dir), "%s", dir);
+        snprintf(path, sizeof(path), "%s/export.col", dir);
+        snprintf(rows, sizeof(rows), "%s/rows.txt", dir);
+        if (!history_ring) history_ring = calloc(HISTORY_RING, sizeof(history_entry_t));
+        ok = history_ring && log_open() == 0;
+    }
+    static const char *senders[] = { "alice", "bob", "carol" };
+    frame_t *frames[64];
+    int nframes = 0;
+    for (int i = 0; ok && i < 64; i++) {
+        char text[64];
+        snprintf(text, sizeof(text), "message %d %s", i, i % 5 ? "hello there" : "");
+        if ((frames[nframes] = frame_format(senders[i % 3], text)) != NULL) nframes++;
+    }
+    ok = ok && nframes == 64;
+    if (ok) log_frames(frames, nframes);
+    for (int i = 0; i < nframes; i++) frame_put(frames[i]);
+    if (ok) {
+        export_path = path;
+        read_export_path = path;
+        ok = export_main() == 0;
+    }
+
+    // The reader prints rows on stdout, so send them to a file and compare
+    int saved = ok ? dup(STDOUT_FILENO) : -1, fd = saved >= 0 ? open(rows, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd >= 0) {
+        fflush(stdout);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+        ok = read_export_main() == 0;
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+    } else {
+        ok = 0;
+    }
+    if (saved >= 0) close(saved);
+    FILE *fp = ok ? fopen(rows, "r") : NULL;
+    int nrows = 0;
+    char line[256];
+    while (fp && fgets(line, sizeof(line), fp)) {
+        char want[128];
+        snprintf(want, sizeof(want), "%s\t0\tmessage %d %s\n", senders[nrows % 3], nrows, nrows % 5 ? "hello there" : "");
+        char *sender = strchr(line, '\t');
+        sender = sender ? strchr(sender + 1, '\t') : NULL; // skip seq and timestamp
+        ok = ok && sender && strcmp(sender + 1, want) == 0 && (uint64_t)atoll(line) == (uint64_t)nrows + 1;
+        nrows++;
+    }
+    if (fp) fclose(fp);
+    fails += self_check("export: round trip", ok && nrows == 64);
+
+    // Remove the scratch directory
+    DIR *dp = made ? opendir(dir) : NULL;
+    struct dirent *e;
+    while (dp && (e = readdir(dp)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    if (dp) {
+        closedir(dp);
+        rmdir(dir);
+    }
+
+    free(raw);
+    free(comp);
+    free(back);
+    printf("%s: %d check%s failed\n", fails ? "FAIL" : "ok", fails, fails == 1 ? "" : "s");
+    return fails ? 1 : 0;
+}
+
+/**
+ * @brief Prints command line usage.
+ * 
+ * @param prog Program name.
+ */
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [port] [options]\n", prog);
+    fprintf(stderr, "  --per-core[=N]                 one shard per CPU, or N: each accepts (SO_REUSEPORT), queues,\n");
+    fprintf(stderr, "                                 sequences and fans out its own clients' messages\n");
+    fprintf(stderr, "  --cpus=LIST                    pin shards (with their clients) to CPUs in order (e.g. 0,2,4-7)\n");
+    fprintf(stderr, "  --huge-pages[=explicit|thp|off] back buffer pools with huge pages\n");
+    fprintf(stderr, "  --pool-objects=N               objects per buffer pool\n");
+    fprintf(stderr, "  --spin-us[=US]                 spin for work before parking\n");
+    fprintf(stderr, "  --busy-poll[=US]               SO_BUSY_POLL on client sockets\n");
+    fprintf(stderr, "  --batch-budget-us=US           coalesce broadcasts under load, holding messages at most US\n");
+    fprintf(stderr, "  --tcp-profile=latency|throughput|default  client socket tuning\n");
+    fprintf(stderr, "  --notsent-lowat=BYTES          cap on unsent data queued per client socket\n");
+    fprintf(stderr, "  --zerocopy-min=BYTES           send writes of at least BYTES with MSG_ZEROCOPY\n");
+    fprintf(stderr, "  --log-dir=DIR                  persist broadcasts to log segments in DIR\n");
+    fprintf(stderr, "  --segment-bytes=BYTES          seal log segments at this size\n");
+    fprintf(stderr, "  --backfill=N                   replay the last N logged messages at login\n");
+    fprintf(stderr, "  --blob-dir=DIR                 accept BLOB uploads into DIR and serve them with GET\n");
+    fprintf(stderr, "  --blob-max=BYTES               largest accepted upload\n");
+    fprintf(stderr, "  --mentions                     send MENTION notifications to @mentioned users\n");
+    fprintf(stderr, "  --filter=FILE                  filter banned terms listed in FILE (reloaded on SIGHUP)\n");
+    fprintf(stderr, "  --filter-action=mask|drop      mask banned terms or drop the message\n");
+    fprintf(stderr, "  --spam-threshold=N             drop copies of a text beyond N per window, throttle repeat senders\n");
+    fprintf(stderr, "  --spam-window=SEC              length of a spam detection window\n");
+    fprintf(stderr, "  --blocklist=FILE               refuse addresses and CIDR prefixes listed in FILE (reloaded on SIGHUP)\n");
+    fprintf(stderr, "  --max-per-ip=N                 concurrent connections allowed per address\n");
+    fprintf(stderr, "  --password-hash=HASH           server password in stored form (see --hash-password)\n");
+    fprintf(stderr, "  --accounts=FILE                require LOGIN:<user>:<password> for accounts listed in FILE\n");
+    fprintf(stderr, "  --account-store=FILE           look up LOGIN:<user>:<password> accounts in a mapped store file\n");
+    fprintf(stderr, "  --set-account=USER             read a password on stdin, save USER in the account store and exit\n");
+    fprintf(stderr, "  --del-account=USER             delete USER from the account store and exit\n");
+    fprintf(stderr, "  --auth-workers=N               threads verifying passwords\n");
+    fprintf(stderr, "  --presence-ms=MS               window over which typing/status updates are coalesced\n");
+    fprintf(stderr, "  --search                       index the message log for SEARCH (needs --log-dir)\n");
+    fprintf(stderr, "  --compact[=N]                  compress sealed log segments, keeping the newest N uncompressed (default 1)\n");
+    fprintf(stderr, "  --react-ms=MS                  window over which reaction counts are aggregated\n");
+    fprintf(stderr, "  --mailbox-dir=DIR              store DMs to offline users in DIR, delivered at login\n");
+    fprintf(stderr, "  --mailbox-quota=BYTES          largest mailbox per user\n");
+    fprintf(stderr, "  --mailbox-total=BYTES          largest total of all mailboxes\n");
+    fprintf(stderr, "  --hash-password                read a password on stdin, print its stored form and exit\n");
+    fprintf(stderr, "  --export=FILE                  write the messages in --log-dir to a columnar FILE and exit\n");
+    fprintf(stderr, "  --read-export=FILE             check a columnar FILE, print its rows and exit\n");
+    fprintf(stderr, "  --self-test                    check the codec, hashes, matchers, sketch, trie, postings and export\n");
+}
+
+/**
+ * @brief Parses the command line: an optional port followed by --name[=value] options.
+ * 
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @param port Receives the listening port.
+ */
+void parse_args(int argc, char **argv, int *port) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *v;
+        if (strncmp(arg, "--", 2) != 0) {
+            *port = atoi(arg);
+        } else if ((v = option_value(arg, "--per-core")) != NULL) {
+            // One shard per online CPU unless a count is given
+            per_core_mode = 1;
+            num_shards = *v ? atoi(v) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (num_shards < 1) num_shards = 1;
+            if (num_shards > MAX_SHARDS) num_shards = MAX_SHARDS;
+        } else if ((v = option_value(arg, "--cpus")) != NULL) {
+            // Pin shard i (its acceptor, dispatcher and clients) to the i-th CPU, wrapping around
+            if (parse_cpu_list(v) < 0) {
+                fprintf(stderr, "Invalid CPU list: %s\n", v);
+                exit(1);
+            }
+        } else if ((v = option_value(arg, "--huge-pages")) != NULL) {
+            // Back buffer pools with explicit (hugetlbfs) or transparent huge pages
+            if (strcmp(v, "explicit") == 0) huge_page_mode = HUGE_EXPLICIT;
+            else if (strcmp(v, "thp") == 0 || *v == '\0') huge_page_mode = HUGE_THP;
+            else if (strcmp(v, "off") == 0) huge_page_mode = HUGE_OFF;
+            else {
+                fprintf(stderr, "Invalid --huge-pages mode: %s (explicit, thp or off)\n", v);
+                exit(1);
+            }
+        } else if ((v = option_value(arg, "--pool-objects")) != NULL) {
+            pool_objects = atoi(v);
+            if (pool_objects < 0) pool_objects = 0;
+        } else if ((v = option_value(arg, "--spin-us")) != NULL) {
+            // Spin this long for new work before parking the shard dispatchers
+            spin_usec = *v ? atoi(v) : 50;
+            if (spin_usec < 0) spin_usec = 0;
+        } else if ((v = option_value(arg, "--busy-poll")) != NULL) {
+            // Busy-poll the device queue on client sockets (SO_BUSY_POLL, microseconds)
+            busy_poll_usec = *v ? atoi(v) : 50;
+            if (busy_poll_usec < 0) busy_poll_usec = 0;
+        } else if ((v = option_value(arg, "--batch-budget-us")) != NULL) {
+            // Latency budget for adaptive micro-batching
+            batch_budget_usec = atoi(v);
+            if (batch_budget_usec < 0) batch_budget_usec = 0;
+        } else if ((v = option_value(arg, "--tcp-profile")) != NULL) {
+            if (strcmp(v, "latency") == 0) tcp_profile = TCP_PROFILE_LATENCY;
+            else if (strcmp(v, "throughput") == 0) tcp_profile = TCP_PROFILE_THROUGHPUT;
+            else if (strcmp(v, "default") == 0) tcp_profile = TCP_PROFILE_DEFAULT;
+            else {
+                fprintf(stderr, "Invalid --tcp-profile: %s (latency, throughput or default)\n", v);
+                exit(1);
+            }
+        } else if ((v = option_value(arg, "--notsent-lowat")) != NULL) {
+            notsent_lowat = atoi(v);
+            if (notsent_lowat < 0) notsent_lowat = 0;
+        } else if ((v = option_value(arg, "--zerocopy-min")) != NULL) {
+            long min = atol(v);
+            zerocopy_min = min > 0 ? (size_t)min : 0;
+        } else if ((v = option_value(arg, "--log-dir")) != NULL) {
+            snprintf(log_dir, sizeof(log_dir), "%s", v);
+        } else if ((v = option_value(arg, "--segment-bytes")) != NULL) {
+            long bytes = atol(v);
+            log_segment_bytes = bytes > 0 ? (size_t)bytes : LOG_SEGMENT_BYTES;
+        } else if ((v = option_value(arg, "--backfill")) != NULL) {
+            backfill_count = atoi(v);
+            if (backfill_count < 0) backfill_count = 0;
+        } else if ((v = option_value(arg, "--blob-dir")) != NULL) {
+            snprintf(blob_dir, sizeof(blob_dir), "%s", v);
+        } else if ((v = option_value(arg, "--blob-max")) != NULL) {
+            blob_max = atoll(v);
+            if (blob_max < 0) blob_max = 0;
+        } else if ((v = option_value(arg, "--compact")) != NULL) {
+            compact_keep = *v ? atoi(v) : 1;
+            if (compact_keep < 0) compact_keep = 0;
+        } else if (strcmp(arg, "--search") == 0) {
+            search_enabled = 1;
+        } else if (strcmp(arg, "--mentions") == 0) {
+            mentions_enabled = 1;
+        } else if ((v = option_value(arg, "--filter")) != NULL) {
+            snprintf(filter_path, sizeof(filter_path), "%s", v);
+        } else if ((v = option_value(arg, "--filter-action")) != NULL) {
+            if (strcmp(v, "mask") == 0) filter_action = FILTER_MASK;
+            else if (strcmp(v, "drop") == 0) filter_action = FILTER_DROP;
+            else {
+                fprintf(stderr, "Invalid --filter-action: %s (mask or drop)\n", v);
+                exit(1);
+            }
+        } else if ((v = option_value(arg, "--spam-threshold")) != NULL) {
+            spam_threshold = atoi(v);
+            if (spam_threshold < 0) spam_threshold = 0;
+        } else if ((v = option_value(arg, "--spam-window")) != NULL) {
+            spam_window_sec = atoi(v);
+            if (spam_window_sec < 1) spam_window_sec = DEFAULT_SPAM_WINDOW;
+        } else if ((v = option_value(arg, "--blocklist")) != NULL) {
+            snprintf(blocklist_path, sizeof(blocklist_path), "%s", v);
+        } else if ((v = option_value(arg, "--max-per-ip")) != NULL) {
+            max_per_ip = atoi(v);
+            if (max_per_ip < 0) max_per_ip = 0;
+        } else if ((v = option_value(arg, "--password-hash")) != NULL) {
+            snprintf(password_hash, sizeof(password_hash), "%s", v);
+        } else if ((v = option_value(arg, "--accounts")) != NULL) {
+            snprintf(accounts_path, sizeof(accounts_path), "%s", v);
+        } else if ((v = option_value(arg, "--account-store")) != NULL) {
+            snprintf(store_path, sizeof(store_path), "%s", v);
+        } else if ((v = option_value(arg, "--set-account")) != NULL) {
+            store_admin_user = v;
+            store_admin_delete = 0;
+        } else if ((v = option_value(arg, "--del-account")) != NULL) {
+            store_admin_user = v;
+            store_admin_delete = 1;
+        } else if ((v = option_value(arg, "--react-ms")) != NULL) {
+            react_ms = atoi(v);
+            if (react_ms < 10) react_ms = DEFAULT_REACT_MS;
+        } else if ((v = option_value(arg, "--presence-ms")) != NULL) {
+            presence_ms = atoi(v);
+            if (presence_ms < 10) presence_ms = DEFAULT_PRESENCE_MS;
+        } else if ((v = option_value(arg, "--mailbox-dir")) != NULL) {
+            snprintf(mailbox_dir, sizeof(mailbox_dir), "%s", v);
+        } else if ((v = option_value(arg, "--mailbox-quota")) != NULL) {
+            mailbox_quota = atol(v);
+            if (mailbox_quota < 0) mailbox_quota = 0;
+        } else if ((v = option_value(arg, "--mailbox-total")) != NULL) {
+            mailbox_total = atol(v);
+            if (mailbox_total < 0) mailbox_total = 0;
+        } else if ((v = option_value(arg, "--auth-workers")) != NULL) {
+            auth_workers = atoi(v);
+            if (auth_workers < 1) auth_workers = 1;
+        } else if ((v = option_value(arg, "--export")) != NULL) {
+            export_path = v;
+            log_readonly = 1;
+        } else if ((v = option_value(arg, "--read-export")) != NULL) {
+            read_export_path = v;
+        } else if (strcmp(arg, "--hash-password") == 0) {
+            exit(hash_password_main());
+        } else if (strcmp(arg, "--self-test") == 0) {
+            exit(self_test_main());
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+}
 
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
+/**
+ * @brief Opens a shard's listening socket.
+ * 
+ * @details With several shards every one binds the same port with
+ * SO_REUSEPORT, and the kernel spreads new connections across them, so no
+ * accept queue is shared between CPUs.
+ * 
+ * @param port The port to listen on.
+ * @return int The listening socket, or -1 on error.
+ */
+int open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
         perror("socket");
-        exit(1);
+        return -1;
     }
 
     int opt = 1; // Enable address reuse
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (num_shards > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        close(fd);
+        return -1;
+    }
 
     struct sockaddr_in srv;
     memset(&srv, 0, sizeof(srv));
@@ -498,69 +8240,203 @@ int main(int argc, char **argv) {
 
     // Check to see if the binding was successful
 
-    if (bind(server_sock, (struct sockaddr*)&srv, sizeof(srv)) < 0) {
+    if (bind(fd, (struct sockaddr*)&srv, sizeof(srv)) < 0) {
         perror("bind");
-        close(server_sock);
-        exit(1);
+        close(fd);
+        return -1;
     }
 
-    if (listen(server_sock, 16) < 0) {
+    if (listen(fd, 16) < 0) {
         perror("listen");
-        close(server_sock);
-        exit(1);
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    printf("Server listening on port %d\n", port);
-
-    pthread_t dispatcher; // Dispatcher thread, which will handle message broadcasting
-    pthread_create(&dispatcher, NULL, dispatcher_thread, NULL); // Start dispatcher thread
-
-    // Accept loop for incoming client connections
+/**
+ * @brief Acceptor thread function: accepts connections on a shard's listener.
+ * 
+ * @details Every connection accepted here joins the shard, so its client
+ * thread, its messages and its frames all stay on the shard's CPU. Shard 0's
+ * acceptor runs on the main thread.
+ * 
+ * @param arg Pointer to the shard.
+ */
+void *acceptor_thread(void *arg) {
+    shard_t *s = (shard_t *)arg;
     while (server_running) {
         struct sockaddr_in cliaddr; // Client address structure
         socklen_t addrlen = sizeof(cliaddr);
-        int clientfd = accept(server_sock, (struct sockaddr*)&cliaddr, &addrlen);
+        int clientfd = accept(s->listen_fd, (struct sockaddr*)&cliaddr, &addrlen);
         if (clientfd < 0) {
-            if (errno == EINTR) continue;
-            perror("accept");
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (server_running) perror("accept");
             break;
         }
 
-        // Create client structure
-        client_t *c = calloc(1, sizeof(client_t));
+        // Refuse blocked and over-limit addresses before spending anything on them
+        uint32_t addr = ntohl(cliaddr.sin_addr.s_addr);
+        if (!admit_connection(addr)) {
+            close(clientfd);
+            continue;
+        }
+
+        // Create client structure (cache-line aligned so neighbouring clients never share a line)
+        client_t *c = aligned_alloc(CACHE_LINE, (sizeof(client_t) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
         if (!c) {
+            if (max_per_ip > 0) ip_release(addr);
             close(clientfd);
             continue;
         }
+        memset(c, 0, sizeof(*c));
+        c->addr = addr;
+
+        apply_tcp_profile(clientfd);
+        if (zerocopy_min > 0) {
+            int one = 1;
+            c->zerocopy = setsockopt(clientfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        }
+        if (busy_poll_usec > 0 &&
+            setsockopt(clientfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec, sizeof(busy_poll_usec)) < 0) {
+            // Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN; warn once and carry on
+            static atomic_int warned = 0;
+            if (!atomic_exchange(&warned, 1)) perror("setsockopt(SO_BUSY_POLL)");
+        }
         c->sockfd = clientfd;
         c->logged_in = 0;
         c->next = NULL;
+        pthread_mutex_init(&c->send_lock, NULL);
+        pthread_mutex_init(&c->hold_lock, NULL);
+        c->shard = s;
         add_client(c);
 
+        // Client threads run next to their shard so the shard's data stays local
         pthread_t tid;
-        if (pthread_create(&tid, NULL, client_thread, c) != 0) {
+        pthread_attr_t attr;
+        thread_attr_for_cpu(&attr, s->cpu);
+        int rc = pthread_create(&tid, &attr, client_thread, c);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
             perror("pthread_create");
             close_and_free_client(c);
             continue;
         }
         pthread_detach(tid);
     }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int port = DEFAULT_PORT;
+    parse_args(argc, argv, &port);
+    if (store_admin_user) return account_admin_main();
+    if (read_export_path) return read_export_main();
+    if (export_path && !log_dir[0]) {
+        fprintf(stderr, "--export needs --log-dir\n");
+        exit(1);
+    }
+
+    history_ring = calloc(HISTORY_RING, sizeof(history_entry_t));
+    if (!history_ring) {
+        perror("calloc");
+        exit(1);
+    }
+    if (log_dir[0] && log_open() < 0) exit(1);
+    if (export_path) return export_main();
+    if ((search_enabled || compact_keep >= 0) && !log_dir[0]) {
+        fprintf(stderr, "--search and --compact need --log-dir\n");
+        exit(1);
+    }
+    if (blob_dir[0] && blob_open() < 0) exit(1);
+    if (mailbox_open() < 0) exit(1);
+    if (mentions_enabled && ac_init(&mention_ac, 0) < 0) exit(1);
+
+    // Create client shards
+    for (int i = 0; i < num_shards; i++) {
+        shards[i] = shard_create(i);
+        if (!shards[i]) {
+            perror("shard_create");
+            exit(1);
+        }
+    }
+
+    signal(SIGINT, sigint_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGHUP is only handled by the reload thread; every thread created below inherits the mask
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    filter_reload();
+    if (filter_path[0] && !atomic_load(&filter_pending)) exit(1);
+    blocklist_reload();
+    if (blocklist_path[0] && !atomic_load(&blocklist_pending)) exit(1);
+    if (auth_init() < 0) exit(1);
+    pthread_t reloader;
+    pthread_create(&reloader, NULL, reload_thread, NULL);
+
+    for (int i = 0; i < num_shards; i++) {
+        shards[i]->listen_fd = open_listener(port);
+        if (shards[i]->listen_fd < 0) exit(1);
+    }
+
+    printf("Server listening on port %d\n", port);
+    printf("Buffer pools: %d objects each, %s pages\n", pool_objects, shards[0]->frame_pool.backing);
+    if (per_core_mode) {
+        printf("Per-core mode: %d shards, each accepting, sequencing and fanning out its own clients\n", num_shards);
+    }
+
+    // Every shard gets a dispatcher, and all but shard 0 an acceptor thread, next to its clients
+    for (int i = 0; i < num_shards; i++) {
+        pthread_attr_t attr;
+        thread_attr_for_cpu(&attr, shards[i]->cpu);
+        pthread_create(&shards[i]->tid, &attr, dispatcher_thread, shards[i]);
+        if (i > 0) pthread_create(&shards[i]->acceptor, &attr, acceptor_thread, shards[i]);
+        pthread_attr_destroy(&attr);
+    }
+
+    pthread_t ticker, indexer, compactor;
+    pthread_create(&ticker, NULL, ticker_thread, NULL);
+    if (search_enabled) pthread_create(&indexer, NULL, indexer_thread, NULL);
+    if (compact_keep >= 0) pthread_create(&compactor, NULL, compactor_thread, NULL);
 
-    // Shutdown: close all clients
-    pthread_mutex_lock(&clients_mutex);
-    client_t *it = clients_head;
-    while (it) {
-        close(it->sockfd);
-        it = it->next;
+    // Accept loop for shard 0's incoming client connections
+    acceptor_thread(shards[0]);
+    for (int i = 1; i < num_shards; i++) pthread_join(shards[i]->acceptor, NULL);
+    for (int i = 0; i < num_shards; i++) close(shards[i]->listen_fd);
+
+    // Shutdown: disconnect all clients (their threads close the sockets)
+    for (int i = 0; i < num_shards; i++) {
+        pthread_mutex_lock(&shards[i]->clients_mutex);
+        client_t *it = shards[i]->clients_head;
+        while (it) {
+            shutdown(it->sockfd, SHUT_RDWR);
+            it = it->next;
+        }
+        pthread_mutex_unlock(&shards[i]->clients_mutex);
     }
-    pthread_mutex_unlock(&clients_mutex);
 
-    // Wake dispatcher to exit
-    pthread_mutex_lock(&msg_mutex);
-    pthread_cond_signal(&msg_cond);
-    pthread_mutex_unlock(&msg_mutex);
+    // Wake the dispatchers to exit
+    for (int i = 0; i < num_shards; i++) shard_wake(shards[i]);
 
-    pthread_join(dispatcher, NULL);
+    pthread_join(ticker, NULL);
+    if (search_enabled) pthread_join(indexer, NULL);
+    if (compact_keep >= 0) pthread_join(compactor, NULL);
+    for (int i = 0; i < num_shards; i++) pthread_join(shards[i]->tid, NULL);
+    auth_shutdown();
+
+    pthread_kill(reloader, SIGHUP);
+    pthread_join(reloader, NULL);
+
+    // Release frames handed over after their destination's dispatcher stopped
+    for (int i = 0; i < num_shards && per_core_mode; i++) {
+        for (int j = 0; j < num_shards && shards[i]->rings; j++) {
+            frame_t *f;
+            while ((f = ring_pop(&shards[i]->rings[j])) != NULL) frame_put(f);
+        }
+    }
 
     printf("Server shutting down\n");
     return 0;